@@ -2,306 +2,751 @@
 #define ASYNC_HH 1
 
 #include <stdlib.h>
-#include <queue>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+
+#include "futex.hh"
+#include "future.hh"
+#include "hash.hh"
+#include "histogram.hh"
+#include "locks.hh"
 
 #define DEFAULT_MAX_DRAIN 1000000
 
+// Operation records are allocated this many at a time, up to this
+// many chunks (past which extras come and go with new and delete).
+#define ASYNC_POOL_CHUNK 256
+#define ASYNC_POOL_MAX_CHUNKS 4096
+
+// A pooled record gives up its buffers rather than hold on to more
+// than this many bytes of them while it's free.
+#define ASYNC_POOL_MAX_BYTES 65536
+
 namespace kvtest {
 
     /**
-     * Abstract base class for all asynchronous operations.
+     * What an AsyncOperation does.
+     */
+    enum async_op_t {
+        ASYNC_NOOP,
+        ASYNC_RESET,
+        ASYNC_SHUTDOWN,
+        ASYNC_SET,
+        ASYNC_SET_CSTR,
+        ASYNC_SET_TTL,
+        ASYNC_GET,
+        ASYNC_GETS,
+        ASYNC_DEL,
+        ASYNC_MUTATE,
+        ASYNC_SET_MULTI,
+        ASYNC_GET_MULTI,
+        ASYNC_DEL_MULTI
+    };
+
+    /**
+     * An operation on its way through an AsyncQueue.
+     *
+     * One record serves for every kind of operation, tagged with which
+     * it is, and the executor switches on the tag.  Records come from
+     * an AsyncOpPool and go back once executed, emptied but keeping
+     * their buffers (up to ASYNC_POOL_MAX_BYTES), so once the pool has
+     * warmed up queueing an operation allocates nothing: keys and
+     * values are copied into space the record already has.
+     *
+     * When commits are pipelined, the record is also the callback its
+     * operation runs with, holding on to the result until the batch
+     * has committed and fire() passes it on.
      */
-    class AsyncOperation {
+    class AsyncOperation : public Callback<bool>,
+                           public Callback<GetValue>,
+                           public Callback<MutationResult>,
+                           public Callback<std::vector<bool> >,
+                           public Callback<std::vector<GetValue> > {
     public:
 
-        AsyncOperation() {}
+        AsyncOperation() : type(ASYNC_NOOP), cvalue(NULL), ttl(0),
+                           boolCb(NULL), completions(NULL),
+                           superseded(false),
+                           boolResult(false), next(NULL),
+                           nextFree(NO_SLOT), slot(NO_SLOT) {}
 
-        virtual ~AsyncOperation() {}
+        /**
+         * The next operation in a drained batch (or NULL).
+         */
+        AsyncOperation *getNext() {
+            return next;
+        }
 
         /**
-         * Perform this operation.
+         * Bytes of keys and values this carries.
          */
-        virtual void execute(KVStore *tut) {
-            throw std::runtime_error("not implemented");
+        size_t bytes() {
+            size_t rv = key.length();
+            switch (type) {
+            case ASYNC_SET:
+            case ASYNC_SET_TTL:
+                rv += value.length();
+                break;
+            case ASYNC_SET_CSTR:
+                rv += strlen(cvalue);
+                break;
+            case ASYNC_MUTATE:
+                rv += m.value.length();
+                break;
+            case ASYNC_SET_MULTI:
+                for (size_t i = 0; i < items.size(); i++) {
+                    rv += items[i].key.length() + items[i].value.length();
+                }
+                break;
+            case ASYNC_GET_MULTI:
+            case ASYNC_DEL_MULTI:
+                for (size_t i = 0; i < keys.size(); i++) {
+                    rv += keys[i].length();
+                }
+                break;
+            default:
+                break;
+            }
+            return rv;
+        }
+
+        void callback(bool &v) {
+            boolResult = v;
+            completions->complete();
         }
 
+        void callback(GetValue &v) {
+            getResult = v;
+            completions->complete();
+        }
+
+        void callback(MutationResult &v) {
+            mutationResult = v;
+            completions->complete();
+        }
+
+        void callback(std::vector<bool> &v) {
+            boolsResult = v;
+            completions->complete();
+        }
+
+        void callback(std::vector<GetValue> &v) {
+            valuesResult = v;
+            completions->complete();
+        }
+
+        /**
+         * Hand the result held on to to the operation's callback.
+         */
+        void fire() {
+            switch (type) {
+            case ASYNC_GET:
+            case ASYNC_GETS:
+                getCb->callback(getResult);
+                break;
+            case ASYNC_MUTATE:
+                mutationCb->callback(mutationResult);
+                break;
+            case ASYNC_SET_MULTI:
+            case ASYNC_DEL_MULTI:
+                boolsCb->callback(boolsResult);
+                break;
+            case ASYNC_GET_MULTI:
+                valuesCb->callback(valuesResult);
+                break;
+            case ASYNC_SHUTDOWN:
+                break;
+            default:
+                boolCb->callback(boolResult);
+                break;
+            }
+        }
+
+        async_op_t               type;
+        std::string              key;
+        // A copy of what's set.
+        std::string              value;
+        // What's set with a C string (not copied, as it never was).
+        const char              *cvalue;
+        uint32_t                 ttl;
+        Mutation                 m;
+        std::vector<KeyValue>    items;
+        std::vector<std::string> keys;
+        // Which of these is used depends on the type.
+        union {
+            Callback<bool>                   *boolCb;
+            Callback<GetValue>               *getCb;
+            Callback<MutationResult>         *mutationCb;
+            Callback<std::vector<bool> >     *boolsCb;
+            Callback<std::vector<GetValue> > *valuesCb;
+        };
+        // Counts the result in once it's held on to.
+        FutureGroup             *completions;
+
+        // Left out of its batch, as a later set of the key replaces
+        // it (taking that set's result).
+        bool                     superseded;
+        // Results held on to until the batch commits.
+        bool                     boolResult;
+        GetValue                 getResult;
+        MutationResult           mutationResult;
+        std::vector<bool>        boolsResult;
+        std::vector<GetValue>    valuesResult;
+
+        // Not from a pool's chunks.
+        static const uint32_t NO_SLOT = 0xffffffff;
+
     private:
+        friend class AsyncQueue;
+        friend class AsyncOpPool;
+
+        // The link while queued or drained.
+        AsyncOperation *next;
+        // The link while free, and where this is in its pool.
+        uint32_t        nextFree;
+        uint32_t        slot;
+
         DISALLOW_COPY_AND_ASSIGN(AsyncOperation);
     };
 
     /**
-     * Operation sent to an async queue to tell it to shut down.
+     * Recycles operation records.
+     *
+     * Any thread may get a record, and any may put them back.  Free
+     * records are kept on a lock-free stack of their slot numbers,
+     * whose top carries a tag bumped on every change so a thread that
+     * was held up between reading the top and swapping it can't put
+     * back a stale link.  Records are never freed until the pool is,
+     * so reading one that's just been taken by another thread is
+     * harmless.
      */
-    class AsyncShutdownOperation : public AsyncOperation {
+    class AsyncOpPool {
     public:
-        void execute(KVStore *tut) {
-            throw this;
-        }
-    };
 
-    /**
-     * Abstract base class for asynchronous operations with boolean
-     * callbacks.
-     */
-    class BoolOperation : public AsyncOperation {
-    public:
+        AsyncOpPool() : top(AsyncOperation::NO_SLOT), nchunks(0) {
+            if (pthread_mutex_init(&mutex, NULL) != 0) {
+                throw std::runtime_error("Failed to create mutex.");
+            }
+        }
 
         /**
-         * Store the callback.
+         * Free every record (none may be in use).
          */
-        BoolOperation(Callback<bool> *c) {
-            cb = c;
+        ~AsyncOpPool() {
+            for (uint32_t i = 0; i < nchunks; i++) {
+                delete[] chunks[i];
+            }
+            pthread_mutex_destroy(&mutex);
         }
 
-    protected:
         /**
-         * The callback to be fired during execute().
+         * Get a record to fill in.
          */
-        Callback<bool> *cb;
-    };
-
-    /**
-     * Async interface to reset.
-     */
-    class ResetOperation : public BoolOperation {
-    public:
-        ResetOperation(Callback<bool> *c) : BoolOperation(c) {}
+        AsyncOperation *get() {
+            uint64_t t, n;
+            AsyncOperation *op;
+            do {
+                t = top;
+                uint32_t i = (uint32_t)t;
+                if (i == AsyncOperation::NO_SLOT) {
+                    return grow();
+                }
+                op = at(i);
+                n = (((t >> 32) + 1) << 32) | op->nextFree;
+            } while (!__sync_bool_compare_and_swap(&top, t, n));
+            return op;
+        }
 
         /**
-         * Call reset, callback(true).
+         * Give back a chain of records linked through getNext() (as
+         * drained from a queue).
          */
-        void execute(KVStore *tut) {
-            tut->reset();
-            bool t = true;
-            cb->callback(t);
+        void put(AsyncOperation *ops) {
+            AsyncOperation *first = NULL, *last = NULL;
+            while (ops != NULL) {
+                AsyncOperation *op = ops;
+                ops = op->next;
+                if (op->slot == AsyncOperation::NO_SLOT) {
+                    delete op;
+                    continue;
+                }
+                trim(op);
+                if (first == NULL) {
+                    first = op;
+                } else {
+                    last->nextFree = op->slot;
+                }
+                last = op;
+            }
+            if (first == NULL) {
+                return;
+            }
+            uint64_t t, n;
+            do {
+                t = top;
+                last->nextFree = (uint32_t)t;
+                n = (((t >> 32) + 1) << 32) | first->slot;
+            } while (!__sync_bool_compare_and_swap(&top, t, n));
         }
-    };
 
-    /**
-     * A NOOP that ensures it runs on the async's thread.
-     */
-    class NOOPOperation : public BoolOperation {
-    public:
-        NOOPOperation(Callback<bool> *c) : BoolOperation(c) {}
+    private:
+
+        AsyncOperation *at(uint32_t i) {
+            return &chunks[i / ASYNC_POOL_CHUNK][i % ASYNC_POOL_CHUNK];
+        }
 
         /**
-         * callback(true).
+         * Add a chunk of records, returning one and freeing the rest.
          */
-        void execute(KVStore *tut) {
-            bool rv = true;
-            cb->callback(rv);
+        AsyncOperation *grow() {
+            LockHolder lh(&mutex);
+            if (nchunks == ASYNC_POOL_MAX_CHUNKS) {
+                return new AsyncOperation();
+            }
+            AsyncOperation *chunk = new AsyncOperation[ASYNC_POOL_CHUNK];
+            uint32_t base = nchunks * ASYNC_POOL_CHUNK;
+            for (uint32_t i = 0; i < ASYNC_POOL_CHUNK; i++) {
+                chunk[i].slot = base + i;
+                chunk[i].next = i + 1 < ASYNC_POOL_CHUNK ? &chunk[i + 1] : NULL;
+            }
+            // Published before any of its slots can be found on the
+            // stack (put's swap is a full barrier).
+            chunks[nchunks++] = chunk;
+            lh.unlock();
+            put(chunk[0].next);
+            chunk[0].next = NULL;
+            return &chunk[0];
         }
-    };
-
-    /**
-     * Async set operation.
-     */
-    class SetOperation : public BoolOperation {
-    public:
 
         /**
-         * Create a set with the given key, value and callback.
+         * Empty a record of what its operation carried, and let go of
+         * its buffers if they add up to more than a free record should
+         * keep.
          */
-        SetOperation(std::string &k, std::string &v,
-                     Callback<bool> *c) : BoolOperation(c) {
-            key = k;
-            value = v;
+        static void trim(AsyncOperation *op) {
+            op->key.clear();
+            switch (op->type) {
+            case ASYNC_SET:
+            case ASYNC_SET_TTL:
+                op->value.clear();
+                break;
+            case ASYNC_SET_CSTR:
+                op->cvalue = NULL;
+                break;
+            case ASYNC_GET:
+            case ASYNC_GETS:
+                op->getResult.value.clear();
+                break;
+            case ASYNC_MUTATE:
+                op->m.value.clear();
+                break;
+            case ASYNC_SET_MULTI:
+                op->items.clear();
+                op->boolsResult.clear();
+                break;
+            case ASYNC_GET_MULTI:
+                op->keys.clear();
+                op->valuesResult.clear();
+                break;
+            case ASYNC_DEL_MULTI:
+                op->keys.clear();
+                op->boolsResult.clear();
+                break;
+            default:
+                break;
+            }
+            if (retained(op) > ASYNC_POOL_MAX_BYTES) {
+                std::string().swap(op->key);
+                std::string().swap(op->value);
+                std::string().swap(op->m.value);
+                std::string().swap(op->getResult.value);
+                std::vector<KeyValue>().swap(op->items);
+                std::vector<std::string>().swap(op->keys);
+                std::vector<GetValue>().swap(op->valuesResult);
+                std::vector<bool>().swap(op->boolsResult);
+            }
         }
 
         /**
-         * Call the underlying set method.
+         * Bytes of buffer an emptied record still holds.
          */
-        void execute(KVStore *tut) {
-            tut->set(key, value, *cb);
+        static size_t retained(AsyncOperation *op) {
+            return op->key.capacity() + op->value.capacity()
+                + op->m.value.capacity() + op->getResult.value.capacity()
+                + op->items.capacity() * sizeof(KeyValue)
+                + op->keys.capacity() * sizeof(std::string)
+                + op->valuesResult.capacity() * sizeof(GetValue)
+                + op->boolsResult.capacity() / 8;
         }
-    private:
-        std::string     key;
-        std::string     value;
+
+        // The tag in the high half, the top slot in the low.
+        volatile uint64_t  top;
+        pthread_mutex_t    mutex;
+        uint32_t           nchunks;
+        AsyncOperation    *chunks[ASYNC_POOL_MAX_CHUNKS];
+
+        DISALLOW_COPY_AND_ASSIGN(AsyncOpPool);
+    };
+
+    /**
+     * How an AsyncQueue groups operations into batches (each run in
+     * one transaction).
+     *
+     * A batch holds at most maxItems operations and, past its first,
+     * at most maxBytes bytes of keys and values (zero is no limit).
+     * With fewer than minItems waiting, the executor lingers up to
+     * maxLingerUsec for more before starting on them.
+     *
+     * Given a targetCommitUsec, the item cap and the linger adapt to
+     * how long commits take: the cap starts at one, shrinks by a
+     * quarter after any commit slower than the target and grows by an
+     * eighth after a full batch commits in time (up to maxItems), and
+     * lingering is cut short so that it and a typical commit fit in
+     * the target.
+     *
+     * With pipelineCommits, a batch's callbacks only fire once it's
+     * durable, and the executor gets the next batch ready while the
+     * last syncs (see AsyncExecutor).
+     */
+    struct AsyncBatchPolicy {
+        AsyncBatchPolicy() : maxItems(DEFAULT_MAX_DRAIN), maxBytes(0),
+                             minItems(1), maxLingerUsec(0),
+                             targetCommitUsec(0), pipelineCommits(false) {}
+
+        size_t   maxItems;
+        size_t   maxBytes;
+        size_t   minItems;
+        uint64_t maxLingerUsec;
+        uint64_t targetCommitUsec;
+        bool     pipelineCommits;
     };
 
     /**
-     * Async set operation.
+     * Async operations queue.
+     *
+     * Any number of threads may add operations, but only one may
+     * drain them.  Adding pushes onto a lock-free stack with a single
+     * compare and swap; draining takes the whole stack with one
+     * exchange and reverses it, so operations come out in the order
+     * they went in.  The draining thread sleeps on a futex when
+     * there's nothing to do, and adding only makes a system call to
+     * wake it then.
+     *
+     * Batches are cut to the policy, and the drainer reports how long
+     * each took to commit so the queue can adapt (and keep stats).
      */
-    class SetCStrOperation : public BoolOperation {
+    class AsyncQueue {
     public:
 
         /**
-         * Create a set with the given key, value and callback.
+         * Create an async queue batching as the policy says.
          */
-        SetCStrOperation(std::string &k, const char *v,
-                         Callback<bool> *c) : BoolOperation(c) {
-            key = k;
-            value = v;
+        AsyncQueue(const AsyncBatchPolicy &p) : policy(p), head(NULL),
+                                                sleeping(0), backlog(NULL),
+                                                backlogTail(NULL),
+                                                backlogItems(0),
+                                                lastFull(false),
+                                                avgCommitUsec(0) {
+            if (policy.maxItems < 1) {
+                policy.maxItems = 1;
+            }
+            // Adapting, start small and work up.
+            itemCap = policy.targetCommitUsec > 0 ? 1 : policy.maxItems;
         }
 
         /**
-         * Call the underlying set method.
+         * Add an operation to an async queue.
+         *
+         * @param op the operation to add
          */
-        void execute(KVStore *tut) {
-            tut->set(key, value, *cb);
+        void addOperation(AsyncOperation *op) {
+            AsyncOperation *h;
+            do {
+                h = head;
+                op->next = h;
+            } while (!__sync_bool_compare_and_swap(&head, h, op));
+            // The swap is a full barrier, so either this sees the
+            // drainer going to sleep or the drainer sees op.
+            if (sleeping && __sync_bool_compare_and_swap(&sleeping, 1, 0)) {
+                futex_wake(&sleeping, 1);
+            }
         }
-    private:
-        std::string  key;
-        const char  *value;
-    };
-
-    /**
-     * Async delete operation.
-     */
-    class DeleteOperation : public BoolOperation {
-    public:
 
         /**
-         * Create a delete operation with the given key and callback.
+         * Drain a batch of operations, waiting for some if there are
+         * none (and lingering for more if the policy says so).
+         *
+         * @return the oldest, linked to the rest through getNext()
          */
-        DeleteOperation(std::string &k, Callback<bool> *c) : BoolOperation(c) {
-            key = k;
+        AsyncOperation *drainTo() {
+            while (backlog == NULL) {
+                if (!take()) {
+                    wait(0);
+                }
+            }
+            if (backlogItems < policy.minItems) {
+                linger();
+            }
+
+            size_t n = 0, bytes = 0;
+            AsyncOperation *rv = backlog, *last = NULL, *op = backlog;
+            while (op != NULL && n < itemCap) {
+                size_t size = op->bytes();
+                if (n > 0 && policy.maxBytes > 0
+                    && bytes + size > policy.maxBytes) {
+                    break;
+                }
+                bytes += size;
+                ++n;
+                last = op;
+                op = op->next;
+            }
+            last->next = NULL;
+            backlog = op;
+            if (backlog == NULL) {
+                backlogTail = NULL;
+            }
+            backlogItems -= n;
+            lastFull = n >= itemCap;
+
+            batchItems.add(n);
+            batchBytes.add(bytes);
+            return rv;
         }
 
         /**
-         * Execute the underlying delete.
+         * Say how long the last batch drained took to commit.
          */
-        void execute(KVStore *db) {
-            db->del(key, *cb);
+        void committed(uint64_t usec) {
+            commitUsec.add(usec);
+            if (policy.targetCommitUsec == 0) {
+                return;
+            }
+            avgCommitUsec = avgCommitUsec - avgCommitUsec / 8 + usec / 8;
+            if (usec > policy.targetCommitUsec) {
+                itemCap -= itemCap / 4;
+                if (itemCap < 1) {
+                    itemCap = 1;
+                }
+            } else if (lastFull && itemCap < policy.maxItems) {
+                itemCap += itemCap / 8 + 1;
+                if (itemCap > policy.maxItems) {
+                    itemCap = policy.maxItems;
+                }
+            }
         }
 
-    private:
-        std::string key;
-    };
-
-    /**
-     * Asynchronous get operation.
-     */
-    class GetOperation : public AsyncOperation {
-    public:
         /**
-         * Construct a GetOperation with the given key and callback.
+         * Say how long a batch took to sync after committing (when
+         * commits are pipelined; from one thread at a time).
          */
-        GetOperation(std::string &k, Callback<GetValue> *c) {
-            key = k;
-            cb = c;
+        void synced(uint64_t usec) {
+            syncUsec.add(usec);
         }
 
         /**
-         * Execute the underlying get and fire the result to the callback.
+         * Forget the batch sizes and commit times (drainer only).
          */
-        void execute(KVStore *db) {
-            db->get(key, *cb);
+        void resetStats() {
+            batchItems.reset();
+            batchBytes.reset();
+            commitUsec.reset();
         }
 
-    private:
-        std::string         key;
-        Callback<GetValue> *cb;
-    };
-
-    /**
-     * Async operations queue.
-     */
-    class AsyncQueue {
-    public:
-
         /**
-         * Create an async queue.
-         *
-         * @param max_drain maximum number of operations to grab for one batch
+         * Forget the sync times (from the thread saying how long
+         * they took).
          */
-        AsyncQueue(int max_drain) {
-            pthread_mutex_init(&mutex, NULL);
-            pthread_cond_init(&cond, NULL);
-            max_drain_ = max_drain;
+        void resetSyncStats() {
+            syncUsec.reset();
         }
 
         /**
-         * Tear down an async queue.
+         * Print the batch sizes and commit times (drainer only, or
+         * slightly stale).
          */
-        ~AsyncQueue() {
-            pthread_cond_destroy(&cond);
-            pthread_mutex_destroy(&mutex);
+        void printStats(std::ostream &o) {
+            if (policy.targetCommitUsec > 0) {
+                o << "# batch item cap: " << itemCap
+                  << ", avg commit usec: " << avgCommitUsec << std::endl;
+            }
+            Histogram::printHeader(o);
+            batchItems.print(o, "items/commit");
+            batchBytes.print(o, "bytes/commit");
+            commitUsec.print(o, "commit usec");
+            if (policy.pipelineCommits) {
+                syncUsec.print(o, "sync usec");
+            }
         }
 
+    private:
+
         /**
-         * Add an operation to an async queue.
+         * Move whatever's been added onto the end of the backlog.
          *
-         * @param op the operation to add
+         * @return false if there was nothing
          */
-        void addOperation(AsyncOperation *op) {
-            LockHolder lh(&mutex);
-            ops.push(op);
-            if(pthread_cond_signal(&cond) != 0) {
-                throw std::runtime_error("Error signaling change.");
+        bool take() {
+            AsyncOperation *h = __sync_lock_test_and_set(&head,
+                                                         (AsyncOperation*)NULL);
+            if (h == NULL) {
+                return false;
             }
+            AsyncOperation *first = NULL, *last = h;
+            while (h != NULL) {
+                AsyncOperation *n = h->next;
+                h->next = first;
+                first = h;
+                h = n;
+                ++backlogItems;
+            }
+            if (backlogTail == NULL) {
+                backlog = first;
+            } else {
+                backlogTail->next = first;
+            }
+            backlogTail = last;
+            return true;
         }
 
         /**
-         * Drain some operations to the given queue.
-         *
-         * This will remove as many operations from the async queue as
-         * can be placed into the output queue given the maximum
-         * execution number.
-         *
-         * @param out an output queue ready to receive the ops
+         * Sleep until something's added (or for at most usec, if
+         * that's not zero).
          */
-        void drainTo(std::queue<AsyncOperation*> &out) {
-            LockHolder lh(&mutex);
-            if(ops.empty()) {
-                if(pthread_cond_wait(&cond, &mutex) != 0) {
-                    throw std::runtime_error("Error waiting for signal.");
-                }
+        void wait(uint64_t usec) {
+            __sync_bool_compare_and_swap(&sleeping, 0, 1);
+            if (head == NULL) {
+                futex_wait(&sleeping, 1, usec);
+            }
+            sleeping = 0;
+        }
+
+        /**
+         * Wait a while for the backlog to reach minItems.
+         */
+        void linger() {
+            uint64_t usec = policy.maxLingerUsec;
+            if (policy.targetCommitUsec > 0) {
+                uint64_t budget = policy.targetCommitUsec > avgCommitUsec
+                    ? policy.targetCommitUsec - avgCommitUsec : 0;
+                usec = usec < budget ? usec : budget;
+            }
+            if (usec == 0) {
+                return;
             }
-            for(int i = 0; i < max_drain_ && !ops.empty(); i++) {
-                out.push(ops.front());
-                ops.pop();
+            uint64_t until = now_usec() + usec;
+            while (backlogItems < policy.minItems) {
+                uint64_t now = now_usec();
+                if (now >= until) {
+                    break;
+                }
+                if (!take()) {
+                    wait(until - now);
+                }
             }
         }
 
-    private:
-        int                         max_drain_;
-        pthread_mutex_t             mutex;
-        pthread_cond_t              cond;
-        std::queue<AsyncOperation*> ops;
+        AsyncBatchPolicy          policy;
+        // Most recently added first.
+        AsyncOperation * volatile head;
+        // Set while the drainer is (about to be) asleep.
+        volatile int              sleeping;
+
+        // Everything below is the drainer's.
+
+        // Taken but not yet drained, oldest first.
+        AsyncOperation           *backlog;
+        AsyncOperation           *backlogTail;
+        size_t                    backlogItems;
+        // The current cap on items in a batch, and whether the last
+        // batch hit it.
+        size_t                    itemCap;
+        bool                      lastFull;
+        uint64_t                  avgCommitUsec;
+        Histogram                 batchItems;
+        Histogram                 batchBytes;
+        Histogram                 commitUsec;
+        // The syncing thread's.
+        Histogram                 syncUsec;
 
         DISALLOW_COPY_AND_ASSIGN(AsyncQueue);
     };
 
     /**
      * Asynchronous executor.
+     *
+     * Normally each batch drained is run in a transaction, with
+     * callbacks firing as operations are done, and then committed
+     * (and synced) before the next is drained.
+     *
+     * Pipelining commits, it keeps two batches going instead.  Each
+     * batch drained is prepared first: runs of keyed operations
+     * (between any noops, resets or batch operations) are sorted by
+     * key, keeping the order of operations on each key, and a set
+     * followed directly by another set of the same key is left out.
+     * The batch is then run, holding on to results, and committed.
+     * A second thread syncs it to disk and fires its callbacks, in
+     * the order they were queued, while this one gets on with the
+     * next batch; that one waits to be handed over until the last
+     * has been synced.  So completion means the operation is durable,
+     * and on a store whose commits are cheap but syncs aren't (see
+     * KVStore::sync()), the disk is kept busy.  (Operations the store
+     * completes after returning, as the EP store does gets of ejected
+     * values, are waited for before the batch commits.)
      */
     class AsyncExecutor {
     public:
 
         /**
          * Construct an AsyncExecutor over the given underlying
-         * KVStore with the given input queue.
+         * KVStore with the given input queue, giving operations back
+         * to the given pool once they're done.
          */
-        AsyncExecutor(KVStore *d, AsyncQueue *q) {
-            tut     = d;
-            iq      = q;
+        AsyncExecutor(KVStore *d, AsyncQueue *q, AsyncOpPool *p,
+                      bool pipelineCommits=false) {
+            tut       = d;
+            iq        = q;
+            pool      = p;
+            pipelined = pipelineCommits;
+            syncing   = NULL;
+            stopSync  = false;
+            if (pthread_mutex_init(&syncMutex, NULL) != 0) {
+                throw std::runtime_error("Failed to create mutex.");
+            }
+            if (pthread_cond_init(&syncCond, NULL) != 0) {
+                throw std::runtime_error("Failed to create condition.");
+            }
+        }
+
+        ~AsyncExecutor() {
+            pthread_cond_destroy(&syncCond);
+            pthread_mutex_destroy(&syncMutex);
         }
 
         /**
-         * Run forever.
+         * Run until told to shut down.
          */
         void run() {
             try {
-                while(true) {
-                    std::queue<AsyncOperation*> ops;
-                    iq->drainTo(ops);
-                    tut->begin();
-                    int count = 0;
-
-                    while(!ops.empty()) {
-                        AsyncOperation *op = ops.front();
-                        ops.pop();
-
-                        op->execute(tut);
-                        count++;
-                        delete op;
-                    }
-
-                    tut->commit();
+                if (pipelined && pthread_create(&syncer, NULL, launchSyncer,
+                                                this) != 0) {
+                    throw std::runtime_error("Error starting sync thread.");
+                }
+                bool running = true;
+                while(running) {
+                    AsyncOperation *ops = iq->drainTo();
+                    running = pipelined ? runPipelined(ops) : runBatch(ops);
+                }
+                if (pipelined) {
+                    LockHolder lh(&syncMutex);
+                    stopSync = true;
+                    pthread_cond_broadcast(&syncCond);
+                    lh.unlock();
+                    pthread_join(syncer, NULL);
                 }
-            } catch(AsyncShutdownOperation *op) {
-                delete op;
                 std::cerr << "Shutting down..." << std::endl;
             } catch(std::runtime_error &e) {
                 std::cerr << "Exception in executor loop: "
@@ -314,12 +759,271 @@ namespace kvtest {
          * Shut down this thread.
          */
         void stop() {
-            iq->addOperation(new AsyncShutdownOperation());
+            AsyncOperation *op = pool->get();
+            op->type = ASYNC_SHUTDOWN;
+            iq->addOperation(op);
         }
 
     private:
-        KVStore       *tut;
-        AsyncQueue    *iq;
+
+        /**
+         * Run, commit and sync a batch.
+         *
+         * @return false if it said to shut down
+         */
+        bool runBatch(AsyncOperation *ops) {
+            bool running = true;
+            tut->begin();
+            for (AsyncOperation *op = ops; op != NULL; op = op->getNext()) {
+                if (op->type == ASYNC_SHUTDOWN) {
+                    running = false;
+                    break;
+                }
+                execute(op);
+            }
+            uint64_t start = now_usec();
+            tut->commit();
+            tut->sync();
+            iq->committed(now_usec() - start);
+            pool->put(ops);
+            return running;
+        }
+
+        /**
+         * Prepare, run and commit a batch, and hand it over to be
+         * synced once the last one has been.
+         *
+         * @return false if it said to shut down
+         */
+        bool runPipelined(AsyncOperation *ops) {
+            bool running = prepare(ops);
+            FutureGroup completions;
+            int started = 0;
+            tut->begin();
+            for (size_t i = 0; i < order.size(); i++) {
+                if (!order[i]->superseded) {
+                    order[i]->completions = &completions;
+                    execute(order[i]);
+                    ++started;
+                }
+            }
+            completions.waitFor(started);
+            // A left out set gets the result of the set after it.
+            for (size_t i = order.size(); i-- > 0; ) {
+                if (order[i]->superseded) {
+                    order[i]->boolResult = order[i + 1]->boolResult;
+                }
+            }
+            uint64_t start = now_usec();
+            tut->commit();
+            iq->committed(now_usec() - start);
+
+            LockHolder lh(&syncMutex);
+            while (syncing != NULL) {
+                pthread_cond_wait(&syncCond, &syncMutex);
+            }
+            syncing = ops;
+            pthread_cond_broadcast(&syncCond);
+            return running;
+        }
+
+        /**
+         * Put the operations of a batch (up to any shutdown) in the
+         * order to run them, marking the sets to leave out.
+         *
+         * @return false if the batch said to shut down
+         */
+        bool prepare(AsyncOperation *ops) {
+            bool running = true;
+            size_t from = 0;
+            order.clear();
+            for (AsyncOperation *op = ops; op != NULL; op = op->getNext()) {
+                if (op->type == ASYNC_SHUTDOWN) {
+                    running = false;
+                    break;
+                }
+                op->superseded = false;
+                order.push_back(op);
+                if (!keyed(op)) {
+                    sortRun(from, order.size() - 1);
+                    from = order.size();
+                }
+            }
+            sortRun(from, order.size());
+            return running;
+        }
+
+        /**
+         * Sort order[from, to) by key and find the sets superseded.
+         */
+        void sortRun(size_t from, size_t to) {
+            if (to <= from + 1) {
+                return;
+            }
+            std::stable_sort(order.begin() + (long)from,
+                             order.begin() + (long)to, keyLess);
+            for (size_t i = from; i + 1 < to; i++) {
+                order[i]->superseded = plainSet(order[i])
+                    && plainSet(order[i + 1])
+                    && order[i]->key == order[i + 1]->key;
+            }
+        }
+
+        static bool keyLess(const AsyncOperation *a, const AsyncOperation *b) {
+            return a->key < b->key;
+        }
+
+        /**
+         * Whether an operation is on just its key (so may be
+         * reordered with operations on other keys).
+         */
+        static bool keyed(const AsyncOperation *op) {
+            switch (op->type) {
+            case ASYNC_SET:
+            case ASYNC_SET_CSTR:
+            case ASYNC_SET_TTL:
+            case ASYNC_GET:
+            case ASYNC_GETS:
+            case ASYNC_DEL:
+            case ASYNC_MUTATE:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        static bool plainSet(const AsyncOperation *op) {
+            return op->type == ASYNC_SET || op->type == ASYNC_SET_CSTR;
+        }
+
+        /**
+         * Sync each batch handed over and fire its callbacks, until
+         * told to stop.
+         */
+        void syncBatches() {
+            LockHolder lh(&syncMutex);
+            for (;;) {
+                while (syncing == NULL && !stopSync) {
+                    pthread_cond_wait(&syncCond, &syncMutex);
+                }
+                if (syncing == NULL) {
+                    break;
+                }
+                AsyncOperation *ops = syncing;
+                lh.unlock();
+
+                uint64_t start = now_usec();
+                tut->sync();
+                iq->synced(now_usec() - start);
+                for (AsyncOperation *op = ops;
+                     op != NULL && op->type != ASYNC_SHUTDOWN;
+                     op = op->getNext()) {
+                    if (op->type == ASYNC_RESET) {
+                        // Sync times are only touched here.
+                        iq->resetSyncStats();
+                    }
+                    op->fire();
+                }
+                pool->put(ops);
+
+                lh.lock();
+                syncing = NULL;
+                pthread_cond_broadcast(&syncCond);
+            }
+        }
+
+        static void *launchSyncer(void *arg) {
+            AsyncExecutor *executor = static_cast<AsyncExecutor*>(arg);
+            try {
+                executor->syncBatches();
+            } catch(std::runtime_error &e) {
+                std::cerr << "Exception in sync loop: "
+                          << e.what() << std::endl;
+                abort();
+            }
+            return NULL;
+        }
+
+        /**
+         * Where an operation's result goes: its callback, or (when
+         * pipelining) the record, to hold on to until it's synced.
+         */
+        template <typename T>
+        Callback<T> &to(AsyncOperation *op, Callback<T> *cb) {
+            if (pipelined) {
+                return *op;
+            }
+            return *cb;
+        }
+
+        /**
+         * Perform one operation.
+         */
+        void execute(AsyncOperation *op) {
+            bool t = true;
+            switch (op->type) {
+            case ASYNC_NOOP:
+                to(op, op->boolCb).callback(t);
+                break;
+            case ASYNC_RESET:
+                tut->reset();
+                iq->resetStats();
+                if (!pipelined) {
+                    iq->resetSyncStats();
+                }
+                to(op, op->boolCb).callback(t);
+                break;
+            case ASYNC_SET:
+                tut->set(op->key, op->value, to(op, op->boolCb));
+                break;
+            case ASYNC_SET_CSTR:
+                tut->set(op->key, op->cvalue, to(op, op->boolCb));
+                break;
+            case ASYNC_SET_TTL:
+                tut->setWithTTL(op->key, op->value, op->ttl,
+                                to(op, op->boolCb));
+                break;
+            case ASYNC_GET:
+                tut->get(op->key, to(op, op->getCb));
+                break;
+            case ASYNC_GETS:
+                tut->gets(op->key, to(op, op->getCb));
+                break;
+            case ASYNC_DEL:
+                tut->del(op->key, to(op, op->boolCb));
+                break;
+            case ASYNC_MUTATE:
+                // The underlying store only sees one operation at a
+                // time, so even its default read-modify-write
+                // mutate() is atomic.
+                tut->mutate(op->key, op->m, to(op, op->mutationCb));
+                break;
+            case ASYNC_SET_MULTI:
+                tut->setMulti(op->items, to(op, op->boolsCb));
+                break;
+            case ASYNC_GET_MULTI:
+                tut->getMulti(op->keys, to(op, op->valuesCb));
+                break;
+            case ASYNC_DEL_MULTI:
+                tut->delMulti(op->keys, to(op, op->boolsCb));
+                break;
+            case ASYNC_SHUTDOWN:
+                break;
+            }
+        }
+
+        KVStore                     *tut;
+        AsyncQueue                  *iq;
+        AsyncOpPool                 *pool;
+        bool                         pipelined;
+        // The batch being prepared, in the order to run it.
+        std::vector<AsyncOperation*> order;
+        // The batch handed over to be synced (or NULL).
+        AsyncOperation              *syncing;
+        bool                         stopSync;
+        pthread_mutex_t              syncMutex;
+        pthread_cond_t               syncCond;
+        pthread_t                    syncer;
 
         DISALLOW_COPY_AND_ASSIGN(AsyncExecutor);
     };
@@ -336,6 +1040,16 @@ namespace kvtest {
 
     /**
      * Asynchronous wrapper for a synchronous KVStore.
+     *
+     * Given several stores, each gets a queue and executor thread of
+     * its own, and each operation goes to the one its key hashes to,
+     * so operations on a key stay in order while different keys are
+     * worked on in parallel.  (The stores should be separate, e.g. a
+     * file each, as nothing serializes access across them.)  A noop
+     * or reset goes to every shard and completes once each has done
+     * it, so it's still a barrier for everything queued before it.
+     * A batch is split by shard, completing once every part has, and
+     * isn't atomic across shards.
      */
     class QueuedKVStore : public KVStore {
     public:
@@ -344,34 +1058,49 @@ namespace kvtest {
          * Construct a QueuedKVStore wrapping the given thing.
          */
         QueuedKVStore(KVStore *t, int max_drain=DEFAULT_MAX_DRAIN) {
-            tut = t;
-            iq = new AsyncQueue(max_drain);
-            executor = new AsyncExecutor(tut, iq);
+            stores.push_back(t);
+            start(drainPolicy(max_drain));
+        }
 
-            if(pthread_create(&thread, NULL, launch_executor_thread, executor)
-               != 0) {
-                throw std::runtime_error("Error initializing queue thread");
-            }
+        /**
+         * Construct a QueuedKVStore with a shard per store.
+         */
+        QueuedKVStore(std::vector<KVStore*> &s,
+                      int max_drain=DEFAULT_MAX_DRAIN) : stores(s) {
+            start(drainPolicy(max_drain));
+        }
+
+        /**
+         * Construct a QueuedKVStore with a shard per store, each
+         * batching operations as the policy says.
+         */
+        QueuedKVStore(std::vector<KVStore*> &s,
+                      const AsyncBatchPolicy &policy) : stores(s) {
+            start(policy);
         }
 
         /**
          * Clean up.
          */
         ~QueuedKVStore() {
-            executor->stop();
-            pthread_join(thread, NULL);
-            delete executor;
-            delete iq;
+            for (size_t i = 0; i < executors.size(); i++) {
+                executors[i]->stop();
+            }
+            for (size_t i = 0; i < executors.size(); i++) {
+                pthread_join(threads[i], NULL);
+                delete executors[i];
+                delete queues[i];
+            }
+            delete pool;
         }
 
         /**
          * Perform an async reset.
          */
         void reset() {
-            std::queue<AsyncOperation*> opq;
-            RememberingCallback<bool> cb;
-            iq->addOperation(new ResetOperation(&cb));
-            cb.waitForValue();
+            Future<bool> cb;
+            everyShard(ASYNC_RESET, cb);
+            cb.wait();
         }
 
         /**
@@ -379,7 +1108,10 @@ namespace kvtest {
          */
         void set(std::string &key, std::string &val,
                  Callback<bool> &cb) {
-            iq->addOperation(new SetOperation(key, val, &cb));
+            AsyncOperation *op = keyed(ASYNC_SET, key);
+            op->value = val;
+            op->boolCb = &cb;
+            submit(op);
         }
 
         /**
@@ -387,21 +1119,154 @@ namespace kvtest {
          */
         void set(std::string &key, const char *val,
                  Callback<bool> &cb) {
-            iq->addOperation(new SetCStrOperation(key, val, &cb));
+            AsyncOperation *op = keyed(ASYNC_SET_CSTR, key);
+            op->cvalue = val;
+            op->boolCb = &cb;
+            submit(op);
+        }
+
+        /**
+         * Perform an async set with TTL.
+         */
+        void setWithTTL(std::string &key, std::string &val, uint32_t ttl,
+                        Callback<bool> &cb) {
+            AsyncOperation *op = keyed(ASYNC_SET_TTL, key);
+            op->value = val;
+            op->ttl = ttl;
+            op->boolCb = &cb;
+            submit(op);
         }
 
         /**
          * Perform an async get.
          */
         void get(std::string &key, Callback<GetValue> &cb) {
-            iq->addOperation(new GetOperation(key, &cb));
+            AsyncOperation *op = keyed(ASYNC_GET, key);
+            op->getCb = &cb;
+            submit(op);
+        }
+
+        /**
+         * Perform an async get with CAS.
+         */
+        void gets(std::string &key, Callback<GetValue> &cb) {
+            AsyncOperation *op = keyed(ASYNC_GETS, key);
+            op->getCb = &cb;
+            submit(op);
+        }
+
+        /**
+         * Perform an async mutation (as one queued operation).
+         */
+        void mutate(std::string &key, Mutation &m,
+                    Callback<MutationResult> &cb) {
+            AsyncOperation *op = keyed(ASYNC_MUTATE, key);
+            op->m = m;
+            op->mutationCb = &cb;
+            submit(op);
         }
 
         /**
          * perform an async delete.
          */
         void del(std::string &key, Callback<bool> &cb) {
-            iq->addOperation(new DeleteOperation(key, &cb));
+            AsyncOperation *op = keyed(ASYNC_DEL, key);
+            op->boolCb = &cb;
+            submit(op);
+        }
+
+        /**
+         * Perform an async batch set (as one queued operation per
+         * shard).
+         */
+        void setMulti(std::vector<KeyValue> &items,
+                      Callback<std::vector<bool> > &cb) {
+            if (queues.size() == 1) {
+                AsyncOperation *op = pool->get();
+                op->type = ASYNC_SET_MULTI;
+                op->items = items;
+                op->boolsCb = &cb;
+                queues[0]->addOperation(op);
+                return;
+            }
+            std::vector<std::vector<KeyValue> > parts(queues.size());
+            std::vector<std::vector<size_t> > positions(queues.size());
+            for (size_t i = 0; i < items.size(); i++) {
+                size_t s = shardFor(items[i].key);
+                parts[s].push_back(items[i]);
+                positions[s].push_back(i);
+            }
+            SplitBatchCollector<bool> *c =
+                new SplitBatchCollector<bool>(items.size(), positions, cb);
+            for (size_t s = 0; s < parts.size(); s++) {
+                if (!parts[s].empty()) {
+                    AsyncOperation *op = pool->get();
+                    op->type = ASYNC_SET_MULTI;
+                    op->items = parts[s];
+                    op->boolsCb = &c->forPart(s);
+                    queues[s]->addOperation(op);
+                }
+            }
+            c->started();
+        }
+
+        /**
+         * Perform an async batch get (as one queued operation per
+         * shard).
+         */
+        void getMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<GetValue> > &cb) {
+            AsyncOperation *op;
+            if (queues.size() == 1) {
+                op = pool->get();
+                op->type = ASYNC_GET_MULTI;
+                op->keys = keys;
+                op->valuesCb = &cb;
+                queues[0]->addOperation(op);
+                return;
+            }
+            std::vector<std::vector<std::string> > parts;
+            SplitBatchCollector<GetValue> *c =
+                splitKeys<GetValue>(keys, parts, cb);
+            for (size_t s = 0; s < parts.size(); s++) {
+                if (!parts[s].empty()) {
+                    op = pool->get();
+                    op->type = ASYNC_GET_MULTI;
+                    op->keys = parts[s];
+                    op->valuesCb = &c->forPart(s);
+                    queues[s]->addOperation(op);
+                }
+            }
+            c->started();
+        }
+
+        /**
+         * Perform an async batch delete (as one queued operation per
+         * shard).
+         */
+        void delMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<bool> > &cb) {
+            AsyncOperation *op;
+            if (queues.size() == 1) {
+                op = pool->get();
+                op->type = ASYNC_DEL_MULTI;
+                op->keys = keys;
+                op->boolsCb = &cb;
+                queues[0]->addOperation(op);
+                return;
+            }
+            std::vector<std::vector<std::string> > parts;
+            SplitBatchCollector<bool> *c = splitKeys<bool>(keys, parts, cb);
+            for (size_t s = 0; s < parts.size(); s++) {
+                if (!parts[s].empty()) {
+                    op = pool->get();
+                    op->type = ASYNC_DEL_MULTI;
+                    op->keys = parts[s];
+                    op->boolsCb = &c->forPart(s);
+                    queues[s]->addOperation(op);
+                }
+            }
+            c->started();
         }
 
         /**
@@ -409,14 +1274,114 @@ namespace kvtest {
          * everything is done).
          */
         void noop(Callback<bool> &cb) {
-            iq->addOperation(new NOOPOperation(&cb));
+            everyShard(ASYNC_NOOP, cb);
+        }
+
+        /**
+         * Print the wrapped stores' stats, and how their operations
+         * were batched.
+         */
+        void printStats(std::ostream &o) {
+            for (size_t i = 0; i < stores.size(); i++) {
+                if (stores.size() > 1) {
+                    o << "# shard " << i << std::endl;
+                }
+                stores[i]->printStats(o);
+                queues[i]->printStats(o);
+            }
         }
 
     private:
-        KVStore *tut;
-        AsyncQueue     *iq;
-        AsyncExecutor  *executor;
-        pthread_t       thread;
+
+        static AsyncBatchPolicy drainPolicy(int max_drain) {
+            AsyncBatchPolicy p;
+            p.maxItems = max_drain > 0 ? (size_t)max_drain : 1;
+            return p;
+        }
+
+        void start(const AsyncBatchPolicy &policy) {
+            if (stores.empty()) {
+                throw std::runtime_error("No stores to queue for.");
+            }
+            pool = new AsyncOpPool();
+            threads.resize(stores.size());
+            for (size_t i = 0; i < stores.size(); i++) {
+                queues.push_back(new AsyncQueue(policy));
+                executors.push_back(new AsyncExecutor(stores[i], queues[i],
+                                                      pool,
+                                                      policy.pipelineCommits));
+                if(pthread_create(&threads[i], NULL, launch_executor_thread,
+                                  executors[i]) != 0) {
+                    throw std::runtime_error("Error initializing queue thread");
+                }
+            }
+        }
+
+        size_t shardFor(const std::string &key) {
+            return (size_t)(hash_bytes(key.data(), key.length())
+                            % queues.size());
+        }
+
+        /**
+         * A record for an operation on the given key.
+         */
+        AsyncOperation *keyed(async_op_t type, std::string &key) {
+            AsyncOperation *op = pool->get();
+            op->type = type;
+            op->key = key;
+            return op;
+        }
+
+        /**
+         * Queue a keyed operation on its key's shard.
+         */
+        void submit(AsyncOperation *op) {
+            if (queues.size() == 1) {
+                queues[0]->addOperation(op);
+            } else {
+                queues[shardFor(op->key)]->addOperation(op);
+            }
+        }
+
+        /**
+         * Queue an operation on every shard, calling back once all
+         * have done it.
+         */
+        void everyShard(async_op_t type, Callback<bool> &cb) {
+            Callback<bool> *c = &cb;
+            if (queues.size() > 1) {
+                c = new CountdownCallback(queues.size(), cb);
+            }
+            for (size_t s = 0; s < queues.size(); s++) {
+                AsyncOperation *op = pool->get();
+                op->type = type;
+                op->boolCb = c;
+                queues[s]->addOperation(op);
+            }
+        }
+
+        /**
+         * Split keys by shard, with a collector for the results.
+         */
+        template <typename T>
+        SplitBatchCollector<T> *splitKeys(std::vector<std::string> &keys,
+                                          std::vector<std::vector<std::string> > &parts,
+                                          Callback<std::vector<T> > &cb) {
+            parts.resize(queues.size());
+            std::vector<std::vector<size_t> > positions(queues.size());
+            for (size_t i = 0; i < keys.size(); i++) {
+                size_t s = shardFor(keys[i]);
+                parts[s].push_back(keys[i]);
+                positions[s].push_back(i);
+            }
+            return new SplitBatchCollector<T>(keys.size(), positions, cb);
+        }
+
+        std::vector<KVStore*>       stores;
+        AsyncOpPool                *pool;
+        std::vector<AsyncQueue*>    queues;
+        std::vector<AsyncExecutor*> executors;
+        std::vector<pthread_t>      threads;
 
         DISALLOW_COPY_AND_ASSIGN(QueuedKVStore);
     };
@@ -0,0 +1,72 @@
+#ifndef ATOMIC_HH
+#define ATOMIC_HH 1
+
+namespace kvtest {
+
+    /**
+     * Full memory barrier (for both the compiler and the CPU).
+     */
+    inline void memory_barrier() {
+        __sync_synchronize();
+    }
+
+    /**
+     * A word-sized value that is always read and written atomically.
+     */
+    template <typename T>
+    class Atomic {
+    public:
+
+        Atomic(T v = 0) {
+            value = v;
+        }
+
+        /**
+         * Read the current value.
+         */
+        T get() const {
+            memory_barrier();
+            return value;
+        }
+
+        /**
+         * Replace the current value.
+         */
+        void set(T v) {
+            memory_barrier();
+            value = v;
+            memory_barrier();
+        }
+
+        /**
+         * Add to the value and return the result.
+         */
+        T incr(T by = 1) {
+            return __sync_add_and_fetch(&value, by);
+        }
+
+        /**
+         * Subtract from the value and return the result.
+         */
+        T decr(T by = 1) {
+            return __sync_sub_and_fetch(&value, by);
+        }
+
+        /**
+         * Set the value to v if it is currently expected.
+         *
+         * @return true if the value was changed
+         */
+        bool cas(T expected, T v) {
+            return __sync_bool_compare_and_swap(&value, expected, v);
+        }
+
+    private:
+        volatile T value;
+
+        DISALLOW_COPY_AND_ASSIGN(Atomic);
+    };
+
+}
+
+#endif /* ATOMIC_HH */
@@ -7,6 +7,7 @@
 #include <iostream>
 #include <sstream>
 #include <list>
+#include <vector>
 
 // Stolen from http://google-styleguide.googlecode.com/svn/trunk/cppguide.xml
 // A macro to disallow the copy constructor and operator= functions
@@ -17,6 +18,7 @@
 
 #include "locks.hh"
 #include "callbacks.hh"
+#include "hash.hh"
 
 /*! \mainpage kvtest
  *
@@ -42,11 +44,12 @@ namespace kvtest {
      */
     class GetValue {
     public:
-        GetValue() { }
+        GetValue() : cas(0) { }
 
         GetValue(std::string v, bool s) {
             value = v;
             success = s;
+            cas = 0;
         }
 
         friend std::ostream& operator<<(std::ostream &o, GetValue &gv) {
@@ -62,6 +65,202 @@ namespace kvtest {
          * True if a value was successfully retrieved.
          */
         bool success;
+        /**
+         * The item's CAS value (from KVStore::gets; otherwise zero
+         * unless the store knows it anyway).
+         */
+        uint64_t cas;
+    };
+
+    /**
+     * Value for callback for scans of a whole store.
+     */
+    class KeyValue {
+    public:
+        KeyValue() { }
+
+        KeyValue(std::string k, std::string v) {
+            key = k;
+            value = v;
+        }
+
+        /**
+         * The key found.
+         */
+        std::string key;
+        /**
+         * Its value.
+         */
+        std::string value;
+    };
+
+    /**
+     * The CAS value of an item in a store that doesn't keep one: a
+     * hash of its value (never zero).
+     */
+    inline uint64_t value_cas(const char *v, size_t len) {
+        return hash_bytes(v, len) | 1;
+    }
+
+    /**
+     * Kinds of in-place change to an item's value.
+     */
+    typedef enum {
+        /** Add to a counter (wrapping at 2^64). */
+        MUTATE_INCR,
+        /** Subtract from a counter (stopping at zero). */
+        MUTATE_DECR,
+        MUTATE_APPEND,
+        MUTATE_PREPEND,
+        /** Replace the value if the CAS value still matches. */
+        MUTATE_CAS
+    } mutation_op_t;
+
+    /**
+     * How a mutation turned out.
+     */
+    typedef enum {
+        MUTATION_DONE,
+        /** There was no such item. */
+        MUTATION_NOT_FOUND,
+        /** The item changed since its CAS value was read. */
+        MUTATION_EXISTS,
+        /** The item isn't a counter (a decimal number). */
+        MUTATION_NOT_NUMBER,
+        /** The store couldn't take the change (try again later). */
+        MUTATION_FAILED
+    } mutation_status_t;
+
+    /**
+     * Value for callback for mutations.
+     */
+    class MutationResult {
+    public:
+        MutationResult() : status(MUTATION_NOT_FOUND), number(0), cas(0) { }
+
+        bool success() {
+            return status == MUTATION_DONE;
+        }
+
+        mutation_status_t status;
+        /**
+         * The counter's new value (incr and decr only).
+         */
+        uint64_t number;
+        /**
+         * The item's new CAS value.
+         */
+        uint64_t cas;
+    };
+
+    /**
+     * An in-place change to one item's value.
+     */
+    class Mutation {
+    public:
+        Mutation(mutation_op_t o, const std::string &v, uint64_t x)
+            : op(o), value(v), n(x) { }
+
+        /**
+         * An increment by nothing (to be assigned over).
+         */
+        Mutation() : op(MUTATE_INCR), n(0) { }
+
+        /**
+         * Work out an item's new value from its current one.
+         *
+         * @param old the current value (NULL if there's no item)
+         * @param len its length
+         * @param oldCas the item's current CAS value
+         * @param out where to put the new value
+         * @param number where to put a counter's new value
+         * @return MUTATION_DONE if out should replace the value
+         */
+        mutation_status_t apply(const char *old, size_t len, uint64_t oldCas,
+                                std::string &out, uint64_t &number) const {
+            if (old == NULL) {
+                return MUTATION_NOT_FOUND;
+            }
+            switch (op) {
+            case MUTATE_INCR:
+            case MUTATE_DECR:
+                if (!parseCounter(old, len, number)) {
+                    return MUTATION_NOT_NUMBER;
+                }
+                if (op == MUTATE_INCR) {
+                    number += n;
+                } else {
+                    number = number > n ? number - n : 0;
+                }
+                formatCounter(number, out);
+                break;
+            case MUTATE_APPEND:
+                out.assign(old, len);
+                out += value;
+                break;
+            case MUTATE_PREPEND:
+                out = value;
+                out.append(old, len);
+                break;
+            case MUTATE_CAS:
+                if (oldCas != n) {
+                    return MUTATION_EXISTS;
+                }
+                out = value;
+                break;
+            }
+            return MUTATION_DONE;
+        }
+
+        /**
+         * As above, for stores without CAS values of their own (see
+         * value_cas).
+         */
+        mutation_status_t apply(const char *old, size_t len,
+                                std::string &out, uint64_t &number) const {
+            uint64_t oldCas = old && op == MUTATE_CAS ? value_cas(old, len) : 0;
+            return apply(old, len, oldCas, out, number);
+        }
+
+        mutation_op_t op;
+        /**
+         * What to append, prepend or swap in.
+         */
+        std::string   value;
+        /**
+         * The amount to add or subtract, or the expected CAS value.
+         */
+        uint64_t      n;
+
+    private:
+
+        static bool parseCounter(const char *s, size_t len, uint64_t &out) {
+            if (len == 0 || len > 20) {
+                return false;
+            }
+            out = 0;
+            for (size_t i = 0; i < len; i++) {
+                if (s[i] < '0' || s[i] > '9') {
+                    return false;
+                }
+                uint64_t next = out * 10 + (uint64_t)(s[i] - '0');
+                if (next / 10 != out) {
+                    return false;
+                }
+                out = next;
+            }
+            return true;
+        }
+
+        static void formatCounter(uint64_t v, std::string &out) {
+            char buf[21];
+            char *p = buf + sizeof(buf);
+            do {
+                *--p = (char)('0' + v % 10);
+                v /= 10;
+            } while (v > 0);
+            out.assign(p, (size_t)(buf + sizeof(buf) - p));
+        }
     };
 
     /**
@@ -109,6 +308,22 @@ namespace kvtest {
         virtual void set(std::string &key, const char *val,
                          Callback<bool> &cb) = 0;
 
+        /**
+         * Set a given key and value, to expire after a while.
+         *
+         * The default ignores the TTL (for stores that don't expire
+         * items).
+         *
+         * @param key the key to set
+         * @param val the value to set
+         * @param ttl seconds until the item expires (zero for never)
+         * @param cb callback that will fire with true if the set succeeded
+         */
+        virtual void setWithTTL(std::string &key, std::string &val,
+                                uint32_t ttl, Callback<bool> &cb) {
+            set(key, val, cb);
+        }
+
         /**
          * Get the value for the given key.
          *
@@ -126,6 +341,167 @@ namespace kvtest {
          */
         virtual void del(std::string &key, Callback<bool> &cb) = 0;
 
+        /**
+         * Get the value for the given key along with its CAS value.
+         *
+         * The default hashes the value from get() (see value_cas).
+         *
+         * @param key the key
+         * @param cb callback that will fire with the retrieved value
+         */
+        virtual void gets(std::string &key, Callback<GetValue> &cb);
+
+        /**
+         * Change an item's value in place.
+         *
+         * The default is a get() followed by a set(), so is only
+         * atomic for stores that do one operation at a time.
+         *
+         * @param key the key
+         * @param m the change to make
+         * @param cb callback that will fire with the outcome
+         */
+        virtual void mutate(std::string &key, Mutation &m,
+                            Callback<MutationResult> &cb);
+
+        /**
+         * Add to a counter.
+         */
+        void incr(std::string &key, uint64_t delta,
+                  Callback<MutationResult> &cb) {
+            Mutation m(MUTATE_INCR, std::string(), delta);
+            mutate(key, m, cb);
+        }
+
+        /**
+         * Subtract from a counter (stopping at zero).
+         */
+        void decr(std::string &key, uint64_t delta,
+                  Callback<MutationResult> &cb) {
+            Mutation m(MUTATE_DECR, std::string(), delta);
+            mutate(key, m, cb);
+        }
+
+        /**
+         * Add to the end of an existing value.
+         */
+        void append(std::string &key, std::string &val,
+                    Callback<MutationResult> &cb) {
+            Mutation m(MUTATE_APPEND, val, 0);
+            mutate(key, m, cb);
+        }
+
+        /**
+         * Add to the start of an existing value.
+         */
+        void prepend(std::string &key, std::string &val,
+                     Callback<MutationResult> &cb) {
+            Mutation m(MUTATE_PREPEND, val, 0);
+            mutate(key, m, cb);
+        }
+
+        /**
+         * Replace an item's value, provided its CAS value (from
+         * gets()) hasn't changed since.
+         */
+        void cas(std::string &key, std::string &val, uint64_t casValue,
+                 Callback<MutationResult> &cb) {
+            Mutation m(MUTATE_CAS, val, casValue);
+            mutate(key, m, cb);
+        }
+
+        /**
+         * Set a batch of keys and values.
+         *
+         * The default calls set() for each.
+         *
+         * @param items the keys and values to set
+         * @param cb callback that will fire once for the whole batch,
+         *           with whether each set succeeded (a PerItemCallback
+         *           hears about each on its own)
+         */
+        virtual void setMulti(std::vector<KeyValue> &items,
+                              Callback<std::vector<bool> > &cb) {
+            BatchCollector<bool> *c = new BatchCollector<bool>(items.size(),
+                                                               cb);
+            for (size_t i = 0; i < items.size(); i++) {
+                set(items[i].key, items[i].value, c->forItem(i));
+            }
+            c->started();
+        }
+
+        /**
+         * Get the values for a batch of keys.
+         *
+         * The default calls get() for each.
+         *
+         * @param keys the keys
+         * @param cb callback that will fire once for the whole batch,
+         *           with the value retrieved for each key
+         */
+        virtual void getMulti(std::vector<std::string> &keys,
+                              Callback<std::vector<GetValue> > &cb) {
+            BatchCollector<GetValue> *c =
+                new BatchCollector<GetValue>(keys.size(), cb);
+            for (size_t i = 0; i < keys.size(); i++) {
+                get(keys[i], c->forItem(i));
+            }
+            c->started();
+        }
+
+        /**
+         * Delete a batch of keys.
+         *
+         * The default calls del() for each.
+         *
+         * @param keys the keys
+         * @param cb callback that will fire once for the whole batch,
+         *           with whether each value existed and was deleted
+         */
+        virtual void delMulti(std::vector<std::string> &keys,
+                              Callback<std::vector<bool> > &cb) {
+            BatchCollector<bool> *c = new BatchCollector<bool>(keys.size(),
+                                                               cb);
+            for (size_t i = 0; i < keys.size(); i++) {
+                del(keys[i], c->forItem(i));
+            }
+            c->started();
+        }
+
+        /**
+         * Hand every key and value in the store to the callback.
+         *
+         * The store may be scanned in slices: slice i of n covers
+         * about a nth of the items, and the n slices together cover
+         * all of them.  Up to getMaxScanSlices() slices may be
+         * scanned at once from different threads, alongside other
+         * use of the store.
+         *
+         * @param cb callback that will fire once per item
+         * @param slice which slice to scan
+         * @param nslices how many slices the store is cut into
+         */
+        virtual void dump(Callback<KeyValue> &cb, size_t slice = 0,
+                          size_t nslices = 1) {
+            throw std::runtime_error("not implemented");
+        }
+
+        /**
+         * How many slices of this store may be scanned concurrently
+         * (and concurrently with anything else).  Zero means a scan
+         * must have the store to itself.
+         */
+        virtual size_t getMaxScanSlices() {
+            return 0;
+        }
+
+        /**
+         * Write any statistics worth knowing about to the given stream.
+         *
+         * @param o where to write them
+         */
+        virtual void printStats(std::ostream &o) {}
+
         /**
          * For things that support transactions, this signals the
          * beginning of one.
@@ -144,10 +520,96 @@ namespace kvtest {
          */
         virtual void rollback() {}
 
+        /**
+         * Make everything committed so far durable.
+         *
+         * Things whose commit() is already durable needn't do
+         * anything.  Unlike everything else here, this may be called
+         * from another thread while the store is in use.
+         */
+        virtual void sync() {}
+
     private:
         DISALLOW_COPY_AND_ASSIGN(KVStore);
     };
 
+    /**
+     * Fills in the CAS value of a get for KVStore::gets.
+     */
+    class CasFiller : public Callback<GetValue> {
+    public:
+        CasFiller(Callback<GetValue> &c) : cb(c) {}
+
+        void callback(GetValue &gv) {
+            if (gv.success) {
+                gv.cas = value_cas(gv.value.data(), gv.value.length());
+            }
+            cb.callback(gv);
+            delete this;
+        }
+
+    private:
+        Callback<GetValue> &cb;
+
+        DISALLOW_COPY_AND_ASSIGN(CasFiller);
+    };
+
+    /**
+     * Runs a mutation as a get followed by a set for KVStore::mutate.
+     */
+    class ReadModifyWrite : public Callback<GetValue>, public Callback<bool> {
+    public:
+        ReadModifyWrite(KVStore &s, std::string &k, Mutation &mut,
+                        Callback<MutationResult> &c)
+            : store(s), key(k), m(mut), cb(c) {}
+
+        void callback(GetValue &gv) {
+            result.status = m.apply(gv.success ? gv.value.data() : NULL,
+                                    gv.value.length(), value, result.number);
+            if (result.status != MUTATION_DONE) {
+                done();
+                return;
+            }
+            store.set(key, value, *static_cast<Callback<bool>*>(this));
+        }
+
+        void callback(bool &stored) {
+            if (stored) {
+                result.cas = value_cas(value.data(), value.length());
+            } else {
+                result.status = MUTATION_FAILED;
+                result.number = 0;
+            }
+            done();
+        }
+
+    private:
+
+        void done() {
+            cb.callback(result);
+            delete this;
+        }
+
+        KVStore                  &store;
+        std::string               key;
+        Mutation                  m;
+        std::string               value;
+        MutationResult            result;
+        Callback<MutationResult> &cb;
+
+        DISALLOW_COPY_AND_ASSIGN(ReadModifyWrite);
+    };
+
+    inline void KVStore::gets(std::string &key, Callback<GetValue> &cb) {
+        get(key, *new CasFiller(cb));
+    }
+
+    inline void KVStore::mutate(std::string &key, Mutation &m,
+                                Callback<MutationResult> &cb) {
+        ReadModifyWrite *rmw = new ReadModifyWrite(*this, key, m, cb);
+        get(key, *static_cast<Callback<GetValue>*>(rmw));
+    }
+
     /**
      * Assertion errors.
      */
@@ -27,16 +27,21 @@ void BDBStore::reset() {
 
 void BDBStore::set(std::string &key, std::string &val,
                    Callback<bool> &cb) {
+    set(key, val.c_str(), cb);
+}
+
+void BDBStore::set(std::string &key, const char *val,
+                   Callback<bool> &cb) {
 
     DBT bdbkey, bdbdata;
     memset(&bdbkey, 0, sizeof(DBT));
     memset(&bdbdata, 0, sizeof(DBT));
 
     bdbkey.data = (void*)key.c_str();
-    bdbkey.size = key.length();
+    bdbkey.size = (u_int32_t)key.length();
 
-    bdbdata.data = (void*)val.c_str();
-    bdbdata.size = val.length() + 1;
+    bdbdata.data = (void*)val;
+    bdbdata.size = (u_int32_t)strlen(val) + 1;
 
     int ret = db->put(db, NULL, &bdbkey, &bdbdata, 0);
     bool rv = ret == 0;
@@ -54,7 +59,7 @@ void BDBStore::get(std::string &key, Callback<GetValue> &cb) {
     memset(&bdbdata, 0, sizeof(DBT));
 
     bdbkey.data = (void*)key.c_str();
-    bdbkey.size = key.length();
+    bdbkey.size = (u_int32_t)key.length();
 
     bdbdata.ulen = 1*1024*1024;
     bdbdata.flags = DB_DBT_MALLOC;
@@ -77,7 +82,7 @@ void BDBStore::del(std::string &key, Callback<bool> &cb) {
     memset(&bdbkey, 0, sizeof(DBT));
 
     bdbkey.data = (void*)key.c_str();
-    bdbkey.size = key.length();
+    bdbkey.size = (u_int32_t)key.length();
 
     bool rv = true;
     if (db->del(db, NULL, &bdbkey, 0) != 0) {
@@ -87,6 +92,96 @@ void BDBStore::del(std::string &key, Callback<bool> &cb) {
     cb.callback(rv);
 }
 
+void BDBStore::setMulti(std::vector<KeyValue> &items,
+                        Callback<std::vector<bool> > &cb) {
+    std::vector<bool> rv(items.size());
+    DBT bdbkey, bdbdata;
+    memset(&bdbkey, 0, sizeof(DBT));
+    memset(&bdbdata, 0, sizeof(DBT));
+
+    for (size_t i = 0; i < items.size(); i++) {
+        bdbkey.data = (void*)items[i].key.c_str();
+        bdbkey.size = (u_int32_t)items[i].key.length();
+        bdbdata.data = (void*)items[i].value.c_str();
+        bdbdata.size = (u_int32_t)items[i].value.length() + 1;
+        rv[i] = db->put(db, NULL, &bdbkey, &bdbdata, 0) == 0;
+    }
+    if (autocommit) {
+        db->sync(db, 0);
+    }
+    cb.callback(rv);
+}
+
+void BDBStore::getMulti(std::vector<std::string> &keys,
+                        Callback<std::vector<GetValue> > &cb) {
+    std::vector<GetValue> rv(keys.size());
+    DBT bdbkey, bdbdata;
+    memset(&bdbkey, 0, sizeof(DBT));
+    memset(&bdbdata, 0, sizeof(DBT));
+    // One buffer, grown as needed, serves the whole batch.
+    bdbdata.flags = DB_DBT_REALLOC;
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        bdbkey.data = (void*)keys[i].c_str();
+        bdbkey.size = (u_int32_t)keys[i].length();
+        if (db->get(db, NULL, &bdbkey, &bdbdata, 0) == 0) {
+            rv[i].value.assign(static_cast<char*>(bdbdata.data));
+            rv[i].success = true;
+        } else {
+            rv[i].value = ":(";
+            rv[i].success = false;
+        }
+    }
+    free(bdbdata.data);
+    cb.callback(rv);
+}
+
+void BDBStore::delMulti(std::vector<std::string> &keys,
+                        Callback<std::vector<bool> > &cb) {
+    std::vector<bool> rv(keys.size());
+    DBT bdbkey;
+    memset(&bdbkey, 0, sizeof(DBT));
+
+    for (size_t i = 0; i < keys.size(); i++) {
+        bdbkey.data = (void*)keys[i].c_str();
+        bdbkey.size = (u_int32_t)keys[i].length();
+        rv[i] = db->del(db, NULL, &bdbkey, 0) == 0;
+    }
+    cb.callback(rv);
+}
+
+void BDBStore::dump(Callback<KeyValue> &cb, size_t slice, size_t nslices) {
+    DBC *cursor;
+    if (db->cursor(db, NULL, &cursor, 0) != 0) {
+        throw std::runtime_error("Error opening cursor.");
+    }
+
+    DBT bdbkey, bdbdata;
+    memset(&bdbkey, 0, sizeof(DBT));
+    memset(&bdbdata, 0, sizeof(DBT));
+    bdbkey.flags = bdbdata.flags = DB_DBT_REALLOC;
+
+    int ret;
+    for (size_t i = 0;
+         (ret = cursor->get(cursor, &bdbkey, &bdbdata, DB_NEXT)) == 0;
+         i++) {
+        if (i % nslices == slice) {
+            // Values are stored with their terminating NUL.
+            kvtest::KeyValue kv(std::string(static_cast<char*>(bdbkey.data),
+                                            bdbkey.size),
+                                std::string(static_cast<char*>(bdbdata.data)));
+            cb.callback(kv);
+        }
+    }
+    free(bdbkey.data);
+    free(bdbdata.data);
+    cursor->close(cursor);
+
+    if (ret != DB_NOTFOUND) {
+        throw std::runtime_error("Error scanning DB.");
+    }
+}
+
 void BDBStore::open() {
     if(!db) {
         int ret = db_create(&db, NULL, 0);
@@ -120,3 +215,15 @@ void BDBStore::close() {
 void BDBStore::commit() {
     db->sync(db, 0);
 }
+
+void BDBStore::printStats(std::ostream &o) {
+    DB_ENV *env = db->get_env(db);
+    DB_MPOOL_STAT *st = NULL;
+    if (env->memp_stat(env, &st, NULL, 0) != 0) {
+        return;
+    }
+    o << "# pages written: " << (unsigned long)st->st_page_out
+      << ", page cache hits: " << (unsigned long)st->st_cache_hit
+      << ", misses: " << (unsigned long)st->st_cache_miss << std::endl;
+    free(st);
+}
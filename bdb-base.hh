@@ -35,11 +35,21 @@ namespace kvtest {
          */
         void commit();
 
+        /**
+         * Pages the cache has written to (and read from) the file.
+         */
+        void printStats(std::ostream &o);
+
         /**
          * Overrides set().
          */
         void set(std::string &key, std::string &val, Callback<bool> &cb);
 
+        /**
+         * Overrides set().
+         */
+        void set(std::string &key, const char *val, Callback<bool> &cb);
+
         /**
          * Overrides get().
          */
@@ -50,6 +60,33 @@ namespace kvtest {
          */
         void del(std::string &key, Callback<bool> &cb);
 
+        /**
+         * Overrides setMulti() to sync once per batch.
+         */
+        void setMulti(std::vector<KeyValue> &items,
+                      Callback<std::vector<bool> > &cb);
+
+        /**
+         * Overrides getMulti().
+         */
+        void getMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<GetValue> > &cb);
+
+        /**
+         * Overrides delMulti().
+         */
+        void delMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<bool> > &cb);
+
+        /**
+         * Overrides dump().
+         *
+         * Every slice walks the whole database (keeping every nth item), and
+         * a scan can't run alongside anything else.
+         */
+        void dump(Callback<KeyValue> &cb, size_t slice = 0,
+                  size_t nslices = 1);
+
 
     private:
         DB *db;
@@ -1,6 +1,9 @@
 #ifndef CALLBACKS_H
 #define CALLBACKS_H 1
 
+#include <pthread.h>
+#include <vector>
+
 namespace kvtest {
 
     /**
@@ -93,6 +96,234 @@ namespace kvtest {
         DISALLOW_COPY_AND_ASSIGN(RememberingCallback);
     };
 
+    /**
+     * Hands each result of a batch operation to a per-item callback
+     * (in the order of the batch).
+     */
+    template <typename T>
+    class PerItemCallback : public Callback<std::vector<T> > {
+    public:
+
+        PerItemCallback(Callback<T> &c) : cb(c) {}
+
+        void callback(std::vector<T> &values) {
+            for (size_t i = 0; i < values.size(); i++) {
+                T v = values[i];
+                cb.callback(v);
+            }
+        }
+
+    private:
+        Callback<T> &cb;
+
+        DISALLOW_COPY_AND_ASSIGN(PerItemCallback);
+    };
+
+    /**
+     * Gathers the results of a batch run as separate operations
+     * (which may complete in any order, on any thread) and hands them
+     * all to the batch's callback once the last is in.
+     *
+     * Create one with new, start an operation per item with
+     * forItem(i) as its callback, then call started().  It deletes
+     * itself once it has fired.
+     */
+    template <typename T>
+    class BatchCollector {
+    public:
+
+        BatchCollector(size_t n, Callback<std::vector<T> > &c)
+            : results(n), items(n), pending(n + 1), cb(c) {
+            pthread_mutex_init(&mutex, NULL);
+            for (size_t i = 0; i < n; i++) {
+                items[i].owner = this;
+                items[i].index = i;
+            }
+        }
+
+        ~BatchCollector() {
+            pthread_mutex_destroy(&mutex);
+        }
+
+        /**
+         * The callback for the ith item.
+         */
+        Callback<T> &forItem(size_t i) {
+            return items[i];
+        }
+
+        /**
+         * Say every item's operation has been started (so the batch
+         * can complete).
+         */
+        void started() {
+            T *none = NULL;
+            complete(0, none);
+        }
+
+    private:
+
+        class Item : public Callback<T> {
+        public:
+            Item() : owner(NULL), index(0) {}
+
+            void callback(T &value) {
+                owner->complete(index, &value);
+            }
+
+            BatchCollector *owner;
+            size_t          index;
+        };
+
+        void complete(size_t i, T *value) {
+            LockHolder lh(&mutex);
+            if (value) {
+                results[i] = *value;
+            }
+            bool last = --pending == 0;
+            lh.unlock();
+            if (last) {
+                cb.callback(results);
+                delete this;
+            }
+        }
+
+        std::vector<T>             results;
+        std::vector<Item>          items;
+        size_t                     pending;
+        Callback<std::vector<T> > &cb;
+        pthread_mutex_t            mutex;
+
+        DISALLOW_COPY_AND_ASSIGN(BatchCollector);
+    };
+
+    /**
+     * Gathers the results of a batch split into parts (each run as a
+     * batch of its own, which may complete in any order, on any
+     * thread) and hands them to the batch's callback, in the batch's
+     * order, once the last part is in.
+     *
+     * Create one with new, giving the positions in the batch of each
+     * part's items; start each non-empty part with forPart(p) as its
+     * callback, then call started().  It deletes itself once it has
+     * fired.
+     */
+    template <typename T>
+    class SplitBatchCollector {
+    public:
+
+        SplitBatchCollector(size_t n, std::vector<std::vector<size_t> > &positions,
+                            Callback<std::vector<T> > &c)
+            : results(n), parts(positions.size()), pending(1), cb(c) {
+            pthread_mutex_init(&mutex, NULL);
+            for (size_t p = 0; p < parts.size(); p++) {
+                parts[p].owner = this;
+                parts[p].positions.swap(positions[p]);
+                if (!parts[p].positions.empty()) {
+                    ++pending;
+                }
+            }
+        }
+
+        ~SplitBatchCollector() {
+            pthread_mutex_destroy(&mutex);
+        }
+
+        /**
+         * The callback for the pth part.
+         */
+        Callback<std::vector<T> > &forPart(size_t p) {
+            return parts[p];
+        }
+
+        /**
+         * Say every part has been started (so the batch can
+         * complete).
+         */
+        void started() {
+            complete(NULL, NULL);
+        }
+
+    private:
+
+        class Part : public Callback<std::vector<T> > {
+        public:
+            Part() : owner(NULL) {}
+
+            void callback(std::vector<T> &values) {
+                owner->complete(this, &values);
+            }
+
+            SplitBatchCollector *owner;
+            std::vector<size_t>  positions;
+        };
+
+        void complete(Part *part, std::vector<T> *values) {
+            LockHolder lh(&mutex);
+            if (part) {
+                for (size_t i = 0; i < values->size()
+                         && i < part->positions.size(); i++) {
+                    results[part->positions[i]] = (*values)[i];
+                }
+            }
+            bool last = --pending == 0;
+            lh.unlock();
+            if (last) {
+                cb.callback(results);
+                delete this;
+            }
+        }
+
+        std::vector<T>             results;
+        std::vector<Part>          parts;
+        size_t                     pending;
+        Callback<std::vector<T> > &cb;
+        pthread_mutex_t            mutex;
+
+        DISALLOW_COPY_AND_ASSIGN(SplitBatchCollector);
+    };
+
+    /**
+     * Fires a callback once it has itself been called n times (with
+     * true only if every call was), e.g. when each of several
+     * operations it was handed to is done.
+     *
+     * Create one with new.  It deletes itself once it has fired.
+     */
+    class CountdownCallback : public Callback<bool> {
+    public:
+
+        CountdownCallback(size_t n, Callback<bool> &c)
+            : pending(n), rv(true), cb(c) {
+            pthread_mutex_init(&mutex, NULL);
+        }
+
+        ~CountdownCallback() {
+            pthread_mutex_destroy(&mutex);
+        }
+
+        void callback(bool &value) {
+            LockHolder lh(&mutex);
+            if (!value) {
+                rv = false;
+            }
+            bool last = --pending == 0;
+            lh.unlock();
+            if (last) {
+                cb.callback(rv);
+                delete this;
+            }
+        }
+
+    private:
+        size_t          pending;
+        bool            rv;
+        Callback<bool> &cb;
+        pthread_mutex_t mutex;
+
+        DISALLOW_COPY_AND_ASSIGN(CountdownCallback);
+    };
+
 }
 
 #endif /* CALLBACKS_H */
@@ -2,6 +2,11 @@
 #include "locks.hh"
 
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/time.h>
+#include <errno.h>
+#include <time.h>
 
 namespace kvtest {
 
@@ -15,163 +20,1965 @@ namespace kvtest {
         return NULL;
     }
 
-    EventuallyPersistentStore::EventuallyPersistentStore(KVStore *t,
-                                                         size_t est) {
+    EventuallyPersistentStore::EventuallyPersistentStore(
+            KVStore *t, size_t est, hash_layout_t layout, size_t nflushers,
+            const FlushPolicy &policy)
+        : est_size(est), storage(est, 193, layout), memQuota(0),
+          expiryPagerSecs(EXPIRY_PAGER_INTERVAL), throttled(false),
+          warming(false), warmStart(0), warmEnd(0) {
 
-        pthread_mutex_init(&mutex, NULL);
-        pthread_cond_init(&cond, NULL);
-        est_size = est;
-        towrite = NULL;
-        initQueue();
-        flusher = new Flusher(this);
+        assert(t);
+        assert(nflushers > 0);
+        pthread_mutex_init(&sharedStoreMutex, NULL);
+        pthread_mutex_init(&warmupMutex, NULL);
+        pthread_mutex_init(&throttleMutex, NULL);
+        pthread_cond_init(&throttleCond, NULL);
+        std::vector<KVStore*> stores(nflushers, t);
+        startFlushers(stores, policy);
+    }
 
-        // Run in a thread...
-        if(pthread_create(&thread, NULL, launch_flusher_thread, flusher)
-           != 0) {
-            throw std::runtime_error("Error initializing queue thread");
+    EventuallyPersistentStore::EventuallyPersistentStore(
+            std::vector<KVStore*> &stores, size_t est, hash_layout_t layout,
+            const FlushPolicy &policy)
+        : est_size(est), storage(est, 193, layout), memQuota(0),
+          expiryPagerSecs(EXPIRY_PAGER_INTERVAL), throttled(false),
+          warming(false), warmStart(0), warmEnd(0) {
+
+        assert(!stores.empty());
+        pthread_mutex_init(&sharedStoreMutex, NULL);
+        pthread_mutex_init(&warmupMutex, NULL);
+        pthread_mutex_init(&throttleMutex, NULL);
+        pthread_cond_init(&throttleCond, NULL);
+        startFlushers(stores, policy);
+    }
+
+    void EventuallyPersistentStore::startFlushers(std::vector<KVStore*> &stores,
+                                                  const FlushPolicy &policy) {
+        int n = storage.getNumPartitions();
+        int nflushers = (int)stores.size();
+        assert(nflushers <= n);
+        bool shared = nflushers > 1 && stores[0] == stores[1];
+
+        for (int i = 0; i < nflushers; i++) {
+            assert(stores[i]);
+            int start = i * n / nflushers;
+            int end = (i + 1) * n / nflushers;
+            Flusher *f = new Flusher(this, stores[i], start, end,
+                                     shared ? &sharedStoreMutex : NULL,
+                                     policy);
+            flushers.push_back(f);
+            for (int b = start; b < end; b++) {
+                flusherFor.push_back(f);
+            }
         }
 
-        underlying = t;
-        assert(underlying);
+        for (size_t i = 0; i < flushers.size(); i++) {
+            flushers[i]->start();
+        }
     }
 
     EventuallyPersistentStore::~EventuallyPersistentStore() {
-        LockHolder lh(&mutex);
-        flusher->stop();
-        if(pthread_cond_signal(&cond) != 0) {
-            throw std::runtime_error("Error signaling change.");
+        waitForWarmup();
+        for (size_t i = 0; i < flushers.size(); i++) {
+            flushers[i]->stop();
+            delete flushers[i];
         }
-        lh.unlock();
-        pthread_join(thread, NULL);
-        delete flusher;
-        delete towrite;
-        pthread_cond_destroy(&cond);
-        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&throttleCond);
+        pthread_mutex_destroy(&throttleMutex);
+        pthread_mutex_destroy(&warmupMutex);
+        pthread_mutex_destroy(&sharedStoreMutex);
     }
 
-    void EventuallyPersistentStore::initQueue() {
-        assert(!towrite);
-        towrite = new std::queue<std::string>;
+    void EventuallyPersistentStore::set(std::string &key, std::string &val,
+                                        Callback<bool> &cb) {
+        set(key, val.c_str(), cb);
     }
 
-    void EventuallyPersistentStore::set(std::string &key, std::string &val,
+    void EventuallyPersistentStore::set(std::string &key, const char *val,
                                         Callback<bool> &cb) {
-        mutation_type_t mtype = storage.set(key, val);
+        setItem(key, val, 0, cb);
+    }
 
-        if (mtype == WAS_CLEAN || mtype == NOT_FOUND) {
-            LockHolder lh(&mutex);
-            queueDirty(key);
+    void EventuallyPersistentStore::setWithTTL(std::string &key,
+                                               std::string &val, uint32_t ttl,
+                                               Callback<bool> &cb) {
+        setItem(key, val.c_str(), ttl == 0 ? 0 : ep_current_time() + ttl, cb);
+    }
+
+    void EventuallyPersistentStore::setItem(std::string &key, const char *val,
+                                            uint32_t exptime,
+                                            Callback<bool> &cb) {
+        if (throttle.enabled() && shouldThrottle() && !waitForFlushers()) {
+            // Temporary failure: the client should back off and retry.
+            bool rv = false;
+            cb.callback(rv);
+            return;
+        }
+
+        mutation_type_t mtype = storage.set(key, val, exptime);
+
+        if (mtype != WAS_DIRTY) {
+            wakeFlusher(key);
         }
         bool rv = true;
         cb.callback(rv);
     }
 
-    void EventuallyPersistentStore::set(std::string &key, const char *val,
-                                        Callback<bool> &cb) {
-        mutation_type_t mtype = storage.set(key, val);
+    void EventuallyPersistentStore::setExpiryPagerInterval(uint32_t secs) {
+        expiryPagerSecs = secs;
+        // Idle flushers work out when to run it next as they wake.
+        for (size_t i = 0; i < flushers.size(); i++) {
+            flushers[i]->wake();
+        }
+    }
 
-        if (mtype == WAS_CLEAN || mtype == NOT_FOUND) {
-            LockHolder lh(&mutex);
-            queueDirty(key);
+    void EventuallyPersistentStore::setThrottle(const ThrottlePolicy &p) {
+        LockHolder lh(&throttleMutex);
+        throttle = p;
+        if (throttle.lowItems == 0 || throttle.lowItems > throttle.highItems) {
+            throttle.lowItems = throttle.highItems;
+        }
+        if (throttle.lowBytes == 0 || throttle.lowBytes > throttle.highBytes) {
+            throttle.lowBytes = throttle.highBytes;
+        }
+        throttled.set(false);
+        pthread_cond_broadcast(&throttleCond);
+    }
+
+    static inline bool above(size_t n, size_t mark) {
+        return mark > 0 && n > mark;
+    }
+
+    bool EventuallyPersistentStore::shouldThrottle() {
+        size_t items = storage.getDirtyItems();
+        size_t bytes = storage.getDirtyBytes();
+        // Once throttling, keep at it until the flushers have caught
+        // up to the low watermarks.
+        bool was = throttled.get();
+        bool rv;
+        if (was) {
+            rv = above(items, throttle.lowItems)
+                || above(bytes, throttle.lowBytes);
+        } else {
+            rv = above(items, throttle.highItems)
+                || above(bytes, throttle.highBytes);
         }
+        // Any set may cross a watermark, so only the first to see the
+        // change makes it.
+        if (rv != was) {
+            throttled.cas(was, rv);
+        }
+        return rv;
+    }
+
+    bool EventuallyPersistentStore::waitForFlushers() {
+        if (throttle.reject) {
+            numRejected.incr();
+            return false;
+        }
+
+        numThrottled.incr();
+        uint64_t start = now_usec();
+        uint64_t until = start + throttle.maxDelayMs * 1000;
+        struct timespec ts;
+        ts.tv_sec = (time_t)(until / 1000000);
+        ts.tv_nsec = (long)(until % 1000000) * 1000;
         bool rv = true;
-        cb.callback(rv);
+
+        // Flushers broadcast under the lock after each commit, so
+        // nothing committed after we check can be missed.
+        LockHolder lh(&throttleMutex);
+        while (rv && throttle.enabled() && shouldThrottle()) {
+            int rc = throttle.maxDelayMs > 0
+                ? pthread_cond_timedwait(&throttleCond, &throttleMutex, &ts)
+                : pthread_cond_wait(&throttleCond, &throttleMutex);
+            if (rc == ETIMEDOUT) {
+                rv = !shouldThrottle();
+            } else if (rc != 0) {
+                throw std::runtime_error("Error waiting for signal.");
+            }
+        }
+        lh.unlock();
+
+        throttleUsec.incr(now_usec() - start);
+        if (!rv) {
+            numRejected.incr();
+        }
+        return rv;
+    }
+
+    void EventuallyPersistentStore::releaseThrottled() {
+        if (throttle.enabled()) {
+            LockHolder lh(&throttleMutex);
+            pthread_cond_broadcast(&throttleCond);
+        }
     }
 
     void EventuallyPersistentStore::reset() {
-        flush(false);
-        LockHolder lh(&mutex);
-        underlying->reset();
-        delete towrite;
-        towrite = NULL;
-        initQueue();
+        waitForWarmup();
+        // Hold every flusher's transaction lock so nothing is in the
+        // middle of writing items out while they're cleared (dirty
+        // ones included, as the store's about to be reset anyway).
+        std::vector<pthread_mutex_t*> locked;
+        for (size_t i = 0; i < flushers.size(); i++) {
+            pthread_mutex_t *m = flushers[i]->getTxnMutex();
+            if (locked.empty() || locked.back() != m) {
+                if (pthread_mutex_lock(m) != 0) {
+                    throw std::runtime_error("Failed to acquire lock.");
+                }
+                locked.push_back(m);
+                flushers[i]->getUnderlying()->reset();
+            }
+        }
         storage.clear();
+        for (size_t i = 0; i < flushers.size(); i++) {
+            flushers[i]->resetHistograms();
+        }
+        for (size_t i = 0; i < locked.size(); i++) {
+            pthread_mutex_unlock(locked[i]);
+        }
+        releaseThrottled();
+    }
+
+    void EventuallyPersistentStore::commit() {
+        waitForWarmup();
+        for (size_t i = 0; i < flushers.size(); i++) {
+            flushers[i]->flush(false);
+            // The flusher's own pass may have taken the last of it and
+            // still be writing.
+            LockHolder txn(flushers[i]->getTxnMutex());
+        }
+    }
+
+    void EventuallyPersistentStore::printStats(std::ostream &o) {
+        size_t items = storage.getNumItems();
+        size_t nonResident = storage.getNumNonResident();
+        uint64_t fetches = numFetches.get();
+        o << "# items: " << items
+          << ", buckets: " << storage.getNumBuckets() << std::endl;
+        o << "# resident: "
+          << (items > 0 ? 100.0 * (double)(items - nonResident) / (double)items
+              : 100.0)
+          << "%, value bytes: " << storage.getValueBytes()
+          << ", retired bytes: " << storage.getRetiredBytes()
+          << ", ejections: " << numEjections.get() << std::endl;
+        o << "# fetches: " << fetches << ", avg usec: "
+          << (fetches > 0 ? fetchUsec.get() / fetches : 0)
+          << ", max usec: " << fetchMaxUsec.get() << std::endl;
+        if (throttle.enabled()) {
+            uint64_t delayed = numThrottled.get();
+            o << "# dirty items: " << storage.getDirtyItems()
+              << ", dirty bytes: " << storage.getDirtyBytes()
+              << ", throttled sets: " << delayed
+              << ", avg delay usec: "
+              << (delayed > 0 ? throttleUsec.get() / delayed : 0)
+              << ", rejected sets: " << numRejected.get() << std::endl;
+        }
+        uint64_t expired = storage.getNumExpired();
+        uint64_t reclaimed = storage.getNumReclaimed();
+        if (expired > 0 || reclaimed > 0) {
+            o << "# expired reads: " << expired
+              << ", reclaimed items: " << reclaimed << std::endl;
+        }
+        if (warmStart != 0) {
+            printWarmup(o);
+        }
+        o << "# flusher\tbuckets\titems\tcommits\tbacklog\titems/s"
+          << std::endl;
+        for (size_t i = 0; i < flushers.size(); i++) {
+            o << i << "\t";
+            flushers[i]->printStats(o);
+        }
+        FlushHistograms h;
+        getFlushHistograms(h);
+        h.print(o);
+        storage.getSlabs().printStats(o);
+        // Flushers may share a store.
+        for (size_t i = 0; i < flushers.size(); i++) {
+            KVStore *kvs = flushers[i]->getUnderlying();
+            if (i == 0 || kvs != flushers[i - 1]->getUnderlying()) {
+                kvs->printStats(o);
+            }
+        }
     }
 
     void EventuallyPersistentStore::get(std::string &key,
                                         Callback<kvtest::GetValue> &cb) {
-        int bucket_num = storage.bucket(key);
-        LockHolder lh(storage.getMutex(bucket_num));
-        StoredValue *v = storage.unlocked_find(key, bucket_num);
-        bool success = v != NULL;
-        const char *sval = v ? v->getValue() : NULL;
-        kvtest::GetValue rv(success ? sval : std::string(":("),
-                            success);
+        lookup(key, cb, false);
+    }
+
+    void EventuallyPersistentStore::gets(std::string &key,
+                                         Callback<kvtest::GetValue> &cb) {
+        lookup(key, cb, true);
+    }
+
+    void EventuallyPersistentStore::lookup(std::string &key,
+                                           Callback<kvtest::GetValue> &cb,
+                                           bool withCas) {
+        // Copy the value straight into the result.
+        kvtest::GetValue rv;
+        value_state_t state = storage.get(key, rv.value,
+                                          withCas ? &rv.cas : NULL);
+        if (state == VALUE_EJECTED || (state == VALUE_MISSING && warming)) {
+            flusherFor[storage.bucket(key)]->fetch(key, cb);
+            return;
+        }
+        rv.success = state == VALUE_FOUND;
+        if (!rv.success) {
+            rv.value = ":(";
+        }
         cb.callback(rv);
-        lh.unlock();
+    }
+
+    /**
+     * A mutation waiting for its item's value to be fetched back
+     * from the store.
+     */
+    class PendingMutation : public Callback<GetValue> {
+    public:
+        PendingMutation(EventuallyPersistentStore &s, std::string &k,
+                        Mutation &mut, Callback<MutationResult> &c)
+            : store(s), key(k), m(mut), cb(c) {}
+
+        void callback(GetValue &gv) {
+            // The value is back in memory (unless the item's gone),
+            // so try again.
+            store.applyMutation(key, m, cb, true);
+            delete this;
+        }
+
+    private:
+        EventuallyPersistentStore &store;
+        std::string                key;
+        Mutation                   m;
+        Callback<MutationResult>  &cb;
+
+        DISALLOW_COPY_AND_ASSIGN(PendingMutation);
+    };
+
+    void EventuallyPersistentStore::mutate(std::string &key, Mutation &m,
+                                           Callback<MutationResult> &cb) {
+        if (throttle.enabled() && shouldThrottle() && !waitForFlushers()) {
+            MutationResult r;
+            r.status = MUTATION_FAILED;
+            cb.callback(r);
+            return;
+        }
+        applyMutation(key, m, cb, false);
+    }
+
+    void EventuallyPersistentStore::applyMutation(std::string &key,
+                                                  Mutation &m,
+                                                  Callback<MutationResult> &cb,
+                                                  bool fetched) {
+        MutationResult r;
+        update_state_t state = storage.mutate(key, m, r);
+        // The store may have what warmup hasn't loaded yet.
+        bool unloaded = state == UPDATE_SKIPPED
+            && r.status == MUTATION_NOT_FOUND && warming && !fetched;
+        if (state == UPDATE_EJECTED || unloaded) {
+            flusherFor[storage.bucket(key)]->fetch(key,
+                *new PendingMutation(*this, key, m, cb));
+            return;
+        }
+        if (state == UPDATE_QUEUED) {
+            wakeFlusher(key);
+        }
+        cb.callback(r);
     }
 
     void EventuallyPersistentStore::del(std::string &key, Callback<bool> &cb) {
-        bool existed = storage.del(key);
-        if (existed) {
-            queueDirty(key);
+        // The store may have what warmup hasn't loaded yet.
+        bool warm = warming;
+        bool existed = storage.del(key, warm);
+        if (existed || warm) {
+            wakeFlusher(key);
         }
         cb.callback(existed);
     }
 
-    void EventuallyPersistentStore::queueDirty(std::string &key) {
-        // Assume locked.
-        towrite->push(key);
+    void EventuallyPersistentStore::setMulti(std::vector<KeyValue> &items,
+                                             Callback<std::vector<bool> > &cb) {
+        std::vector<bool> rv(items.size(), false);
+        if (throttle.enabled() && shouldThrottle() && !waitForFlushers()) {
+            cb.callback(rv);
+            return;
+        }
+
+        for (size_t i = 0; i < items.size(); i++) {
+            if (storage.set(items[i].key, items[i].value.c_str())
+                != WAS_DIRTY) {
+                wakeFlusher(items[i].key);
+            }
+            rv[i] = true;
+        }
+        cb.callback(rv);
+    }
+
+    void EventuallyPersistentStore::getMulti(
+            std::vector<std::string> &keys,
+            Callback<std::vector<GetValue> > &cb) {
+        std::vector<GetValue> rv(keys.size());
+        std::vector<size_t> fetches;
+        for (size_t i = 0; i < keys.size(); i++) {
+            value_state_t state = storage.get(keys[i], rv[i].value);
+            if (state == VALUE_EJECTED || (state == VALUE_MISSING && warming)) {
+                fetches.push_back(i);
+                continue;
+            }
+            rv[i].success = state == VALUE_FOUND;
+            if (!rv[i].success) {
+                rv[i].value = ":(";
+            }
+        }
+        if (fetches.empty()) {
+            cb.callback(rv);
+            return;
+        }
+
+        // Gather what's resident with what the flushers read back.
+        BatchCollector<GetValue> *c =
+            new BatchCollector<GetValue>(keys.size(), cb);
+        std::vector<size_t>::iterator f = fetches.begin();
+        for (size_t i = 0; i < keys.size(); i++) {
+            if (f != fetches.end() && *f == i) {
+                flusherFor[storage.bucket(keys[i])]->fetch(keys[i],
+                                                           c->forItem(i));
+                ++f;
+            } else {
+                c->forItem(i).callback(rv[i]);
+            }
+        }
+        c->started();
+    }
+
+    void EventuallyPersistentStore::delMulti(std::vector<std::string> &keys,
+                                             Callback<std::vector<bool> > &cb) {
+        std::vector<bool> rv(keys.size());
+        bool warm = warming;
+        for (size_t i = 0; i < keys.size(); i++) {
+            rv[i] = storage.del(keys[i], warm);
+            if (rv[i] || warm) {
+                wakeFlusher(keys[i]);
+            }
+        }
+        cb.callback(rv);
+    }
+
+    /**
+     * Loads scanned items into the hash table.
+     */
+    class WarmupLoader : public Callback<KeyValue> {
+    public:
+        WarmupLoader(HashTable &ht, volatile size_t &q, Atomic<uint64_t> &n)
+            : storage(ht), quota(q), loaded(n), count(0), resident(true) {}
+
+        ~WarmupLoader() {
+            loaded.incr(count);
+        }
+
+        void callback(KeyValue &kv) {
+            // Past the quota, only keys are loaded.
+            if (count % 256 == 0) {
+                size_t q = quota;
+                resident = q == 0 || storage.getValueBytes() < q;
+                loaded.incr(count);
+                count = 0;
+            }
+            if (storage.warm(kv.key, kv.value.c_str(), resident)) {
+                ++count;
+            }
+        }
+
+    private:
+        HashTable        &storage;
+        volatile size_t  &quota;
+        Atomic<uint64_t> &loaded;
+        uint64_t          count;
+        bool              resident;
+
+        DISALLOW_COPY_AND_ASSIGN(WarmupLoader);
+    };
+
+    /**
+     * Hands a snapshot's items to a dump callback.
+     */
+    class SnapshotDumper : public SnapshotVisitor {
+    public:
+        SnapshotDumper(HashTable &ht, std::vector<Flusher*> &f,
+                       Callback<KeyValue> &c)
+            : storage(ht), flusherFor(f), cb(c) {}
+
+        void visit(std::string &key, Blob *value) {
+            KeyValue kv;
+            kv.key = key;
+            if (value) {
+                kv.value.assign(value->getData(), value->length());
+            } else {
+                Flusher *f = flusherFor[storage.bucket(key)];
+                Future<GetValue> gcb;
+                LockHolder txn(f->getTxnMutex());
+                f->getUnderlying()->get(key, gcb);
+                txn.unlock();
+                gcb.wait();
+                if (!gcb.val.success) {
+                    // Deleted and persisted since.
+                    return;
+                }
+                kv.value = gcb.val.value;
+            }
+            cb.callback(kv);
+        }
+
+    private:
+        HashTable            &storage;
+        std::vector<Flusher*> &flusherFor;
+        Callback<KeyValue>   &cb;
+
+        DISALLOW_COPY_AND_ASSIGN(SnapshotDumper);
+    };
+
+    void EventuallyPersistentStore::dump(Callback<KeyValue> &cb, size_t slice,
+                                         size_t nslices) {
+        waitForWarmup();
+        SnapshotDumper dumper(storage, flusherFor, cb);
+        storage.scan(dumper, true, (int)slice, (int)nslices);
+    }
+
+    void EventuallyPersistentStore::warmup(size_t nthreads, bool wait) {
+        assert(nthreads > 0);
+        waitForWarmup();
+
+        LockHolder lh(&warmupMutex);
+        warmedItems.set(0);
+        warmStart = now_usec();
+        warmEnd = 0;
+        warming = true;
+
+        // Flushers sharing a store are next to each other.
+        for (size_t i = 0; i < flushers.size(); i++) {
+            KVStore *kvs = flushers[i]->getUnderlying();
+            if (i > 0 && kvs == flushers[i - 1]->getUnderlying()) {
+                continue;
+            }
+            size_t max = kvs->getMaxScanSlices();
+            size_t n = max == 0 ? 1 : std::min(nthreads, max);
+            for (size_t j = 0; j < n; j++) {
+                WarmupSlice *ws = new WarmupSlice;
+                ws->store = this;
+                ws->kvs = kvs;
+                ws->txnMutex = max == 0 ? flushers[i]->getTxnMutex() : NULL;
+                ws->slice = j;
+                ws->nslices = n;
+                warmers.push_back(ws);
+            }
+        }
+
+        warmersRunning.set((int)warmers.size());
+        for (size_t i = 0; i < warmers.size(); i++) {
+            if (pthread_create(&warmers[i]->thread, NULL, launchWarmup,
+                               warmers[i]) != 0) {
+                throw std::runtime_error("Error starting warmup thread");
+            }
+        }
+        lh.unlock();
+
+        if (wait) {
+            uint64_t next = warmStart;
+            while (warming) {
+                usleep(10000);
+                if (now_usec() >= next + 1000000) {
+                    next = now_usec();
+                    printWarmup(std::cout);
+                }
+            }
+            waitForWarmup();
+            printWarmup(std::cout);
+        }
+    }
+
+    void *EventuallyPersistentStore::launchWarmup(void *arg) {
+        WarmupSlice *ws = static_cast<WarmupSlice*>(arg);
+        ws->store->warmSlice(ws);
+        return NULL;
+    }
+
+    void EventuallyPersistentStore::warmSlice(WarmupSlice *ws) {
+        try {
+            WarmupLoader loader(storage, memQuota, warmedItems);
+            if (ws->txnMutex) {
+                LockHolder lh(ws->txnMutex);
+                ws->kvs->dump(loader, ws->slice, ws->nslices);
+            } else {
+                ws->kvs->dump(loader, ws->slice, ws->nslices);
+            }
+        } catch(std::runtime_error &e) {
+            std::cerr << "Error warming up: " << e.what() << std::endl;
+        }
+        if (warmersRunning.decr() == 0) {
+            finishWarmup();
+        }
+    }
+
+    void EventuallyPersistentStore::finishWarmup() {
+        warmEnd = now_usec();
+        warming = false;
+        // Deletes persisted during warmup left their tombstones in
+        // case a scan was about to load what they deleted.
+        for (size_t i = 0; i < flushers.size(); i++) {
+            flushers[i]->sweepTombstones();
+        }
+    }
+
+    void EventuallyPersistentStore::waitForWarmup() {
+        LockHolder lh(&warmupMutex);
+        for (size_t i = 0; i < warmers.size(); i++) {
+            pthread_join(warmers[i]->thread, NULL);
+            delete warmers[i];
+        }
+        warmers.clear();
+    }
+
+    void EventuallyPersistentStore::printWarmup(std::ostream &o) {
+        uint64_t end = warmEnd;
+        uint64_t usec = (end ? end : now_usec()) - warmStart;
+        uint64_t items = warmedItems.get();
+        o << "# warmup: " << items << " items in "
+          << (double)usec / 1000000.0 << "s ("
+          << (usec > 0 ? items * 1000000 / usec : 0) << " items/s)"
+          << (end ? "" : ", running") << std::endl;
+    }
+
+    void EventuallyPersistentStore::wakeFlusher(std::string &key) {
+        if (flushers.size() == 1) {
+            flushers[0]->wake();
+        } else {
+            flusherFor[storage.bucket(key)]->wake();
+        }
+    }
+
+    Flusher::Flusher(EventuallyPersistentStore *st, KVStore *kvs,
+                     int start, int end, pthread_mutex_t *txn,
+                     const FlushPolicy &pol)
+        : store(st), underlying(kvs), startBucket(start), endBucket(end),
+          policy(pol), lingerStart(0), uncommittedItems(0),
+          uncommittedBytes(0), ejectCursor(0), ejectStalled(false),
+          nextExpiry(0), expiryInterval(0), needSweep(false),
+          idle(false), running(false) {
+
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+        // A store of our own only needs guarding against reset.
+        txnMutex = txn;
+        if (!txnMutex) {
+            txnMutex = new pthread_mutex_t;
+            pthread_mutex_init(txnMutex, NULL);
+        }
+        ownTxnMutex = txn == NULL;
+    }
+
+    Flusher::~Flusher() {
+        stop();
+        if (ownTxnMutex) {
+            pthread_mutex_destroy(txnMutex);
+            delete txnMutex;
+        }
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void Flusher::start() {
+        running = true;
+        if(pthread_create(&thread, NULL, launch_flusher_thread, this)
+           != 0) {
+            running = false;
+            throw std::runtime_error("Error initializing flusher thread");
+        }
+    }
+
+    void Flusher::stop() {
+        LockHolder lh(&mutex);
+        if (!running) {
+            return;
+        }
+        running = false;
         if(pthread_cond_signal(&cond) != 0) {
             throw std::runtime_error("Error signaling change.");
         }
+        lh.unlock();
+        pthread_join(thread, NULL);
+    }
+
+    void Flusher::run() {
+        try {
+            while(running) {
+                flush(true);
+            }
+            // Nobody else will answer these.
+            LockHolder txn(txnMutex);
+            serviceFetches();
+            txn.unlock();
+            std::cout << "Shutting down flusher." << std::endl;
+        } catch(std::runtime_error &e) {
+            std::cerr << "Exception in executor loop: "
+                      << e.what() << std::endl;
+            assert(false);
+        }
     }
 
-    void EventuallyPersistentStore::flush(bool shouldWait) {
+    void Flusher::wake() {
+        // The item is already on a dirty list, so a flusher that
+        // isn't idle will find it without being told.
+        if (idle.get()) {
+            LockHolder lh(&mutex);
+            if(pthread_cond_signal(&cond) != 0) {
+                throw std::runtime_error("Error signaling change.");
+            }
+        }
+    }
+
+    void Flusher::sweepTombstones() {
+        LockHolder lh(&mutex);
+        needSweep = true;
+        if(pthread_cond_signal(&cond) != 0) {
+            throw std::runtime_error("Error signaling change.");
+        }
+    }
+
+    void Flusher::fetch(std::string &key, Callback<GetValue> &cb) {
+        FetchRequest req;
+        req.key = key;
+        req.cb = &cb;
+        req.queued = now_usec();
+        LockHolder lh(&mutex);
+        fetches.push(req);
+        pendingFetches.incr();
+        if(pthread_cond_signal(&cond) != 0) {
+            throw std::runtime_error("Error signaling change.");
+        }
+    }
+
+    void Flusher::serviceFetches() {
+        if (!hasFetches()) {
+            return;
+        }
+        std::queue<FetchRequest> q;
         LockHolder lh(&mutex);
+        std::swap(q, fetches);
+        pendingFetches.set(0);
+        lh.unlock();
+
+        HashTable &storage = store->storage;
+        while (!q.empty()) {
+            FetchRequest &req = q.front();
+            Future<GetValue> gcb;
+            underlying->get(req.key, gcb);
+            gcb.wait();
+
+            GetValue rv;
+            rv.success = gcb.val.success
+                && storage.restore(req.key, gcb.val.value, rv.value,
+                                   store->warming, &rv.cas) == VALUE_FOUND;
+            if (!rv.success) {
+                rv.value = ":(";
+            }
+            req.cb->callback(rv);
+
+            uint64_t took = now_usec() - req.queued;
+            store->numFetches.incr();
+            store->fetchUsec.incr(took);
+            uint64_t prev = store->fetchMaxUsec.get();
+            while (took > prev && !store->fetchMaxUsec.cas(prev, took)) {
+                prev = store->fetchMaxUsec.get();
+            }
+            q.pop();
+        }
+        // Fetched values are clean, so they can go again.
+        ejectStalled = false;
+        ejectValues();
+    }
+
+    void Flusher::ejectValues() {
+        size_t quota = store->memQuota;
+        HashTable &storage = store->storage;
+        if (quota == 0) {
+            return;
+        }
+        // Values replaced or ejected still take up memory until
+        // readers have moved on, so they count too.
+        size_t used = storage.getValueBytes() + storage.getRetiredBytes();
+        if (used <= quota) {
+            return;
+        }
+        reclaimRetired();
+        used = storage.getValueBytes() + storage.getRetiredBytes();
+        if (used <= quota || ejectStalled) {
+            return;
+        }
+
+        // Get back down to the low watermark, with each flusher
+        // taking its share from its own partitions, spread evenly.
+        size_t excess = used - quota / 100 * EJECT_LOW_WATERMARK;
+        int nparts = endBucket - startBucket;
+        size_t share = excess / (size_t)storage.getNumPartitions()
+            * (size_t)nparts + 1;
+        size_t freed = 0, count = 0;
+        int n;
+        for (n = 0; n < nparts && freed < share; n++) {
+            size_t want = (share - freed) / (size_t)(nparts - n) + 1;
+            int i = startBucket + (ejectCursor + n) % nparts;
+            freed += storage.eject(i, want, count);
+        }
+        ejectCursor = (ejectCursor + n) % nparts;
+        store->numEjections.incr(count);
+        // What was ejected can usually go right away.
+        reclaimRetired();
+        // Most of what's left is dirty, so don't keep scanning for it
+        // until something is committed or fetched.
+        ejectStalled = freed < share / 2;
+    }
+
+    void Flusher::expireItems() {
+        uint32_t interval = store->expiryPagerSecs;
+        uint64_t now = now_usec();
+        if (interval != expiryInterval) {
+            expiryInterval = interval;
+            nextExpiry = interval == 0 ? 0 : now + (uint64_t)interval * 1000000;
+        }
+        if (nextExpiry == 0 || now < nextExpiry) {
+            return;
+        }
+        nextExpiry = now + (uint64_t)interval * 1000000;
+
+        // What this turns into deletes goes out with the next flush.
+        uint32_t t = ep_current_time();
+        for (int i = startBucket; i < endBucket; i++) {
+            store->storage.expire(i, t);
+        }
+    }
+
+    bool Flusher::hasRetired() {
+        for (int i = startBucket; i < endBucket; i++) {
+            if (store->storage.hasRetired(i)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Flusher::reclaimRetired() {
+        for (int i = startBucket; i < endBucket; i++) {
+            store->storage.reclaim(i);
+        }
+    }
+
+    bool Flusher::hasDirty() {
+        for (int i = startBucket; i < endBucket; i++) {
+            if (store->storage.getNumDirty(i) > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t Flusher::getBacklog() {
+        size_t rv = 0;
+        for (int i = startBucket; i < endBucket; i++) {
+            rv += store->storage.getNumDirty(i);
+        }
+        return rv;
+    }
+
+    void FlushHistograms::merge(const FlushHistograms &h) {
+        batchItems.merge(h.batchItems);
+        batchBytes.merge(h.batchBytes);
+        commitUsec.merge(h.commitUsec);
+        writeUsec.merge(h.writeUsec);
+        dirtyAgeUsec.merge(h.dirtyAgeUsec);
+    }
+
+    void FlushHistograms::reset() {
+        batchItems.reset();
+        batchBytes.reset();
+        commitUsec.reset();
+        writeUsec.reset();
+        dirtyAgeUsec.reset();
+    }
+
+    void FlushHistograms::print(std::ostream &o) const {
+        Histogram::printHeader(o);
+        batchItems.print(o, "items/commit");
+        batchBytes.print(o, "bytes/commit");
+        commitUsec.print(o, "commit usec");
+        writeUsec.print(o, "write usec");
+        dirtyAgeUsec.print(o, "dirty age usec");
+    }
+
+    void EventuallyPersistentStore::getFlushHistograms(FlushHistograms &h) {
+        for (size_t i = 0; i < flushers.size(); i++) {
+            h.merge(flushers[i]->getHistograms());
+        }
+    }
+
+    void Flusher::printStats(std::ostream &o) {
+        uint64_t items = itemsFlushed.get();
+        uint64_t usec = busyUsec.get();
+        o << startBucket << "-" << endBucket - 1 << "\t"
+          << items << "\t" << commits.get() << "\t"
+          << getBacklog() << "\t"
+          << (usec > 0 ? items * 1000000 / usec : 0) << std::endl;
+    }
 
-        if (towrite->empty()) {
+    bool Flusher::shouldLinger() {
+        if (policy.minItems <= 1 || policy.maxLingerMs == 0
+            || getBacklog() >= policy.minItems) {
+            return false;
+        }
+        uint64_t now = now_usec();
+        if (lingerStart == 0) {
+            lingerStart = now;
+        }
+        return now < lingerStart + policy.maxLingerMs * 1000;
+    }
+
+    void Flusher::flush(bool shouldWait) {
+        if (shouldWait) {
+            expireItems();
+            reclaimRetired();
+        }
+
+        if (hasFetches()) {
+            LockHolder txn(txnMutex);
+            serviceFetches();
+        }
+
+        if (needSweep) {
+            LockHolder txn(txnMutex);
+            needSweep = false;
+            for (int i = startBucket; i < endBucket; i++) {
+                store->storage.purgeTombstones(i);
+            }
+        }
+
+        if (!hasDirty()) {
             if (shouldWait) {
-                if(pthread_cond_wait(&cond, &mutex) != 0) {
+                LockHolder lh(&mutex);
+                idle.set(true);
+                // Anything queued before we went idle is visible now,
+                // and anything after will signal.
+                if (!hasDirty() && !hasFetches() && !needSweep && running) {
+                    // Up until the expiry pager is due, or it's time
+                    // to free what was retired.
+                    uint64_t until = nextExpiry;
+                    if (hasRetired()) {
+                        uint64_t r = now_usec() + RETIRED_RECLAIM_MS * 1000;
+                        if (until == 0 || r < until) {
+                            until = r;
+                        }
+                    }
+                    if (until == 0) {
+                        if(pthread_cond_wait(&cond, &mutex) != 0) {
+                            throw std::runtime_error(
+                                "Error waiting for signal.");
+                        }
+                    } else {
+                        struct timespec ts;
+                        ts.tv_sec = (time_t)(until / 1000000);
+                        ts.tv_nsec = (long)(until % 1000000) * 1000;
+                        int rc = pthread_cond_timedwait(&cond, &mutex, &ts);
+                        if (rc != 0 && rc != ETIMEDOUT) {
+                            throw std::runtime_error(
+                                "Error waiting for signal.");
+                        }
+                    }
+                }
+                idle.set(false);
+            }
+            return;
+        }
+
+        if (shouldWait && shouldLinger()) {
+            // Give the batch a chance to fill up.  Each new dirty item
+            // wakes us to check again.
+            uint64_t until = lingerStart + policy.maxLingerMs * 1000;
+            struct timespec ts;
+            ts.tv_sec = (time_t)(until / 1000000);
+            ts.tv_nsec = (long)(until % 1000000) * 1000;
+            LockHolder lh(&mutex);
+            idle.set(true);
+            if (running && !hasFetches()
+                && getBacklog() < policy.minItems) {
+                int rc = pthread_cond_timedwait(&cond, &mutex, &ts);
+                if (rc != 0 && rc != ETIMEDOUT) {
                     throw std::runtime_error("Error waiting for signal.");
                 }
             }
+            idle.set(false);
+            return;
+        }
+        // Lingering is left to the flusher's own thread.
+        if (shouldWait) {
+            lingerStart = 0;
+        }
+
+        HashTable &storage = store->storage;
+        RememberingCallback<bool> cb;
+        std::vector<StoredValue*> deleted;
+        uint64_t flushed = 0;
+        size_t batchItems = 0, batchBytes = 0;
+
+        LockHolder txn(txnMutex);
+        uint64_t start = now_usec();
+        underlying->begin();
+        if (policy.sortKeys) {
+            flushed = flushSorted(deleted, cb);
+        } else {
+            for (int i = startBucket; i < endBucket; i++) {
+                LockHolder lh(storage.getMutex(i));
+                StoredValue *v = storage.takeDirty(i);
+                lh.unlock();
+                while (v) {
+                    // Items taken off the list stay dirty until they're
+                    // written, so a cap can split the list across
+                    // transactions.
+                    v = flushOne(i, v, deleted, batchBytes, cb);
+                    ++flushed;
+                    // Don't keep gets waiting for a whole pass.
+                    serviceFetches();
+                    if (batchFull(++batchItems, batchBytes)) {
+                        commit(deleted);
+                        underlying->begin();
+                        batchItems = batchBytes = 0;
+                    }
+                }
+            }
+        }
+        commit(deleted);
+        uint64_t end = now_usec();
+        // Counted before anyone waiting on the transaction sees it.
+        itemsFlushed.incr(flushed);
+        busyUsec.incr(end - start);
+
+        // Whatever was just written can now be ejected.
+        ejectValues();
+    }
+
+    void Flusher::commit(std::vector<StoredValue*> &deleted) {
+        HashTable &storage = store->storage;
+        uint64_t start = now_usec();
+        underlying->commit();
+        uint64_t end = now_usec();
+        commits.incr();
+        ejectStalled = false;
+
+        histograms.commitUsec.add(end - start);
+        histograms.batchItems.add(uncommittedItems);
+        histograms.batchBytes.add(uncommittedBytes);
+        uint32_t now = (uint32_t)end;
+        for (size_t i = 0; i < dirtiedAt.size(); i++) {
+            histograms.dirtyAgeUsec.add(now - dirtiedAt[i]);
+        }
+        dirtiedAt.clear();
+
+        storage.persisted(uncommittedItems, uncommittedBytes);
+        uncommittedItems = uncommittedBytes = 0;
+        store->releaseThrottled();
+
+        // Until warmup is done, a scan may still load what was just
+        // deleted, so tombstones stay until it's swept up after.
+        if (!store->warming) {
+            for (size_t i = 0; i < deleted.size(); i++) {
+                StoredValue *v = deleted[i];
+                storage.purge(storage.partitionFor(v->getHash()), v);
+            }
+        }
+        deleted.clear();
+    }
+
+    StoredValue *Flusher::flushOne(int bucket_num, StoredValue *v,
+                                   std::vector<StoredValue*> &deleted,
+                                   size_t &bytes, Callback<bool> &cb) {
+
+        // Only this flusher removes items from its partitions (purging
+        // tombstones), so v stays around while we work on it.
+        LockHolder lh(store->storage.getMutex(bucket_num));
+        StoredValue *next = v->takeNextDirty();
+        writeOne(lh, v, deleted, bytes, cb);
+        return next;
+    }
+
+    void Flusher::writeOne(LockHolder &lh, StoredValue *v,
+                           std::vector<StoredValue*> &deleted,
+                           size_t &bytes, Callback<bool> &cb) {
+        HashTable &storage = store->storage;
+        bool isDeleted = v->isDeleted();
+        Blob *val = NULL;
+        if (!isDeleted) {
+            // Hold on to it for the duration.
+            val = v->getBlob()->acquire();
+        }
+        size_t size = HashTable::dirtySize(v);
+        dirtiedAt.push_back(v->getDirtiedAt());
+        v->markClean();
+        lh.unlock();
+
+        bytes += size;
+        ++uncommittedItems;
+        uncommittedBytes += size;
+        uint64_t start = now_usec();
+        if (val) {
+            underlying->set(v->getKey(), val->getData(), cb);
+            val->release(storage.getSlabs());
         } else {
-            std::queue<std::string> *q = towrite;
-            towrite = NULL;
-            initQueue();
-            lh.unlock();
+            underlying->del(v->getKey(), cb);
+            deleted.push_back(v);
+        }
+        histograms.writeUsec.add(now_usec() - start);
+    }
+
+    // A dirty item waiting for a sorted flush.
+    struct DirtyItem {
+        StoredValue *v;
+        int          bucket;
+    };
 
-            RememberingCallback<bool> cb;
-            assert(underlying);
+    static bool dirty_key_less(const DirtyItem &a, const DirtyItem &b) {
+        return a.v->getKey() < b.v->getKey();
+    }
+
+    size_t Flusher::flushSorted(std::vector<StoredValue*> &deleted,
+                                Callback<bool> &cb) {
+        HashTable &storage = store->storage;
+
+        // Take every dirty list up front.  The items stay dirty until
+        // they're written, so sets meanwhile don't queue them again
+        // (and are picked up when they are), and nothing ejects them.
+        std::vector<DirtyItem> items;
+        for (int i = startBucket; i < endBucket; i++) {
+            LockHolder lh(storage.getMutex(i));
+            StoredValue *v = storage.takeDirty(i);
+            while (v) {
+                DirtyItem d;
+                d.v = v;
+                d.bucket = i;
+                items.push_back(d);
+                v = v->takeNextDirty();
+            }
+        }
+        // Keys never change, so they can be compared unlocked.
+        std::sort(items.begin(), items.end(), dirty_key_less);
 
-            underlying->begin();
-            while (!q->empty()) {
-                flushSome(q, cb);
+        size_t batchItems = 0, batchBytes = 0;
+        for (size_t n = 0; n < items.size(); n++) {
+            LockHolder lh(storage.getMutex(items[n].bucket));
+            writeOne(lh, items[n].v, deleted, batchBytes, cb);
+            serviceFetches();
+            // A cap ends the transaction on a run of neighbouring keys.
+            if (batchFull(++batchItems, batchBytes)) {
+                commit(deleted);
+                underlying->begin();
+                batchItems = batchBytes = 0;
             }
-            underlying->commit();
+        }
+        return items.size();
+    }
 
-            delete q;
+    static size_t partition_size(size_t n) {
+        size_t rv = MIN_PARTITION_SIZE;
+        while (rv < n) {
+            rv <<= 1;
         }
+        return rv;
     }
 
-    void EventuallyPersistentStore::flushSome(std::queue<std::string> *q,
-                                             Callback<bool> &cb) {
+    // Chained partitions.
 
-        std::string key = q->front();
-        q->pop();
+    static ChainedTable *new_chained_table(size_t n) {
+        ChainedTable *t = new ChainedTable;
+        t->nbuckets = n;
+        t->buckets = (StoredValue**)calloc(n, sizeof(StoredValue*));
+        if (!t->buckets) {
+            delete t;
+            return NULL;
+        }
+        return t;
+    }
 
-        int bucket_num = storage.bucket(key);
-        LockHolder lh(storage.getMutex(bucket_num));
-        StoredValue *v = storage.unlocked_find(key, bucket_num);
+    static void free_chained_table(void *p, void *arg = NULL) {
+        ChainedTable *t = static_cast<ChainedTable*>(p);
+        free(t->buckets);
+        delete t;
+    }
 
-        bool found = v != NULL;
-        bool isDirty = (found && v->isDirty());
-        const char *val = NULL;
-        if (isDirty) {
-            v->markClean();
-            // Copy it for the duration.
-            val = strdup(v->getValue());
+    ChainedPartition::ChainedPartition(EpochManager *m, SlabAllocator *a,
+                                       size_t n)
+        : HashPartition(m, a) {
+        table = new_chained_table(partition_size(n));
+        if (!table) {
+            throw std::runtime_error("Error allocating hash partition.");
         }
-        lh.unlock();
+        old = NULL;
+        cursor = 0;
+    }
 
-        if (found && isDirty) {
-            underlying->set(key, val, cb);
-        } else if (!found) {
-            underlying->del(key, cb);
+    ChainedPartition::~ChainedPartition() {
+        clear();
+        free_chained_table(table);
+    }
+
+    StoredValue * volatile *ChainedPartition::chain(uint64_t h) {
+        if (old) {
+            size_t ob = (h >> 7) & (old->nbuckets - 1);
+            if (ob >= cursor) {
+                return &old->buckets[ob];
+            }
         }
+        return &table->buckets[(h >> 7) & (table->nbuckets - 1)];
+    }
 
-        free((void*)val);
+    StoredValue *ChainedPartition::find(std::string &key, uint64_t h) {
+        StoredValue *v = *chain(h);
+        while (v) {
+            if (v->hasKey(key, h)) {
+                return v;
+            }
+            v = v->next;
+        }
+        return NULL;
     }
 
+    bool ChainedPartition::optimisticFind(std::string &key, uint64_t h,
+                                          StoredValue *&out) {
+        // A migration may have us walking a chain that's being
+        // relinked, so don't trust where we end up.
+        StoredValue *v = *chain(h);
+        for (int i = 0; v && i < MAX_OPTIMISTIC_CHAIN; i++) {
+            if (v->hasKey(key, h)) {
+                out = v;
+                return true;
+            }
+            v = v->next;
+        }
+        out = NULL;
+        return v == NULL;
+    }
+
+    void ChainedPartition::insert(std::string &key, uint64_t h,
+                                  StoredValue *v) {
+        StoredValue * volatile *head = chain(h);
+        v->next = *head;
+        memory_barrier();
+        *head = v;
+        ++count;
+        maybeResize();
+    }
+
+    StoredValue *ChainedPartition::remove(std::string &key, uint64_t h) {
+        StoredValue * volatile *vp = chain(h);
+        while (*vp) {
+            StoredValue *v = *vp;
+            if (v->hasKey(key, h)) {
+                // Leave v->next alone for anyone still walking past.
+                *vp = v->next;
+                --count;
+                maybeResize();
+                return v;
+            }
+            vp = &v->next;
+        }
+        return NULL;
+    }
+
+    void ChainedPartition::maybeResize() {
+        if (old) {
+            migrate(RESIZE_STEP);
+            return;
+        }
+        size_t n = table->nbuckets;
+        if (count > n) {
+            n *= 2;
+        } else if (count < n / 8 && n > MIN_PARTITION_SIZE) {
+            n /= 2;
+        }
+        if (n != table->nbuckets) {
+            ChainedTable *t = new_chained_table(n);
+            if (!t) {
+                // Keep going at the current size.
+                return;
+            }
+            cursor = 0;
+            old = table;
+            memory_barrier();
+            table = t;
+        }
+    }
+
+    void ChainedPartition::migrate(size_t n) {
+        for (; old && n > 0; n--) {
+            StoredValue *v = old->buckets[cursor];
+            while (v) {
+                StoredValue *next = v->next;
+                noteChanged(v);
+                StoredValue * volatile *head =
+                    &table->buckets[(v->hash >> 7)
+                                    & (table->nbuckets - 1)];
+                v->next = *head;
+                *head = v;
+                v = next;
+            }
+            old->buckets[cursor] = NULL;
+            if (++cursor == old->nbuckets) {
+                limbo.retire(old, free_chained_table);
+                old = NULL;
+                cursor = 0;
+            }
+        }
+    }
+
+    void ChainedPartition::clear() {
+        if (old) {
+            migrate(old->nbuckets);
+        }
+        forgetDirty();
+        for (size_t i = 0; i < table->nbuckets; i++) {
+            StoredValue *v = table->buckets[i];
+            table->buckets[i] = NULL;
+            while (v) {
+                StoredValue *next = v->next;
+                limbo.retire(v, StoredValue::destroy, slabs);
+                v = next;
+            }
+        }
+        count = nonResident = valueBytes = expiring = 0;
+    }
+
+    bool ChainedPartition::visit(HashTableVisitor &visitor) {
+        // Items not yet moved are still in the old table.
+        ChainedTable *tables[2] = { old, table };
+        for (int t = 0; t < 2; t++) {
+            if (!tables[t]) {
+                continue;
+            }
+            for (size_t i = 0; i < tables[t]->nbuckets; i++) {
+                for (StoredValue *v = tables[t]->buckets[i]; v; v = v->next) {
+                    if (!visitor.visit(v)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    void ChainedPartition::startScan(PartitionCursor &c) {
+        c.tables[0] = table;
+        c.tables[1] = old;
+        c.which = 0;
+        c.pos = 0;
+    }
+
+    bool ChainedPartition::scan(PartitionCursor &c, size_t n,
+                                HashTableVisitor &visitor) {
+        for (; c.which < 2; c.which++, c.pos = 0) {
+            ChainedTable *t = static_cast<ChainedTable*>(c.tables[c.which]);
+            if (!t || (t != table && t != old)) {
+                continue;
+            }
+            for (; n > 0 && c.pos < t->nbuckets; n--, c.pos++) {
+                for (StoredValue *v = t->buckets[c.pos]; v; v = v->next) {
+                    visitor.visit(v);
+                }
+            }
+            if (c.pos < t->nbuckets) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Open addressed partitions.
+
+    static const int8_t CTRL_EMPTY = -128;
+    static const int8_t CTRL_DELETED = -2;
+
+    static inline int8_t ctrl_tag(uint64_t h) {
+        return (int8_t)(h & 0x7f);
+    }
+
+    // Bit i is set when the i-th control byte in the group equals b.
+    static inline unsigned int match_byte(const int8_t *g, int8_t b) {
+#ifdef __SSE2__
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+        return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(c,
+                                                             _mm_set1_epi8(b)));
+#else
+        unsigned int rv = 0;
+        for (int i = 0; i < OPEN_GROUP_WIDTH; i++) {
+            if (g[i] == b) {
+                rv |= 1u << i;
+            }
+        }
+        return rv;
+#endif
+    }
+
+    // Bit i is set when the i-th control byte is empty or deleted.
+    static inline unsigned int match_available(const int8_t *g) {
+#ifdef __SSE2__
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g));
+        return (unsigned int)_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1),
+                                                             c));
+#else
+        unsigned int rv = 0;
+        for (int i = 0; i < OPEN_GROUP_WIDTH; i++) {
+            if (g[i] < -1) {
+                rv |= 1u << i;
+            }
+        }
+        return rv;
+#endif
+    }
+
+    // Position of the key in the given table, or -1.
+    //
+    // Safe (if not necessarily right) against concurrent writers, as
+    // it never follows a slot that's been emptied.
+    static ssize_t open_locate(OpenTable *t, std::string &key, uint64_t h) {
+        size_t mask = t->capacity / OPEN_GROUP_WIDTH - 1;
+        size_t group = (h >> 7) & mask;
+        int8_t tag = ctrl_tag(h);
+        size_t klen = key.length();
+        for (size_t step = 0; step <= mask; step++) {
+            const int8_t *g = t->ctrl + group * OPEN_GROUP_WIDTH;
+            unsigned int m = match_byte(g, tag);
+            while (m) {
+                size_t pos = group * OPEN_GROUP_WIDTH + __builtin_ctz(m);
+                OpenSlot &slot = t->slots[pos];
+                StoredValue *sv = slot.sv;
+                if (!sv) {
+                    // Raced with a remove.
+                } else if (slot.klen == OPEN_LONG_KEY) {
+                    if (sv->hasKey(key, h)) {
+                        return (ssize_t)pos;
+                    }
+                } else if (slot.klen == klen
+                           && memcmp(slot.key, key.data(), klen) == 0) {
+                    return (ssize_t)pos;
+                }
+                m &= m - 1;
+            }
+            if (match_byte(g, CTRL_EMPTY)) {
+                break;
+            }
+            group = (group + step + 1) & mask;
+        }
+        return -1;
+    }
+
+    static OpenTable *new_open_table(size_t cap) {
+        OpenTable *t = new OpenTable;
+        t->capacity = cap;
+        t->ctrl = (int8_t*)malloc(cap);
+        t->slots = (OpenSlot*)calloc(cap, sizeof(OpenSlot));
+        if (!t->ctrl || !t->slots) {
+            free(t->ctrl);
+            free(t->slots);
+            delete t;
+            throw std::runtime_error("Error allocating hash partition.");
+        }
+        memset(t->ctrl, CTRL_EMPTY, cap);
+        return t;
+    }
+
+    static void free_open_table(void *p, void *arg = NULL) {
+        OpenTable *t = static_cast<OpenTable*>(p);
+        free(t->ctrl);
+        free(t->slots);
+        delete t;
+    }
+
+    OpenPartition::OpenPartition(EpochManager *m, SlabAllocator *a, size_t n)
+        : HashPartition(m, a) {
+        table = new_open_table(partition_size(n));
+        old = NULL;
+        ocursor = used = tombstones = 0;
+    }
+
+    OpenPartition::~OpenPartition() {
+        clear();
+        free_open_table(table);
+    }
+
+    void OpenPartition::place(const char *k, size_t klen, uint64_t h,
+                              StoredValue *v) {
+        OpenTable *t = table;
+        size_t mask = t->capacity / OPEN_GROUP_WIDTH - 1;
+        size_t group = (h >> 7) & mask;
+        for (size_t step = 0; ; step++) {
+            assert(step <= mask);
+            unsigned int m = match_available(t->ctrl
+                                             + group * OPEN_GROUP_WIDTH);
+            if (m) {
+                size_t pos = group * OPEN_GROUP_WIDTH + __builtin_ctz(m);
+                if (t->ctrl[pos] == CTRL_DELETED) {
+                    --tombstones;
+                }
+                OpenSlot &slot = t->slots[pos];
+                if (klen <= OPEN_INLINE_KEY) {
+                    slot.klen = (uint8_t)klen;
+                    memcpy(slot.key, k, klen);
+                } else {
+                    slot.klen = OPEN_LONG_KEY;
+                }
+                slot.sv = v;
+                memory_barrier();
+                t->ctrl[pos] = ctrl_tag(h);
+                ++used;
+                return;
+            }
+            group = (group + step + 1) & mask;
+        }
+    }
+
+    void OpenPartition::startResize(size_t newcap) {
+        // Finish any resize in progress first.
+        if (old) {
+            migrate(old->capacity);
+        }
+        OpenTable *t = new_open_table(newcap);
+        ocursor = 0;
+        used = tombstones = 0;
+        old = table;
+        memory_barrier();
+        table = t;
+    }
+
+    void OpenPartition::migrate(size_t n) {
+        for (; old && n > 0; n--) {
+            for (size_t i = ocursor * OPEN_GROUP_WIDTH;
+                 i < (ocursor + 1) * OPEN_GROUP_WIDTH; i++) {
+                if (old->ctrl[i] >= 0) {
+                    StoredValue *sv = old->slots[i].sv;
+                    std::string &k = sv->getKey();
+                    noteChanged(sv);
+                    place(k.data(), k.length(), sv->getHash(), sv);
+                    // Keep probe chains in the old table intact.
+                    old->ctrl[i] = CTRL_DELETED;
+                }
+            }
+            if (++ocursor == old->capacity / OPEN_GROUP_WIDTH) {
+                limbo.retire(old, free_open_table);
+                old = NULL;
+                ocursor = 0;
+            }
+        }
+    }
+
+    StoredValue *OpenPartition::find(std::string &key, uint64_t h) {
+        StoredValue *rv = NULL;
+        optimisticFind(key, h, rv);
+        return rv;
+    }
+
+    bool OpenPartition::optimisticFind(std::string &key, uint64_t h,
+                                       StoredValue *&out) {
+        OpenTable *t = table;
+        OpenTable *o = old;
+        ssize_t pos = open_locate(t, key, h);
+        if (pos >= 0) {
+            out = t->slots[pos].sv;
+        } else if (o && (pos = open_locate(o, key, h)) >= 0) {
+            out = o->slots[pos].sv;
+        } else {
+            out = NULL;
+        }
+        return true;
+    }
+
+    void OpenPartition::insert(std::string &key, uint64_t h, StoredValue *v) {
+        // Keep at least 1/8 of the slots empty so probes terminate early.
+        size_t cap = table->capacity;
+        if ((used + tombstones + 1) * 8 > cap * 7) {
+            startResize(tombstones > used / 2 ? cap : cap * 2);
+        }
+        place(key.data(), key.length(), h, v);
+        ++count;
+        migrate(RESIZE_STEP);
+    }
+
+    StoredValue *OpenPartition::remove(std::string &key, uint64_t h) {
+        OpenTable *t = table;
+        ssize_t pos = open_locate(t, key, h);
+        if (pos < 0 && old) {
+            t = old;
+            pos = open_locate(t, key, h);
+        }
+        if (pos < 0) {
+            return NULL;
+        }
+        StoredValue *v = t->slots[pos].sv;
+        --count;
+        if (t == table) {
+            --used;
+            // Probes never continue past a group with an empty slot,
+            // so such a group doesn't need a tombstone.
+            size_t group = (size_t)pos & ~(size_t)(OPEN_GROUP_WIDTH - 1);
+            if (match_byte(t->ctrl + group, CTRL_EMPTY)) {
+                t->ctrl[pos] = CTRL_EMPTY;
+            } else {
+                t->ctrl[pos] = CTRL_DELETED;
+                ++tombstones;
+            }
+        } else {
+            t->ctrl[pos] = CTRL_DELETED;
+        }
+        t->slots[pos].sv = NULL;
+
+        if (old) {
+            migrate(RESIZE_STEP);
+        } else if (used * 8 < table->capacity
+                   && table->capacity > MIN_PARTITION_SIZE) {
+            startResize(table->capacity / 2);
+        }
+        return v;
+    }
+
+    void OpenPartition::clear() {
+        if (old) {
+            migrate(old->capacity);
+        }
+        forgetDirty();
+        OpenTable *t = table;
+        for (size_t i = 0; i < t->capacity; i++) {
+            if (t->ctrl[i] >= 0) {
+                limbo.retire(t->slots[i].sv, StoredValue::destroy, slabs);
+            }
+        }
+        // Readers may still be probing the old slots.
+        table = new_open_table(MIN_PARTITION_SIZE);
+        limbo.retire(t, free_open_table);
+        used = tombstones = count = 0;
+        nonResident = valueBytes = expiring = 0;
+    }
+
+    bool OpenPartition::visit(HashTableVisitor &visitor) {
+        // Moved slots are tombstones in the old table, so nothing is
+        // seen twice.
+        OpenTable *tables[2] = { old, table };
+        for (int t = 0; t < 2; t++) {
+            if (!tables[t]) {
+                continue;
+            }
+            for (size_t i = 0; i < tables[t]->capacity; i++) {
+                if (tables[t]->ctrl[i] >= 0
+                    && !visitor.visit(tables[t]->slots[i].sv)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void OpenPartition::startScan(PartitionCursor &c) {
+        c.tables[0] = table;
+        c.tables[1] = old;
+        c.which = 0;
+        c.pos = 0;
+    }
+
+    bool OpenPartition::scan(PartitionCursor &c, size_t n,
+                             HashTableVisitor &visitor) {
+        for (; c.which < 2; c.which++, c.pos = 0) {
+            OpenTable *t = static_cast<OpenTable*>(c.tables[c.which]);
+            if (!t || (t != table && t != old)) {
+                continue;
+            }
+            size_t end = std::min(t->capacity, c.pos + n * OPEN_GROUP_WIDTH);
+            for (; c.pos < end; c.pos++) {
+                if (t->ctrl[c.pos] >= 0) {
+                    visitor.visit(t->slots[c.pos].sv);
+                }
+            }
+            if (c.pos < t->capacity) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Ejects the values of clean items until enough bytes are freed.
+     */
+    class Ejector : public HashTableVisitor {
+    public:
+        Ejector(HashPartition *part, SlabAllocator &a, size_t b)
+            : p(part), slabs(a), wanted(b), freed(0), count(0) {}
+
+        bool visit(StoredValue *v) {
+            if (v->isDirty() || v->isDeleted() || !v->isResident()) {
+                return true;
+            }
+            if (v->takeReferenced()) {
+                return true;
+            }
+            Blob *b = v->ejectValue();
+            freed += b->length();
+            ++count;
+            p->valueRemoved(b);
+            p->noteEjected();
+            // Optimistic readers may still be copying it.
+            p->getLimbo().retire(b, Blob::releaseRetired, &slabs,
+                                 b->length());
+            return freed < wanted;
+        }
+
+        HashPartition *p;
+        SlabAllocator &slabs;
+        size_t         wanted;
+        size_t         freed;
+        size_t         count;
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(Ejector);
+    };
+
+    size_t HashTable::eject(int bucket_num, size_t bytes, size_t &count) {
+        assert(active);
+        LockHolder lh(getMutex(bucket_num));
+        HashPartition *p = partitions[bucket_num];
+        Ejector ejector(p, slabs, bytes);
+        // The first pass may only clear reference bits.
+        for (int pass = 0; pass < 2 && ejector.freed < bytes; pass++) {
+            if (!p->visit(ejector)) {
+                break;
+            }
+        }
+        count += ejector.count;
+        return ejector.freed;
+    }
+
+    /**
+     * Collects tombstones whose deletes have been persisted.
+     */
+    class TombstoneCollector : public HashTableVisitor {
+    public:
+        TombstoneCollector() {}
+
+        bool visit(StoredValue *v) {
+            if (v->isDeleted() && v->isClean()) {
+                found.push_back(v);
+            }
+            return true;
+        }
+
+        std::vector<StoredValue*> found;
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(TombstoneCollector);
+    };
+
+    size_t HashTable::purgeTombstones(int bucket_num) {
+        assert(active);
+        LockHolder lh(getMutex(bucket_num));
+        HashPartition *p = partitions[bucket_num];
+        TombstoneCollector collector;
+        p->visit(collector);
+        for (size_t i = 0; i < collector.found.size(); i++) {
+            StoredValue *v = collector.found[i];
+            p->beginWrite();
+            StoredValue *gone = p->remove(v->getKey(), v->getHash());
+            p->endWrite();
+            assert(gone == v);
+            p->getLimbo().retire(gone, StoredValue::destroy, &slabs);
+        }
+        return collector.found.size();
+    }
+
+    /**
+     * Collects live items past their expiry time.
+     */
+    class ExpiryCollector : public HashTableVisitor {
+    public:
+        ExpiryCollector(uint32_t t) : now(t) {}
+
+        bool visit(StoredValue *v) {
+            if (!v->isDeleted() && v->hasExpired(now)) {
+                found.push_back(v);
+            }
+            return true;
+        }
+
+        uint32_t                  now;
+        std::vector<StoredValue*> found;
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(ExpiryCollector);
+    };
+
+    size_t HashTable::expire(int bucket_num, uint32_t now) {
+        assert(active);
+        HashPartition *p = partitions[bucket_num];
+        if (p->getNumExpiring() == 0) {
+            return 0;
+        }
+        PartitionCursor c;
+        ExpiryCollector collector(now);
+        size_t rv = 0;
+        EpochGuard eg(&epochs);
+
+        LockHolder lh(getMutex(bucket_num));
+        p->startScan(c);
+        bool more = true;
+        while (more) {
+            more = p->scan(c, SCAN_STEP, collector);
+            for (size_t i = 0; i < collector.found.size(); i++) {
+                tombstone(p, collector.found[i]);
+            }
+            rv += collector.found.size();
+            collector.found.clear();
+            if (more) {
+                lh.unlock();
+                lh.lock();
+            }
+        }
+        numReclaimed.incr(rv);
+        return rv;
+    }
+
+    /**
+     * Picks out the live items a scan should show.
+     */
+    class ScanCollector : public HashTableVisitor {
+    public:
+        ScanCollector(PartitionSnapshot *s)
+            : snap(s), now(ep_current_time()) {}
+
+        bool visit(StoredValue *v) {
+            if (v->isDeleted() || v->hasExpired(now)) {
+                return true;
+            }
+            // Anything changed since the snapshot started was saved
+            // as it was (or is new).
+            if (snap && v->getSeqno() > snap->seqno) {
+                return true;
+            }
+            SnapshotImage img;
+            img.item = v;
+            img.key = v->getKey();
+            img.value = v->isResident() ? v->getBlob()->acquire() : NULL;
+            found.push_back(img);
+            return true;
+        }
+
+        PartitionSnapshot         *snap;
+        uint32_t                   now;
+        std::vector<SnapshotImage> found;
+
+    private:
+        DISALLOW_COPY_AND_ASSIGN(ScanCollector);
+    };
+
+    static bool image_less(const SnapshotImage &a, const SnapshotImage &b) {
+        return a.item < b.item;
+    }
+
+    /**
+     * Show images to a visitor, dropping their references.
+     */
+    static void show_images(SnapshotVisitor &visitor,
+                            std::vector<SnapshotImage> &images,
+                            SlabAllocator &slabs) {
+        for (size_t i = 0; i < images.size(); i++) {
+            visitor.visit(images[i].key, images[i].value);
+            if (images[i].value) {
+                images[i].value->release(slabs);
+            }
+        }
+        images.clear();
+    }
+
+    void HashTable::scan(SnapshotVisitor &visitor, bool pointInTime,
+                         int slice, int nslices) {
+        assert(active);
+        if (!pointInTime) {
+            for (int i = slice; i < (int)n_locks; i += nslices) {
+                scanPartition(i, visitor, NULL);
+            }
+            return;
+        }
+
+        // Take our partitions from any other point in time scan
+        // (always in order, so two can't each wait for the other).
+        for (int i = slice; i < (int)n_locks; i += nslices) {
+            if (pthread_mutex_lock(&snapshotMutexes[i]) != 0) {
+                throw std::runtime_error("Failed to acquire lock.");
+            }
+        }
+        std::vector<PartitionSnapshot> snaps(n_locks);
+        // Start every partition's snapshot at the same instant.
+        for (int i = slice; i < (int)n_locks; i += nslices) {
+            if (pthread_mutex_lock(getMutex(i)) != 0) {
+                throw std::runtime_error("Failed to acquire lock.");
+            }
+        }
+        for (int i = slice; i < (int)n_locks; i += nslices) {
+            partitions[i]->setSnapshot(&snaps[i]);
+            pthread_mutex_unlock(getMutex(i));
+        }
+        for (int i = slice; i < (int)n_locks; i += nslices) {
+            scanPartition(i, visitor, &snaps[i]);
+            pthread_mutex_unlock(&snapshotMutexes[i]);
+        }
+    }
+
+    void HashTable::scanPartition(int bucket_num, SnapshotVisitor &visitor,
+                                  PartitionSnapshot *snap) {
+        HashPartition *p = partitions[bucket_num];
+        PartitionCursor c;
+        ScanCollector collector(snap);
+        std::vector<SnapshotImage> &found = collector.found;
+        // Everything shown is copied out under the lock, and the
+        // cursor's tables are only looked at once they're known to
+        // still be the partition's, so no epoch is held.
+
+        LockHolder lh(getMutex(bucket_num));
+        p->startScan(c);
+        bool more = true;
+        while (more) {
+            more = p->scan(c, SCAN_STEP, collector);
+            if (!snap) {
+                lh.unlock();
+                show_images(visitor, found, slabs);
+                lh.lock();
+            } else if (more) {
+                lh.unlock();
+                lh.lock();
+            }
+        }
+        if (!snap) {
+            return;
+        }
+        p->setSnapshot(NULL);
+        lh.unlock();
+
+        // An item found by the scan and then changed was saved as
+        // well, and it's only shown as saved.
+        std::vector<SnapshotImage> &saved = snap->preserved;
+        std::sort(saved.begin(), saved.end(), image_less);
+        std::vector<SnapshotImage> unchanged;
+        for (size_t i = 0; i < found.size(); i++) {
+            SnapshotImage &img = found[i];
+            if (!std::binary_search(saved.begin(), saved.end(), img,
+                                    image_less)) {
+                unchanged.push_back(img);
+            } else if (img.value) {
+                img.value->release(slabs);
+            }
+        }
+        found.clear();
+        show_images(visitor, unchanged, slabs);
+        show_images(visitor, saved, slabs);
+    }
+
+
 }
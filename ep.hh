@@ -6,38 +6,136 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <stdexcept>
 #include <iostream>
 #include <queue>
+#include <new>
 
 #include <set>
 #include <queue>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "base-test.hh"
 #include "locks.hh"
+#include "atomic.hh"
+#include "epoch.hh"
+#include "slab.hh"
+#include "histogram.hh"
+#include "hash.hh"
+#include "future.hh"
 
 namespace kvtest {
 
     // Forward declaration for StoredValue
     class HashTable;
+    class HashPartition;
+    class ChainedPartition;
+    class OpenPartition;
+
+    /**
+     * The clock item expiry times are kept in: seconds since the
+     * epoch.
+     */
+    inline uint32_t ep_current_time() {
+        return (uint32_t)time(NULL);
+    }
+
+    /**
+     * An immutable, reference counted value.
+     *
+     * The StoredValue holding a blob owns one reference, and anyone
+     * else who wants to keep using the bytes (e.g. the flusher) takes
+     * their own instead of copying them.  The store's reference is
+     * always dropped through a Limbo, so a reader inside an epoch can
+     * still safely acquire a blob it found.
+     */
+    class Blob {
+    public:
+
+        // Make a blob holding a copy of the given string.
+        static Blob *create(const char *v, SlabAllocator &a) {
+            size_t len = strlen(v);
+            Blob *b = new (a.allocate(allocSize(len))) Blob(len);
+            memcpy(b->data, v, len + 1);
+            return b;
+        }
+
+        const char *getData() {
+            return data;
+        }
+
+        size_t length() {
+            return len;
+        }
+
+        // Take another reference.
+        Blob *acquire() {
+            refcount.incr();
+            return this;
+        }
+
+        // Drop a reference, freeing the blob if it was the last.
+        void release(SlabAllocator &a) {
+            if (refcount.decr() == 0) {
+                size_t n = allocSize(len);
+                this->~Blob();
+                a.release(this, n);
+            }
+        }
+
+        // Limbo deleter dropping a reference (arg is the allocator).
+        static void releaseRetired(void *p, void *arg) {
+            static_cast<Blob*>(p)->release(*static_cast<SlabAllocator*>(arg));
+        }
+
+    private:
+
+        Blob(size_t l) : refcount(1) {
+            len = l;
+        }
+
+        static size_t allocSize(size_t l) {
+            return sizeof(Blob) + l;
+        }
+
+        Atomic<int> refcount;
+        size_t      len;
+        char        data[1];
+
+        DISALLOW_COPY_AND_ASSIGN(Blob);
+    };
 
     class StoredValue {
     public:
         StoredValue() {
-            next = NULL;
+            next = nextDirty = NULL;
             value = NULL;
-            dirty = false;
+            hash = seqno = 0;
+            exptime = 0;
+            cas = 0;
+            dirty = deleted = referenced = false;
+            dirtiedAt = 0;
         }
-        StoredValue(std::string &k, const char *v, StoredValue *n) {
+        StoredValue(std::string &k, uint64_t h, const char *v, StoredValue *n,
+                    SlabAllocator &a) {
             key = k;
+            hash = h;
+            seqno = 0;
+            exptime = 0;
+            cas = 0;
             value = NULL;
-            setValue(v);
+            replaceValue(v, a);
             dirty = true;
+            deleted = referenced = false;
+            dirtiedAt = 0;
             next = n;
-        }
-        ~StoredValue() {
-            free((void*)value);
-            value = NULL;
+            nextDirty = NULL;
         }
         void markDirty() {
             dirty = true;
@@ -51,22 +149,135 @@ namespace kvtest {
         bool isClean() {
             return !dirty;
         }
+        // True if this is a tombstone for a delete.
+        bool isDeleted() {
+            return deleted;
+        }
+        // True if the value is in memory (tombstones have none either).
+        bool isResident() {
+            return value != NULL;
+        }
+        // When this last became dirty (the low bits of now_usec()).
+        uint32_t getDirtiedAt() {
+            return dirtiedAt;
+        }
+        // Unlink from the dirty list this item was taken from.
+        StoredValue *takeNextDirty() {
+            StoredValue *rv = nextDirty;
+            nextDirty = NULL;
+            return rv;
+        }
         const char* getValue() {
+            return value->getData();
+        }
+        Blob *getBlob() {
             return value;
         }
-        void setValue(const char *v) {
-            free((void*)value);
-            value = strdup(v);
+        std::string &getKey() {
+            return key;
+        }
+        // The key's HashTable::hash.
+        uint64_t getHash() {
+            return hash;
+        }
+        // Cheap check (comparing hashes first) for this item's key.
+        bool hasKey(std::string &k, uint64_t h) {
+            return hash == h && k.compare(key) == 0;
+        }
+        // The partition's sequence number when this was last changed.
+        uint64_t getSeqno() {
+            return seqno;
+        }
+        // Changes whenever the value does (and never goes back).
+        uint64_t getCas() {
+            return cas;
+        }
+        // When this expires (see ep_current_time), or zero for never.
+        uint32_t getExptime() {
+            return exptime;
+        }
+        // True if this has an expiry time that's passed (so an item
+        // with a TTL of n seconds lasts at least that long).  The
+        // clock is only read for items that can expire.
+        bool hasExpired() {
+            uint32_t t = exptime;
+            return t != 0 && t < ep_current_time();
+        }
+        bool hasExpired(uint32_t now) {
+            uint32_t t = exptime;
+            return t != 0 && t < now;
+        }
+        // Install a new blob holding a copy of v and hand back the
+        // previous one.
+        //
+        // Lock-free readers may still be looking at the previous
+        // blob, so the caller must retire it (with
+        // Blob::releaseRetired) rather than release it.
+        Blob *replaceValue(const char *v, SlabAllocator &a) {
+            Blob *prev = value;
+            Blob *nv = Blob::create(v, a);
+            memory_barrier();
+            value = nv;
             markDirty();
+            return prev;
+        }
+
+        // Give up the value, keeping the item.  As with
+        // replaceValue, the caller must retire what it gets back.
+        Blob *ejectValue() {
+            Blob *rv = value;
+            value = NULL;
+            return rv;
+        }
+
+        // Check (and forget) whether the item was read since the
+        // last time this was asked.
+        bool takeReferenced() {
+            bool rv = referenced;
+            if (rv) {
+                referenced = false;
+            }
+            return rv;
+        }
+
+        // Allocate a StoredValue from the given slabs.
+        static StoredValue *create(std::string &k, uint64_t h, const char *v,
+                                   SlabAllocator &a) {
+            void *mem = a.allocate(sizeof(StoredValue));
+            return new (mem) StoredValue(k, h, v, NULL, a);
+        }
+
+        // Free a StoredValue made by create() (dropping its blob).
+        static void destroy(void *p, void *arg) {
+            StoredValue *v = static_cast<StoredValue*>(p);
+            SlabAllocator *a = static_cast<SlabAllocator*>(arg);
+            if (v->value) {
+                v->value->release(*a);
+            }
+            v->~StoredValue();
+            a->release(v, sizeof(StoredValue));
         }
+
     private:
 
         friend class HashTable;
+        friend class HashPartition;
+        friend class ChainedPartition;
+        friend class OpenPartition;
 
         bool dirty;
+        volatile bool deleted;
+        // Read recently (the ejector gives these a second chance).
+        volatile bool referenced;
+        uint32_t dirtiedAt;
+        volatile uint32_t exptime;
+        uint64_t hash;
+        uint64_t seqno;
+        volatile uint64_t cas;
         std::string key;
-        const char *value;
-        StoredValue *next;
+        Blob * volatile value;
+        StoredValue * volatile next;
+        StoredValue *nextDirty;
         DISALLOW_COPY_AND_ASSIGN(StoredValue);
     };
 
@@ -74,157 +285,1332 @@ namespace kvtest {
         NOT_FOUND, WAS_CLEAN, WAS_DIRTY
     } mutation_type_t;
 
+    /**
+     * What HashTable::mutate did.
+     */
+    typedef enum {
+        /** Nothing changed (the result says why). */
+        UPDATE_SKIPPED,
+        /** The value has to be fetched back from the store first. */
+        UPDATE_EJECTED,
+        /** Changed an item that was already dirty. */
+        UPDATE_WAS_DIRTY,
+        /** Changed an item, which is now queued for the flusher. */
+        UPDATE_QUEUED
+    } update_state_t;
+
+    /**
+     * What a HashTable lookup found.
+     */
+    typedef enum {
+        /** No such item. */
+        VALUE_MISSING,
+        /** The value was copied out. */
+        VALUE_FOUND,
+        /** The item exists, but its value was ejected. */
+        VALUE_EJECTED
+    } value_state_t;
+
+    /**
+     * Something that wants to look at the items of a HashTable.
+     */
+    class HashTableVisitor {
+    public:
+        virtual ~HashTableVisitor() {}
+
+        /**
+         * Look at an item (tombstones included) with its partition
+         * locked.
+         *
+         * @return false to stop visiting
+         */
+        virtual bool visit(StoredValue *v) = 0;
+    };
+
+    /**
+     * Something that wants to look at the items of a HashTable
+     * without holding any locks (see HashTable::scan).
+     */
+    class SnapshotVisitor {
+    public:
+        virtual ~SnapshotVisitor() {}
+
+        /**
+         * Look at a live item.
+         *
+         * @param value the item's value, or NULL if it was ejected
+         *        (and so is only in the underlying store)
+         */
+        virtual void visit(std::string &key, Blob *value) = 0;
+    };
+
+    /**
+     * An item as a scan shows it: as the scan found it or, for a
+     * snapshot, as it was when the snapshot started (saved by whoever
+     * changed it before the snapshot got to it).
+     *
+     * The item may be gone by the time it's shown, so it's only used
+     * to tell images apart, and what's shown is copied out.
+     */
+    struct SnapshotImage {
+        StoredValue *item;
+        std::string  key;
+        // A reference of our own (NULL if the value was ejected).
+        Blob        *value;
+    };
+
+    /**
+     * A point in time snapshot in progress over one partition.
+     */
+    struct PartitionSnapshot {
+        // Items last changed at or before this are unchanged since.
+        uint64_t                   seqno;
+        std::vector<SnapshotImage> preserved;
+    };
+
+    /**
+     * Where a scan of a partition has got to.
+     */
+    struct PartitionCursor {
+        // The tables the partition had when the scan started.
+        void   *tables[2];
+        int     which;
+        size_t  pos;
+    };
+
+    /**
+     * How a HashTable lays out its items.
+     */
+    typedef enum {
+        /** Linked lists of StoredValues hanging off each bucket. */
+        CHAINED_LAYOUT,
+        /** Open addressing with control bytes and inline keys. */
+        OPEN_LAYOUT
+    } hash_layout_t;
+
+// Number of control bytes (and slots) examined per probe step.
+#define OPEN_GROUP_WIDTH 16
+// Keys up to this length are kept in the slot array itself.
+#define OPEN_INLINE_KEY 23
+// Marker in OpenSlot::klen for keys only found in the StoredValue.
+#define OPEN_LONG_KEY 0xff
+
+    /**
+     * A slot in an open addressed partition.
+     */
+    struct OpenSlot {
+        StoredValue * volatile sv;
+        uint8_t                klen;
+        char                   key[OPEN_INLINE_KEY];
+    };
+
+// Buckets (or slot groups) moved to the new table per mutation while
+// a partition is resizing.
+#define RESIZE_STEP 4
+// Partitions never shrink below this many buckets (or slots).
+#define MIN_PARTITION_SIZE 16
+// Longest chain an optimistic reader walks before taking the lock.
+#define MAX_OPTIMISTIC_CHAIN 64
+
+    /**
+     * The portion of a HashTable guarded by one lock.
+     *
+     * A partition grows and shrinks on its own as its load factor
+     * changes.  A resize only allocates the new table; items are then
+     * moved over a few buckets at a time by each subsequent mutation,
+     * so no single operation pays for rehashing the whole partition.
+     *
+     * Except for optimisticFind, all methods assume the caller holds
+     * the partition's lock.  Structural changes (and sets, which
+     * change an item's value and CAS value together) must be
+     * bracketed by beginWrite/endWrite so optimistic readers can tell
+     * they raced with one, and anything unlinked goes to the
+     * partition's limbo.
+     *
+     * Each partition also keeps a list of its dirty items (linked
+     * through the items themselves) for the flusher.  Deletes stay in
+     * the table as dirty tombstones until the flusher has persisted
+     * them, so find() may return tombstones.
+     */
+    class HashPartition {
+    public:
+
+        HashPartition(EpochManager *m, SlabAllocator *a) : limbo(m), seq(0) {
+            count = 0;
+            mutations = 0;
+            casCounter = 0;
+            snapshot = NULL;
+            slabs = a;
+            dirtyHead = dirtyTail = NULL;
+            dirtyCount = 0;
+            nonResident = valueBytes = 0;
+            expiring = 0;
+        }
+
+        virtual ~HashPartition() {}
+
+        /**
+         * Find the item for the given key and hash (or NULL).
+         */
+        virtual StoredValue *find(std::string &key, uint64_t h) = 0;
+
+        /**
+         * Look for an item without holding the lock.
+         *
+         * Must be called inside an epoch, and the result is only
+         * meaningful if the sequence number from readBegin still
+         * validates afterwards.
+         *
+         * @return false if the caller should take the lock instead
+         */
+        virtual bool optimisticFind(std::string &key, uint64_t h,
+                                    StoredValue *&out) = 0;
+
+        /**
+         * Add an item for a key known not to be present.
+         */
+        virtual void insert(std::string &key, uint64_t h, StoredValue *v) = 0;
+
+        /**
+         * Unlink the item for the given key and return it (or NULL).
+         */
+        virtual StoredValue *remove(std::string &key, uint64_t h) = 0;
+
+        /**
+         * Retire every item.
+         */
+        virtual void clear() = 0;
+
+        /**
+         * Show every item to the visitor (until it says to stop).
+         *
+         * @return false if the visitor stopped early
+         */
+        virtual bool visit(HashTableVisitor &visitor) = 0;
+
+        /**
+         * Start a scan of the partition.
+         */
+        virtual void startScan(PartitionCursor &c) = 0;
+
+        /**
+         * Show the items in up to n more buckets (or slot groups) to
+         * the visitor.
+         *
+         * Items only move between tables when the partition is
+         * resized, and a table the partition no longer has was
+         * emptied by moving everything to the new one, so the rest of
+         * it is skipped.
+         *
+         * @return false once every table has been scanned
+         */
+        virtual bool scan(PartitionCursor &c, size_t n,
+                          HashTableVisitor &visitor) = 0;
+
+        /**
+         * Number of buckets (or slots) currently allocated.
+         */
+        virtual size_t getCapacity() = 0;
+
+        /**
+         * True while items are still being moved to a new table.
+         */
+        virtual bool isResizing() = 0;
+
+        /**
+         * Number of items in this partition.
+         */
+        size_t getNumItems() {
+            return count;
+        }
+
+        /**
+         * Number of live items whose values have been ejected.
+         */
+        size_t getNumNonResident() {
+            return nonResident;
+        }
+
+        /**
+         * Number of live items with an expiry time (may be read
+         * without the lock).
+         */
+        size_t getNumExpiring() {
+            return expiring;
+        }
+
+        /**
+         * Give an item a new expiry time (zero for never).
+         */
+        void setExptime(StoredValue *v, uint32_t t) {
+            if (v->exptime == 0 && t != 0) {
+                ++expiring;
+            } else if (v->exptime != 0 && t == 0) {
+                --expiring;
+            }
+            v->exptime = t;
+        }
+
+        /**
+         * Bytes of values in memory (may be read without the lock).
+         */
+        size_t getValueBytes() {
+            return valueBytes;
+        }
+
+        /**
+         * Stamp a new item with the next sequence number (and CAS
+         * value).
+         */
+        void noteAdded(StoredValue *v) {
+            v->seqno = ++mutations;
+            v->cas = nextCas();
+        }
+
+        /**
+         * A CAS value no item in this partition has had.
+         */
+        uint64_t nextCas() {
+            return ++casCounter;
+        }
+
+        /**
+         * Stamp an item about to be changed (or moved to a new table)
+         * with the next sequence number, first saving it for the
+         * snapshot in progress if it hasn't changed since that
+         * started.
+         */
+        void noteChanged(StoredValue *v) {
+            if (snapshot && v->seqno <= snapshot->seqno) {
+                // Tombstones aren't in the snapshot anyway.
+                if (!v->deleted) {
+                    SnapshotImage img;
+                    img.item = v;
+                    img.key = v->key;
+                    img.value = v->value ? v->value->acquire() : NULL;
+                    snapshot->preserved.push_back(img);
+                }
+            }
+            v->seqno = ++mutations;
+        }
+
+        /**
+         * Start (or with NULL, finish) a point in time snapshot.
+         */
+        void setSnapshot(PartitionSnapshot *s) {
+            if (s) {
+                s->seqno = mutations;
+            }
+            snapshot = s;
+        }
+
+        /**
+         * Account for a value being put into or taken out of an item.
+         */
+        void valueAdded(Blob *b) {
+            valueBytes += b->length();
+        }
+
+        void valueRemoved(Blob *b) {
+            valueBytes -= b->length();
+        }
+
+        /**
+         * Account for a live item losing or regaining its value.
+         */
+        void noteEjected() {
+            ++nonResident;
+        }
+
+        void noteResident() {
+            --nonResident;
+        }
+
+        /**
+         * Objects unlinked from this partition.
+         */
+        Limbo &getLimbo() {
+            return limbo;
+        }
+
+        /**
+         * Add an item that just became dirty to the dirty list.
+         */
+        void queueDirty(StoredValue *v) {
+            assert(v->nextDirty == NULL);
+            if (dirtyTail) {
+                dirtyTail->nextDirty = v;
+            } else {
+                dirtyHead = v;
+            }
+            dirtyTail = v;
+            ++dirtyCount;
+        }
+
+        /**
+         * Take the whole dirty list.
+         *
+         * The caller walks it with StoredValue::takeNextDirty (under
+         * the lock), which must happen before the item is marked
+         * clean and so can be queued again.
+         */
+        StoredValue *takeDirty() {
+            StoredValue *rv = dirtyHead;
+            forgetDirty();
+            return rv;
+        }
+
+        /**
+         * True if anything is waiting for the flusher (may be read
+         * without the lock).
+         */
+        bool hasDirty() {
+            return dirtyHead != NULL;
+        }
+
+        /**
+         * Number of items on the dirty list (may be read without the
+         * lock).
+         */
+        size_t getNumDirty() {
+            return dirtyCount;
+        }
+
+        void beginWrite() {
+            seq.incr();
+        }
+
+        void endWrite() {
+            seq.incr();
+        }
+
+        /**
+         * Sequence number to validate an optimistic read against
+         * (odd while a writer is active).
+         */
+        uint32_t readBegin() {
+            uint32_t s = seq.get();
+            memory_barrier();
+            return s;
+        }
+
+        /**
+         * True if no writer touched the partition since readBegin.
+         */
+        bool readValidate(uint32_t s) {
+            return seq.get() == s;
+        }
+
+    protected:
+
+        void forgetDirty() {
+            dirtyHead = dirtyTail = NULL;
+            dirtyCount = 0;
+        }
+
+        size_t                  count;
+        uint64_t                mutations;
+        uint64_t                casCounter;
+        PartitionSnapshot      *snapshot;
+        Limbo                   limbo;
+        SlabAllocator          *slabs;
+        StoredValue * volatile  dirtyHead;
+        StoredValue            *dirtyTail;
+        volatile size_t         dirtyCount;
+        size_t                  nonResident;
+        volatile size_t         valueBytes;
+        volatile size_t         expiring;
+
+    private:
+        Atomic<uint32_t> seq;
+
+        DISALLOW_COPY_AND_ASSIGN(HashPartition);
+    };
+
+    /**
+     * A bucket array published to optimistic readers as a unit.
+     */
+    struct ChainedTable {
+        size_t        nbuckets;
+        StoredValue **buckets;
+    };
+
+    /**
+     * A partition made of linked lists hanging off each bucket.
+     *
+     * While resizing, old buckets below the migration cursor have
+     * been moved to the new table; items hashing to any other old
+     * bucket are still found (and inserted) there.
+     */
+    class ChainedPartition : public HashPartition {
+    public:
+
+        ChainedPartition(EpochManager *m, SlabAllocator *a, size_t n);
+
+        ~ChainedPartition();
+
+        StoredValue *find(std::string &key, uint64_t h);
+
+        bool optimisticFind(std::string &key, uint64_t h, StoredValue *&out);
+
+        void insert(std::string &key, uint64_t h, StoredValue *v);
+
+        StoredValue *remove(std::string &key, uint64_t h);
+
+        void clear();
+
+        bool visit(HashTableVisitor &visitor);
+
+        void startScan(PartitionCursor &c);
+
+        bool scan(PartitionCursor &c, size_t n, HashTableVisitor &visitor);
+
+        size_t getCapacity() {
+            return table->nbuckets;
+        }
+
+        bool isResizing() {
+            return old != NULL;
+        }
+
+    private:
+        StoredValue * volatile *chain(uint64_t h);
+        void maybeResize();
+        void migrate(size_t n);
+
+        ChainedTable * volatile table;
+        ChainedTable * volatile old;
+        volatile size_t         cursor;
+
+        DISALLOW_COPY_AND_ASSIGN(ChainedPartition);
+    };
+
+    /**
+     * A slot array published to optimistic readers as a unit.
+     */
+    struct OpenTable {
+        size_t    capacity;
+        int8_t   *ctrl;
+        OpenSlot *slots;
+    };
+
+    /**
+     * An open addressed (Swiss table style) partition.
+     *
+     * Each slot has a control byte that is either empty, deleted, or
+     * holds seven bits of the key's hash.  Lookups compare a whole
+     * group of control bytes at once and only look at the key (which
+     * is usually right there in the slot) when the tag matches.
+     *
+     * While resizing, groups of the old table are moved to the new
+     * one in order.  Moved slots are left as tombstones, so every
+     * item lives in exactly one of the two tables.
+     */
+    class OpenPartition : public HashPartition {
+    public:
+
+        OpenPartition(EpochManager *m, SlabAllocator *a, size_t n);
+
+        ~OpenPartition();
+
+        StoredValue *find(std::string &key, uint64_t h);
+
+        bool optimisticFind(std::string &key, uint64_t h, StoredValue *&out);
+
+        void insert(std::string &key, uint64_t h, StoredValue *v);
+
+        StoredValue *remove(std::string &key, uint64_t h);
+
+        void clear();
+
+        bool visit(HashTableVisitor &visitor);
+
+        void startScan(PartitionCursor &c);
+
+        bool scan(PartitionCursor &c, size_t n, HashTableVisitor &visitor);
+
+        size_t getCapacity() {
+            return table->capacity;
+        }
+
+        bool isResizing() {
+            return old != NULL;
+        }
+
+    private:
+        void place(const char *k, size_t klen, uint64_t h, StoredValue *v);
+        void startResize(size_t newcap);
+        void migrate(size_t n);
+
+        OpenTable * volatile table;
+        OpenTable * volatile old;
+        size_t               ocursor;
+        size_t               used;
+        size_t               tombstones;
+
+        DISALLOW_COPY_AND_ASSIGN(OpenPartition);
+    };
+
+// Optimistic attempts a lock-free read makes before taking the lock.
+#define OPTIMISTIC_READ_TRIES 4
+// Buckets (or slot groups) a scan looks at per lock acquisition.
+#define SCAN_STEP 64
+
     class HashTable {
     public:
 
-        // Construct with number of buckets and locks.
-        HashTable(size_t s = 196613, size_t l = 193) {
-            size = s;
+        // Construct with an initial number of buckets and number of locks.
+        //
+        // Each lock guards its own partition of the table, and the
+        // bucket numbers handed out are partition numbers.
+        HashTable(size_t s = 196613, size_t l = 193,
+                  hash_layout_t lay = CHAINED_LAYOUT) {
             n_locks = l;
             active = true;
-            values = (StoredValue**)calloc(s, sizeof(StoredValue**));
+            partitions = (HashPartition**)calloc(l, sizeof(HashPartition*));
             mutexes = (pthread_mutex_t*)calloc(l, sizeof(pthread_mutex_t));
+            snapshotMutexes = (pthread_mutex_t*)calloc(l,
+                                                       sizeof(pthread_mutex_t));
             for (int i = 0; i < (int)n_locks; i++) {
+                if (lay == OPEN_LAYOUT) {
+                    partitions[i] = new OpenPartition(&epochs, &slabs, s / l);
+                } else {
+                    partitions[i] = new ChainedPartition(&epochs, &slabs,
+                                                         s / l);
+                }
                 pthread_mutex_init(&mutexes[i], NULL);
+                pthread_mutex_init(&snapshotMutexes[i], NULL);
             }
         }
 
         ~HashTable() {
             clear();
             for (int i = 0; i < (int)n_locks; i++) {
+                delete partitions[i];
                 pthread_mutex_destroy(&mutexes[i]);
+                pthread_mutex_destroy(&snapshotMutexes[i]);
             }
             free(mutexes);
-            free(values);
+            free(snapshotMutexes);
+            free(partitions);
             mutexes = NULL;
-            values = NULL;
+            partitions = NULL;
             active = false;
         }
 
+        // Drop everything, including anything waiting to be flushed.
         void clear() {
             assert(active);
-            for (int i = 0; i < (int)size; i++) {
+            for (int i = 0; i < (int)n_locks; i++) {
                 LockHolder lh(getMutex(i));
-                while (values[i]) {
-                    StoredValue *v = values[i];
-                    values[i] = v->next;
-                    delete v;
-                }
+                partitions[i]->beginWrite();
+                partitions[i]->clear();
+                partitions[i]->endWrite();
             }
+            dirtyItems.set(0);
+            dirtyBytes.set(0);
         }
 
         StoredValue *find(std::string &key) {
             assert(active);
-            int bucket_num = bucket(key);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
             LockHolder lh(getMutex(bucket_num));
-            return unlocked_find(key, bucket_num);
+            return unlocked_find(key, bucket_num, h);
         }
 
+        // Copy out the value for a key without taking any lock
+        // (unless readers keep racing with writers), and its CAS
+        // value if asked.
+        value_state_t get(std::string &key, std::string &out,
+                          uint64_t *cas = NULL) {
+            assert(active);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
+            HashPartition *p = partitions[bucket_num];
+
+            EpochGuard eg(&epochs);
+            for (int i = 0; i < OPTIMISTIC_READ_TRIES; i++) {
+                uint32_t s = p->readBegin();
+                if (s & 1) {
+                    continue;
+                }
+                StoredValue *v = NULL;
+                if (!p->optimisticFind(key, h, v)) {
+                    break;
+                }
+                // A delete clears the value after flagging the item,
+                // so either check can catch one.  A set changes the
+                // value and CAS value together as a write, so if the
+                // read validates they go together.
+                Blob *val = v && !v->isDeleted() ? v->getBlob() : NULL;
+                uint64_t c = cas && v ? v->cas : 0;
+                if (p->readValidate(s)) {
+                    if (!v || v->isDeleted()) {
+                        return VALUE_MISSING;
+                    }
+                    if (v->hasExpired()) {
+                        // Left for the expiry pager to reclaim.
+                        numExpired.incr();
+                        return VALUE_MISSING;
+                    }
+                    if (!val) {
+                        // Ejected (or caught mid-update); sort it
+                        // out under the lock.
+                        break;
+                    }
+                    if (!v->referenced) {
+                        v->referenced = true;
+                    }
+                    // Blobs are never modified, and this one can't
+                    // be freed until we leave the epoch.
+                    out.assign(val->getData(), val->length());
+                    if (cas) {
+                        *cas = c;
+                    }
+                    return VALUE_FOUND;
+                }
+            }
+
+            LockHolder lh(getMutex(bucket_num));
+            StoredValue *v = unlocked_find(key, bucket_num, h);
+            if (!v) {
+                return VALUE_MISSING;
+            }
+            if (v->hasExpired()) {
+                numExpired.incr();
+                return VALUE_MISSING;
+            }
+            if (!v->isResident()) {
+                return VALUE_EJECTED;
+            }
+            v->referenced = true;
+            out.assign(v->getValue(), v->getBlob()->length());
+            if (cas) {
+                *cas = v->cas;
+            }
+            return VALUE_FOUND;
+        }
+
+        // Put a fetched value back into an item whose value was
+        // ejected, and copy out the item's current value (and CAS
+        // value if asked).
+        //
+        // Returns VALUE_MISSING if the item has gone away since (or,
+        // with insertMissing, if it's been deleted since; otherwise a
+        // missing item is added).
+        value_state_t restore(std::string &key, std::string &val,
+                              std::string &out, bool insertMissing=false,
+                              uint64_t *cas=NULL) {
+            assert(active);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
+            LockHolder lh(getMutex(bucket_num));
+            HashPartition *p = partitions[bucket_num];
+            StoredValue *v = p->find(key, h);
+            if (!v && insertMissing) {
+                v = insertClean(p, key, h, val.c_str(), true);
+            }
+            if (!v || v->isDeleted() || v->hasExpired()) {
+                return VALUE_MISSING;
+            }
+            if (!v->isResident()) {
+                // Still clean, so this is what was persisted.
+                Blob *b = Blob::create(val.c_str(), slabs);
+                memory_barrier();
+                v->value = b;
+                p->valueAdded(b);
+                p->noteResident();
+            }
+            out.assign(v->getValue(), v->getBlob()->length());
+            if (cas) {
+                *cas = v->cas;
+            }
+            return VALUE_FOUND;
+        }
+
+        // Add a clean item loaded from the store, unless the key is
+        // already known (a set or delete since takes precedence).
+        //
+        // If not resident, only the key is kept.
+        bool warm(std::string &key, const char *val, bool resident) {
+            assert(active);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
+            LockHolder lh(getMutex(bucket_num));
+            HashPartition *p = partitions[bucket_num];
+            if (p->find(key, h)) {
+                return false;
+            }
+            insertClean(p, key, h, val, resident);
+            return true;
+        }
+
+        // Eject the values of clean items in a partition until at
+        // least the given number of bytes are freed (or there's
+        // nothing left to eject).  Recently read items get a second
+        // chance.
+        //
+        // Returns the bytes freed, adding the items ejected to count.
+        size_t eject(int bucket_num, size_t bytes, size_t &count);
+
         // True if this existed and was clean
-        mutation_type_t set(std::string &key, std::string &val) {
-            return set(key, val.c_str());
+        mutation_type_t set(std::string &key, std::string &val,
+                            uint32_t exptime = 0) {
+            return set(key, val.c_str(), exptime);
         }
 
-        mutation_type_t set(std::string &key, const char *val) {
+        // Anything not already dirty is queued for the flusher.
+        //
+        // The item expires at exptime (see ep_current_time) unless
+        // that's zero.
+        mutation_type_t set(std::string &key, const char *val,
+                            uint32_t exptime = 0) {
             assert(active);
-            mutation_type_t rv = NOT_FOUND;
-            int bucket_num = bucket(key);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
             LockHolder lh(getMutex(bucket_num));
-            StoredValue *v = unlocked_find(key, bucket_num);
-            if (v) {
-                rv = v->isClean() ? WAS_CLEAN : WAS_DIRTY;
-                v->setValue(val);
-            } else {
-                v = new StoredValue(key, val, values[bucket_num]);
-                values[bucket_num] = v;
+            HashPartition *p = partitions[bucket_num];
+            return store(p, key, h, p->find(key, h), val, exptime);
+        }
+
+        // Apply a mutation to a key's value under its lock.
+        //
+        // An ejected value must be fetched back first, so that's
+        // left to the caller.
+        update_state_t mutate(std::string &key, const Mutation &m,
+                              MutationResult &r) {
+            assert(active);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
+            LockHolder lh(getMutex(bucket_num));
+            HashPartition *p = partitions[bucket_num];
+            StoredValue *v = p->find(key, h);
+            if (!v || v->isDeleted()) {
+                r.status = MUTATION_NOT_FOUND;
+                return UPDATE_SKIPPED;
             }
-            return rv;
+            if (v->hasExpired()) {
+                numExpired.incr();
+                r.status = MUTATION_NOT_FOUND;
+                return UPDATE_SKIPPED;
+            }
+            if (!v->isResident()) {
+                return UPDATE_EJECTED;
+            }
+            std::string nv;
+            r.status = m.apply(v->getValue(), v->getBlob()->length(), v->cas,
+                               nv, r.number);
+            if (r.status != MUTATION_DONE) {
+                return UPDATE_SKIPPED;
+            }
+            mutation_type_t mtype = store(p, key, h, v, nv.c_str(),
+                                          v->exptime);
+            r.cas = v->cas;
+            return mtype == WAS_DIRTY ? UPDATE_WAS_DIRTY : UPDATE_QUEUED;
         }
 
+        // Find a live item (not a tombstone).
         StoredValue *unlocked_find(std::string &key, int bucket_num) {
-            StoredValue *v = values[bucket_num];
-            while (v) {
-                if (key.compare(v->key) == 0) {
-                    return v;
-                }
-                v = v->next;
-            }
-            return NULL;
+            return unlocked_find(key, bucket_num, hash(key));
+        }
+
+        StoredValue *unlocked_find(std::string &key, int bucket_num,
+                                   uint64_t h) {
+            StoredValue *v = partitions[bucket_num]->find(key, h);
+            return v && !v->isDeleted() ? v : NULL;
         }
 
         inline int bucket(std::string &key) {
             assert(active);
-            int h=5381;
-            int i=0;
-            const char *str=key.c_str();
+            return partitionFor(hash(key));
+        }
 
-            for(i=0; str[i] != 0x00; i++) {
-                h = ((h << 5) + h) ^ str[i];
-            }
+        // Well mixed hash used to place keys.
+        //
+        // The high half picks the partition and the low half the
+        // bucket (or slot group and tag) within it.
+        static inline uint64_t hash(std::string &key) {
+            return hash_bytes(key.data(), key.length());
+        }
 
-            return abs(h) % (int)size;
+        // Map a hash onto a partition (multiplying rather than
+        // dividing, as there are a prime number of them).
+        inline int partitionFor(uint64_t h) {
+            return (int)(((h >> 32) * n_locks) >> 32);
         }
 
         // Get the mutex for a bucket (for doing your own lock management)
         inline pthread_mutex_t *getMutex(int bucket_num) {
             assert(active);
-            assert(bucket_num < (int)size);
+            assert(bucket_num < (int)n_locks);
             assert(bucket_num >= 0);
-            int lock_num = bucket_num % (int)n_locks;
-            assert(lock_num < (int)n_locks);
-            assert(lock_num >= 0);
-            return &mutexes[lock_num];
+            return &mutexes[bucket_num];
         }
 
         // True if it existed
-        bool del(std::string &key) {
+        //
+        // The item stays behind as a dirty tombstone until the
+        // flusher has persisted the delete and purges it.  With
+        // tombstoneMissing, a key that isn't here gets a tombstone
+        // too (in case the store has it).
+        bool del(std::string &key, bool tombstoneMissing=false) {
             assert(active);
-            int bucket_num = bucket(key);
+            uint64_t h = hash(key);
+            int bucket_num = partitionFor(h);
             LockHolder lh(getMutex(bucket_num));
+            HashPartition *p = partitions[bucket_num];
+            StoredValue *v = p->find(key, h);
+            if (!v && tombstoneMissing) {
+                // Made a (dirty) tombstone before anyone can see it.
+                v = StoredValue::create(key, h, "", slabs);
+                v->ejectValue()->release(slabs);
+                v->deleted = true;
+                p->noteAdded(v);
+                p->beginWrite();
+                p->insert(key, h, v);
+                p->endWrite();
+                queueDirty(p, v);
+                return false;
+            }
+            if (!v || v->isDeleted()) {
+                return false;
+            }
+            // An expired item is deleted all the same, but it was
+            // already gone as far as anyone could tell.
+            bool expired = v->hasExpired();
+            tombstone(p, v);
+            return !expired;
+        }
 
-            StoredValue *v = values[bucket_num];
+        // Turn the expired items in a partition into deletes (a few
+        // buckets at a time, so traffic isn't held up).
+        //
+        // Returns how many there were.
+        size_t expire(int bucket_num, uint32_t now);
 
-            // Special case empty bucket.
-            if (!v) {
-                return false;
+        // Number of reads and mutations that found an item expired.
+        uint64_t getNumExpired() {
+            return numExpired.get();
+        }
+
+        // Number of expired items turned into deletes.
+        uint64_t getNumReclaimed() {
+            return numReclaimed.get();
+        }
+
+        // Number of partitions (and locks) bucket numbers range over.
+        int getNumPartitions() {
+            return (int)n_locks;
+        }
+
+        // Take the dirty list of a partition (caller holds its lock).
+        StoredValue *takeDirty(int bucket_num) {
+            return partitions[bucket_num]->takeDirty();
+        }
+
+        // Bytes of values in memory (a lock-free hint).
+        size_t getValueBytes() {
+            size_t rv = 0;
+            for (int i = 0; i < (int)n_locks; i++) {
+                rv += partitions[i]->getValueBytes();
             }
+            return rv;
+        }
+
+        // Bytes of replaced and ejected values still waiting for
+        // readers to move on (a lock-free hint).
+        size_t getRetiredBytes() {
+            size_t rv = 0;
+            for (int i = 0; i < (int)n_locks; i++) {
+                rv += partitions[i]->getLimbo().getBytes();
+            }
+            return rv;
+        }
 
-            // Special case the first one
-            if (key.compare(v->key) == 0) {
-                values[bucket_num] = v->next;
-                delete v;
-                return true;
+        // True if a partition has anything waiting to be freed (a
+        // lock-free hint).
+        bool hasRetired(int bucket_num) {
+            return partitions[bucket_num]->getLimbo().getCount() > 0;
+        }
+
+        // Free what a partition retired that readers are done with
+        // (which otherwise waits for it to retire more).
+        void reclaim(int bucket_num) {
+            if (hasRetired(bucket_num)) {
+                LockHolder lh(getMutex(bucket_num));
+                partitions[bucket_num]->getLimbo().reclaim();
             }
+        }
 
-            while (v->next) {
-                if (key.compare(v->next->key) == 0) {
-                    StoredValue *tmp = v->next;
-                    v->next = v->next->next;
-                    delete tmp;
+        // Number of live items whose values have been ejected.
+        size_t getNumNonResident() {
+            size_t rv = 0;
+            for (int i = 0; i < (int)n_locks; i++) {
+                LockHolder lh(getMutex(i));
+                rv += partitions[i]->getNumNonResident();
+            }
+            return rv;
+        }
+
+        // Show every item in a partition to the visitor.
+        bool visit(int bucket_num, HashTableVisitor &visitor) {
+            LockHolder lh(getMutex(bucket_num));
+            return partitions[bucket_num]->visit(visitor);
+        }
+
+        // Show every live item to the visitor, holding each
+        // partition's lock for only SCAN_STEP buckets at a time (and
+        // calling the visitor with no lock held).
+        //
+        // With pointInTime, every item is seen as it was when the
+        // scan started: whoever changes an item the scan hasn't got
+        // to yet saves what it was, and items added since aren't
+        // seen.  Otherwise items are seen as the scan finds them, and
+        // a resize meanwhile may cause an item to be missed or seen
+        // twice.  Either way, a clear() meanwhile loses items.
+        //
+        // Only partitions where i % nslices == slice are scanned.
+        // Point in time scans of disjoint slices run at once; ones
+        // that share partitions take turns at them.
+        void scan(SnapshotVisitor &visitor, bool pointInTime=true,
+                  int slice=0, int nslices=1);
+
+        // Number of dirty items waiting in a partition (a lock-free hint).
+        size_t getNumDirty(int bucket_num) {
+            return partitions[bucket_num]->getNumDirty();
+        }
+
+        // Number of items dirty or written out but not yet committed.
+        size_t getDirtyItems() {
+            return dirtyItems.get();
+        }
+
+        // Bytes of keys and values of those items.
+        size_t getDirtyBytes() {
+            return dirtyBytes.get();
+        }
+
+        // Account for items the flusher has committed (marking each
+        // clean took the given number of bytes off).
+        void persisted(size_t items, size_t bytes) {
+            dirtyItems.decr(items);
+            dirtyBytes.decr(bytes);
+        }
+
+        // Bytes an item counts for while dirty (caller holds its lock).
+        static size_t dirtySize(StoredValue *v) {
+            return v->getKey().length() + (v->value ? v->value->length() : 0);
+        }
+
+        // True if any partition has dirty items (a lock-free hint).
+        bool hasDirty() {
+            for (int i = 0; i < (int)n_locks; i++) {
+                if (partitions[i]->hasDirty()) {
                     return true;
                 }
             }
-
             return false;
         }
 
+        // Remove a tombstone whose delete has been persisted, unless
+        // it's been set or deleted again since.
+        void purge(int bucket_num, StoredValue *v) {
+            LockHolder lh(getMutex(bucket_num));
+            if (v->isDeleted() && v->isClean()) {
+                HashPartition *p = partitions[bucket_num];
+                p->beginWrite();
+                StoredValue *gone = p->remove(v->getKey(), v->getHash());
+                p->endWrite();
+                assert(gone == v);
+                p->getLimbo().retire(gone, StoredValue::destroy, &slabs);
+            }
+        }
+
+        // Purge every tombstone in a partition whose delete has been
+        // persisted.
+        //
+        // Returns how many were purged.
+        size_t purgeTombstones(int bucket_num);
+
+        // Total number of items (including unpurged tombstones).
+        size_t getNumItems() {
+            size_t rv = 0;
+            for (int i = 0; i < (int)n_locks; i++) {
+                LockHolder lh(getMutex(i));
+                rv += partitions[i]->getNumItems();
+            }
+            return rv;
+        }
+
+        // Memory used by items and their values.
+        SlabAllocator &getSlabs() {
+            return slabs;
+        }
+
+        // Total number of buckets (or slots) currently allocated.
+        size_t getNumBuckets() {
+            size_t rv = 0;
+            for (int i = 0; i < (int)n_locks; i++) {
+                LockHolder lh(getMutex(i));
+                rv += partitions[i]->getCapacity();
+            }
+            return rv;
+        }
+
     private:
-        size_t            size;
+
+        void scanPartition(int bucket_num, SnapshotVisitor &visitor,
+                           PartitionSnapshot *snap);
+
+        // Give a key (which may have an item, possibly a tombstone)
+        // a new value and expiry time (caller holds the partition's
+        // lock).
+        mutation_type_t store(HashPartition *p, std::string &key,
+                              uint64_t h, StoredValue *v, const char *val,
+                              uint32_t exptime) {
+            mutation_type_t rv = NOT_FOUND;
+            if (v) {
+                bool wasDirty = v->isDirty();
+                if (!v->isDeleted()) {
+                    rv = wasDirty ? WAS_DIRTY : WAS_CLEAN;
+                }
+                p->noteChanged(v);
+                // Lock-free readers retry rather than see the new
+                // value with the old CAS value.
+                p->beginWrite();
+                Blob *old = v->replaceValue(val, slabs);
+                if (wasDirty) {
+                    dirtyResized(old ? old->length() : 0,
+                                 v->getBlob()->length());
+                }
+                if (old) {
+                    p->valueRemoved(old);
+                    p->getLimbo().retire(old, Blob::releaseRetired, &slabs,
+                                         old->length());
+                } else if (!v->isDeleted()) {
+                    p->noteResident();
+                }
+                p->valueAdded(v->getBlob());
+                memory_barrier();
+                v->deleted = false;
+                p->setExptime(v, exptime);
+                v->cas = p->nextCas();
+                p->endWrite();
+                if (!wasDirty) {
+                    queueDirty(p, v);
+                }
+            } else {
+                v = StoredValue::create(key, h, val, slabs);
+                p->noteAdded(v);
+                p->setExptime(v, exptime);
+                p->beginWrite();
+                p->insert(key, h, v);
+                p->endWrite();
+                p->valueAdded(v->getBlob());
+                queueDirty(p, v);
+            }
+            return rv;
+        }
+
+        // Turn a live item into a dirty tombstone (caller holds the
+        // partition's lock).
+        void tombstone(HashPartition *p, StoredValue *v) {
+            p->noteChanged(v);
+            v->deleted = true;
+            p->setExptime(v, 0);
+            memory_barrier();
+            if (v->value && v->isDirty()) {
+                dirtyResized(v->value->length(), 0);
+            }
+            if (v->value) {
+                p->valueRemoved(v->value);
+                p->getLimbo().retire(v->value, Blob::releaseRetired, &slabs,
+                                     v->value->length());
+                v->value = NULL;
+            } else {
+                p->noteResident();
+            }
+            if (v->isClean()) {
+                v->markDirty();
+                queueDirty(p, v);
+            }
+        }
+
+        // Queue an item that just became dirty (caller holds the
+        // partition's lock).
+        void queueDirty(HashPartition *p, StoredValue *v) {
+            v->dirtiedAt = (uint32_t)now_usec();
+            p->queueDirty(v);
+            dirtyItems.incr();
+            dirtyBytes.incr(dirtySize(v));
+        }
+
+        // A dirty item's value changed size.
+        void dirtyResized(size_t oldLen, size_t newLen) {
+            if (newLen > oldLen) {
+                dirtyBytes.incr(newLen - oldLen);
+            } else if (oldLen > newLen) {
+                dirtyBytes.decr(oldLen - newLen);
+            }
+        }
+
+        // Add a new clean item (caller holds the partition's lock).
+        StoredValue *insertClean(HashPartition *p, std::string &key,
+                                 uint64_t h, const char *val, bool resident) {
+            StoredValue *v = StoredValue::create(key, h, val, slabs);
+            v->markClean();
+            p->noteAdded(v);
+            if (!resident) {
+                // Nobody else has seen it yet.
+                v->ejectValue()->release(slabs);
+            }
+            p->beginWrite();
+            p->insert(key, h, v);
+            p->endWrite();
+            if (resident) {
+                p->valueAdded(v->getBlob());
+            } else {
+                p->noteEjected();
+            }
+            return v;
+        }
+
         size_t            n_locks;
         bool              active;
-        StoredValue     **values;
+        EpochManager      epochs;
+        SlabAllocator     slabs;
+        HashPartition   **partitions;
         pthread_mutex_t  *mutexes;
+        // Each held by a point in time scan until it's done with
+        // that partition.
+        pthread_mutex_t  *snapshotMutexes;
+        // Dirty items and their bytes, until the flusher commits them.
+        Atomic<size_t>    dirtyItems;
+        Atomic<size_t>    dirtyBytes;
+        Atomic<uint64_t>  numExpired;
+        Atomic<uint64_t>  numReclaimed;
 
         DISALLOW_COPY_AND_ASSIGN(HashTable);
     };
 
     // Forward declaration
     class Flusher;
+    class EventuallyPersistentStore;
 
+    /**
+     * A thread loading one slice of a store during warmup.
+     */
+    struct WarmupSlice {
+        EventuallyPersistentStore *store;
+        KVStore                   *kvs;
+        // Held while scanning a store that has to be scanned alone.
+        pthread_mutex_t           *txnMutex;
+        size_t                     slice;
+        size_t                     nslices;
+        pthread_t                  thread;
+    };
+
+    /**
+     * How a flusher groups dirty items into transactions.
+     *
+     * A flusher waits until it has at least minItems dirty items, or
+     * until the first of them has lingered for maxLingerMs, before it
+     * starts writing.  A transaction is committed once it holds
+     * maxItems items or maxBytes bytes of keys and values (zero means
+     * no limit), and the rest go in further transactions.
+     *
+     * With sortKeys, each pass gathers everything dirty and writes it
+     * out in key order (bytewise, as SQLite's primary key index and a
+     * default BDB btree keep them), so each transaction touches a run
+     * of neighbouring pages rather than pages all over the tree.
+     *
+     * The defaults write out whatever is dirty as soon as it shows up,
+     * in hash order, all in one transaction.
+     */
+    struct FlushPolicy {
+        FlushPolicy() : minItems(1), maxLingerMs(0),
+                        maxItems(0), maxBytes(0), sortKeys(false) {}
+
+        size_t minItems;
+        size_t maxLingerMs;
+        size_t maxItems;
+        size_t maxBytes;
+        bool   sortKeys;
+    };
+
+    /**
+     * What the flushers have been up to.
+     */
+    struct FlushHistograms {
+        /** Items written in each transaction. */
+        Histogram batchItems;
+        /** Bytes of keys and values written in each transaction. */
+        Histogram batchBytes;
+        /** Time taken by each commit on the underlying store. */
+        Histogram commitUsec;
+        /** Time taken to write (set or delete) each item. */
+        Histogram writeUsec;
+        /** Time from an item becoming dirty to its commit. */
+        Histogram dirtyAgeUsec;
+
+        void merge(const FlushHistograms &h);
+        void reset();
+        void print(std::ostream &o) const;
+    };
+
+    /**
+     * When sets are held back because the flushers are falling behind.
+     *
+     * Once more than highItems dirty items, or more than highBytes
+     * bytes of their keys and values, are waiting to be committed,
+     * sets are throttled until both are back down to lowItems and
+     * lowBytes (a zero mark is no limit, and a zero low mark is the
+     * high one).  A throttled set waits for the flushers to catch up,
+     * for at most maxDelayMs (zero is as long as it takes); with
+     * reject, or if that's too long, it fails instead so the client
+     * can shed load.
+     */
+    struct ThrottlePolicy {
+        ThrottlePolicy() : highItems(0), lowItems(0), highBytes(0),
+                           lowBytes(0), maxDelayMs(0), reject(false) {}
+
+        bool enabled() const {
+            return highItems > 0 || highBytes > 0;
+        }
+
+        size_t highItems;
+        size_t lowItems;
+        size_t highBytes;
+        size_t lowBytes;
+        size_t maxDelayMs;
+        bool   reject;
+    };
+
+    /**
+     * Keeps everything in memory and writes dirty items to the
+     * underlying store(s) in the background.
+     *
+     * The partitions of the hash table are split into contiguous
+     * ranges, one per flusher thread.  Flushers either each persist
+     * to their own store, or share one, in which case their
+     * transactions on it are serialized.
+     */
     class EventuallyPersistentStore : public KVStore {
     public:
 
-        EventuallyPersistentStore(KVStore *t, size_t est=32768);
+        EventuallyPersistentStore(KVStore *t, size_t est=32768,
+                                  hash_layout_t layout=CHAINED_LAYOUT,
+                                  size_t nflushers=1,
+                                  const FlushPolicy &policy=FlushPolicy());
+
+        /**
+         * Run one flusher per store.
+         */
+        EventuallyPersistentStore(std::vector<KVStore*> &stores,
+                                  size_t est=32768,
+                                  hash_layout_t layout=CHAINED_LAYOUT,
+                                  const FlushPolicy &policy=FlushPolicy());
 
         ~EventuallyPersistentStore();
 
@@ -234,59 +1620,374 @@ namespace kvtest {
         void set(std::string &key, const char *val,
                  Callback<bool> &cb);
 
+        /**
+         * Set an item that expires after ttl seconds (zero for
+         * never).
+         *
+         * An expired item reads as missing right away, and the
+         * expiry pager deletes it from the store later.
+         */
+        void setWithTTL(std::string &key, std::string &val, uint32_t ttl,
+                        Callback<bool> &cb);
+
         void get(std::string &key, Callback<GetValue> &cb);
 
         void del(std::string &key, Callback<bool> &cb);
 
+        /**
+         * Get with the item's CAS value.
+         */
+        void gets(std::string &key, Callback<GetValue> &cb);
+
+        /**
+         * Apply the mutation under the item's lock, once its value is
+         * in memory (it's throttled like a set).
+         */
+        void mutate(std::string &key, Mutation &m,
+                    Callback<MutationResult> &cb);
+
+        /**
+         * Set every item under one throttle check.
+         */
+        void setMulti(std::vector<KeyValue> &items,
+                      Callback<std::vector<bool> > &cb);
+
+        /**
+         * Get every key, completing inline unless some value must be
+         * read back from a store.
+         */
+        void getMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<GetValue> > &cb);
+
+        void delMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<bool> > &cb);
+
         void reset();
 
+        /**
+         * Write out everything dirty and wait until it's committed to
+         * the underlying stores.
+         */
+        void commit();
+
+        /**
+         * Hand every item to the callback as it was when the dump
+         * started, without holding up traffic meanwhile.
+         *
+         * Ejected values are read back from the store, so may be
+         * newer than the snapshot.  Each slice is its own snapshot.
+         */
+        void dump(Callback<KeyValue> &cb, size_t slice = 0,
+                  size_t nslices = 1);
+
+        size_t getMaxScanSlices() {
+            return (size_t)storage.getNumPartitions();
+        }
+
+        void printStats(std::ostream &o);
+
+        /**
+         * Limit the bytes of values kept in memory (zero for no limit).
+         *
+         * Past the limit, flushers eject the values of clean items
+         * (keeping the keys), and a get of one of those completes
+         * once a flusher has fetched it back from its store.
+         */
+        void setMemoryQuota(size_t bytes) {
+            memQuota = bytes;
+        }
+
+        /**
+         * Get the flushers' histograms (added together) since the
+         * last reset.
+         */
+        void getFlushHistograms(FlushHistograms &h);
+
+        /**
+         * Set how often (in seconds) each flusher looks for expired
+         * items in its partitions and deletes them (zero for never).
+         */
+        void setExpiryPagerInterval(uint32_t secs);
+
+        /**
+         * Set the watermarks past which sets are throttled (set this
+         * up before sending any traffic).
+         */
+        void setThrottle(const ThrottlePolicy &p);
+
+        /**
+         * Load every item in the underlying store(s) into memory as
+         * clean items, scanning each store in up to nthreads slices
+         * at once.
+         *
+         * Traffic may be served meanwhile: an item set or deleted
+         * during warmup keeps its new state, and a get of an item not
+         * loaded yet is fetched from the store.
+         *
+         * @param nthreads scanning threads per store
+         * @param wait if true, return once warmup is done (printing
+         *        progress to stdout meanwhile)
+         */
+        void warmup(size_t nthreads, bool wait=true);
+
+        /**
+         * True while warmup is loading items.
+         */
+        bool isWarmingUp() {
+            return warming;
+        }
+
+        /**
+         * Wait for warmup (if any) to finish.
+         */
+        void waitForWarmup();
+
     private:
 
-        void queueDirty(std::string &key);
-        void flush(bool shouldWait);
-        void flushSome(std::queue<std::string> *q, Callback<bool> &cb);
-        void initQueue();
+        static void *launchWarmup(void *arg);
+        void warmSlice(WarmupSlice *ws);
+        void finishWarmup();
+        void printWarmup(std::ostream &o);
+
+        void setItem(std::string &key, const char *val, uint32_t exptime,
+                     Callback<bool> &cb);
+        void lookup(std::string &key, Callback<GetValue> &cb, bool withCas);
+        void applyMutation(std::string &key, Mutation &m,
+                           Callback<MutationResult> &cb, bool fetched);
+
+        bool shouldThrottle();
+        bool waitForFlushers();
+        void releaseThrottled();
+
+        void startFlushers(std::vector<KVStore*> &stores,
+                           const FlushPolicy &policy);
+        void wakeFlusher(std::string &key);
 
         friend class Flusher;
+        friend class PendingMutation;
 
-        KVStore                 *underlying;
         size_t                   est_size;
-        Flusher                 *flusher;
         HashTable                storage;
-        pthread_mutex_t          mutex;
-        pthread_cond_t           cond;
-        std::queue<std::string> *towrite;
-        pthread_t                thread;
+        std::vector<Flusher*>    flushers;
+        // Which flusher owns each partition.
+        std::vector<Flusher*>    flusherFor;
+        pthread_mutex_t          sharedStoreMutex;
+        volatile size_t          memQuota;
+        volatile uint32_t        expiryPagerSecs;
+        Atomic<uint64_t>         numEjections;
+        Atomic<uint64_t>         numFetches;
+        Atomic<uint64_t>         fetchUsec;
+        Atomic<uint64_t>         fetchMaxUsec;
+        ThrottlePolicy           throttle;
+        Atomic<bool>             throttled;
+        pthread_mutex_t          throttleMutex;
+        pthread_cond_t           throttleCond;
+        Atomic<uint64_t>         numThrottled;
+        Atomic<uint64_t>         numRejected;
+        Atomic<uint64_t>         throttleUsec;
+        std::vector<WarmupSlice*> warmers;
+        pthread_mutex_t          warmupMutex;
+        Atomic<int>              warmersRunning;
+        Atomic<uint64_t>         warmedItems;
+        volatile bool            warming;
+        volatile uint64_t        warmStart;
+        volatile uint64_t        warmEnd;
         DISALLOW_COPY_AND_ASSIGN(EventuallyPersistentStore);
     };
 
+// Default seconds between expiry pager runs.
+#define EXPIRY_PAGER_INTERVAL 60
+// How long an idle flusher leaves values its partitions retired
+// before freeing them.
+#define RETIRED_RECLAIM_MS 100
+// Ejection frees values down to this percentage of the quota.
+#define EJECT_LOW_WATERMARK 90
+
+    /**
+     * A get waiting for its value to be fetched from the store.
+     */
+    struct FetchRequest {
+        std::string         key;
+        Callback<GetValue> *cb;
+        uint64_t            queued;
+    };
+
+    /**
+     * A thread draining the dirty lists of a range of partitions
+     * into a store.
+     *
+     * It also fetches ejected values back from the store for gets on
+     * its partitions, and ejects values when memory is short.
+     */
     class Flusher {
     public:
-        Flusher(EventuallyPersistentStore *st) {
-            store = st;
-            running = true;
+
+        /**
+         * @param st the store whose items are flushed
+         * @param kvs where they're written
+         * @param start the first partition flushed
+         * @param end one past the last partition flushed
+         * @param txn held for the duration of each transaction on kvs
+         * @param pol how to batch items into transactions
+         */
+        Flusher(EventuallyPersistentStore *st, KVStore *kvs,
+                int start, int end, pthread_mutex_t *txn,
+                const FlushPolicy &pol);
+
+        ~Flusher();
+
+        void start();
+
+        /**
+         * Stop the thread and wait for it to exit.
+         */
+        void stop();
+
+        bool isRunning() {
+            return running;
         }
-        ~Flusher() {
-            stop();
+
+        /**
+         * Signal the thread if it's waiting for work.
+         */
+        void wake();
+
+        /**
+         * Fetch an ejected value from the store and complete the get
+         * with it.
+         */
+        void fetch(std::string &key, Callback<GetValue> &cb);
+
+        bool hasFetches() {
+            return pendingFetches.get() > 0;
         }
-        void stop() {
-            running = false;
+
+        /**
+         * Purge the tombstones left behind during warmup (deletes
+         * persisted while warmup might still load what they deleted).
+         */
+        void sweepTombstones();
+
+        /**
+         * Write out everything dirty in this flusher's partitions.
+         *
+         * Other threads may call this (without waiting) to have it
+         * done now; only the flusher's own runs the expiry pager and
+         * lingers.
+         *
+         * @param shouldWait if nothing is dirty, wait to be woken (and
+         *        if too little is, linger as the policy allows)
+         */
+        void flush(bool shouldWait);
+
+        /**
+         * True if any of this flusher's partitions has dirty items.
+         */
+        bool hasDirty();
+
+        /**
+         * Dirty items waiting in this flusher's partitions.
+         */
+        size_t getBacklog();
+
+        KVStore *getUnderlying() {
+            return underlying;
         }
-        void run() {
-            try {
-                while(running) {
-                    store->flush(true);
-                }
-                std::cout << "Shutting down flusher." << std::endl;
-            } catch(std::runtime_error &e) {
-                std::cerr << "Exception in executor loop: "
-                          << e.what() << std::endl;
-                assert(false);
-            }
+
+        pthread_mutex_t *getTxnMutex() {
+            return txnMutex;
         }
+
+        void printStats(std::ostream &o);
+
+        /**
+         * What this flusher has recorded (may be read at any time).
+         */
+        const FlushHistograms &getHistograms() {
+            return histograms;
+        }
+
+        /**
+         * Forget what's been recorded (caller holds the txn mutex).
+         */
+        void resetHistograms() {
+            histograms.reset();
+        }
+
+        void run();
+
     private:
+
+        bool shouldLinger();
+
+        StoredValue *flushOne(int bucket_num, StoredValue *v,
+                              std::vector<StoredValue*> &deleted,
+                              size_t &bytes, Callback<bool> &cb);
+
+        void writeOne(LockHolder &lh, StoredValue *v,
+                      std::vector<StoredValue*> &deleted,
+                      size_t &bytes, Callback<bool> &cb);
+
+        size_t flushSorted(std::vector<StoredValue*> &deleted,
+                           Callback<bool> &cb);
+
+        bool batchFull(size_t items, size_t bytes) {
+            return (policy.maxItems > 0 && items >= policy.maxItems)
+                || (policy.maxBytes > 0 && bytes >= policy.maxBytes);
+        }
+
+        void commit(std::vector<StoredValue*> &deleted);
+
+        void serviceFetches();
+
+        void ejectValues();
+
+        void expireItems();
+
+        bool hasRetired();
+
+        void reclaimRetired();
+
         EventuallyPersistentStore *store;
-        volatile bool running;
+        KVStore                   *underlying;
+        int                        startBucket;
+        int                        endBucket;
+        pthread_mutex_t           *txnMutex;
+        bool                       ownTxnMutex;
+        FlushPolicy                policy;
+        // When we started waiting for a batch to fill up (or zero;
+        // only the flusher's thread touches it).
+        uint64_t                   lingerStart;
+        // Written out in the current transaction (for the throttle).
+        size_t                     uncommittedItems;
+        size_t                     uncommittedBytes;
+        // When each of those became dirty.
+        std::vector<uint32_t>      dirtiedAt;
+        // Only updated with the txn mutex held.
+        FlushHistograms            histograms;
+        std::queue<FetchRequest>   fetches;
+        Atomic<size_t>             pendingFetches;
+        // Where the next ejection starts (relative to startBucket;
+        // this and ejectStalled are only touched with the txn mutex
+        // held).
+        int                        ejectCursor;
+        // Nothing more can be ejected until another commit.
+        bool                       ejectStalled;
+        // When the expiry pager next runs (zero if it's off), and
+        // the interval that was worked out with (the flusher's
+        // thread's own).
+        uint64_t                   nextExpiry;
+        uint32_t                   expiryInterval;
+        volatile bool              needSweep;
+        pthread_mutex_t            mutex;
+        pthread_cond_t             cond;
+        Atomic<bool>               idle;
+        volatile bool              running;
+        pthread_t                  thread;
+        Atomic<uint64_t>           itemsFlushed;
+        Atomic<uint64_t>           commits;
+        Atomic<uint64_t>           busyUsec;
+        DISALLOW_COPY_AND_ASSIGN(Flusher);
     };
 
 }
@@ -0,0 +1,294 @@
+#ifndef EPOCH_HH
+#define EPOCH_HH 1
+
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+#include "base-test.hh"
+#include "atomic.hh"
+
+// Retired objects (or bytes of them) a Limbo holds before it tries
+// to free some.
+#define LIMBO_RECLAIM_THRESHOLD 64
+#define LIMBO_RECLAIM_BYTES (1024 * 1024)
+
+namespace kvtest {
+
+    /**
+     * A thread's announcement of the epoch it is reading in.
+     */
+    struct EpochRecord {
+        volatile unsigned long epoch;
+        volatile bool          active;
+        volatile bool          inuse;
+        int                    depth;
+        EpochRecord           *next;
+    };
+
+    /**
+     * Epoch based reclamation.
+     *
+     * Readers that look at shared structures without a lock do so
+     * inside an EpochGuard.  Writers unlink objects and retire them
+     * to a Limbo instead of freeing them, and the objects are only
+     * freed once every reader that might have seen them has left.
+     */
+    class EpochManager {
+    public:
+
+        EpochManager() : global(2), records(NULL) {
+            if (pthread_key_create(&key, releaseRecord) != 0) {
+                throw std::runtime_error("Error creating epoch key.");
+            }
+        }
+
+        /**
+         * Records of threads that exited are recycled, not freed, so
+         * this must outlive every reader.
+         */
+        ~EpochManager() {
+            pthread_key_delete(key);
+            EpochRecord *r = records.get();
+            while (r) {
+                EpochRecord *next = r->next;
+                delete r;
+                r = next;
+            }
+        }
+
+        /**
+         * Start reading shared structures.
+         */
+        void enter() {
+            EpochRecord *r = record();
+            if (r->depth++ == 0) {
+                r->epoch = global.get();
+                r->active = true;
+                memory_barrier();
+            }
+        }
+
+        /**
+         * Done reading shared structures.
+         */
+        void exit() {
+            EpochRecord *r = record();
+            assert(r->depth > 0);
+            if (--r->depth == 0) {
+                memory_barrier();
+                r->active = false;
+            }
+        }
+
+        /**
+         * The current epoch (stamped on retired objects).
+         */
+        unsigned long current() {
+            return global.get();
+        }
+
+        /**
+         * Move to the next epoch if every active reader has caught
+         * up with the current one.
+         *
+         * Objects retired two or more epochs before the returned one
+         * can no longer be seen by any reader.
+         *
+         * @return the current epoch
+         */
+        unsigned long tryAdvance() {
+            unsigned long e = global.get();
+            for (EpochRecord *r = records.get(); r; r = r->next) {
+                if (r->active && r->epoch != e) {
+                    return e;
+                }
+            }
+            global.cas(e, e + 1);
+            return global.get();
+        }
+
+    private:
+
+        EpochRecord *record() {
+            EpochRecord *r = static_cast<EpochRecord*>(pthread_getspecific(key));
+            if (!r) {
+                r = claimRecord();
+                pthread_setspecific(key, r);
+            }
+            return r;
+        }
+
+        EpochRecord *claimRecord() {
+            for (EpochRecord *r = records.get(); r; r = r->next) {
+                if (!r->inuse && __sync_bool_compare_and_swap(&r->inuse,
+                                                              false, true)) {
+                    return r;
+                }
+            }
+            EpochRecord *r = new EpochRecord();
+            r->epoch = 0;
+            r->active = false;
+            r->inuse = true;
+            r->depth = 0;
+            do {
+                r->next = records.get();
+            } while (!records.cas(r->next, r));
+            return r;
+        }
+
+        static void releaseRecord(void *arg) {
+            EpochRecord *r = static_cast<EpochRecord*>(arg);
+            r->active = false;
+            r->depth = 0;
+            memory_barrier();
+            r->inuse = false;
+        }
+
+        Atomic<unsigned long>  global;
+        Atomic<EpochRecord*>   records;
+        pthread_key_t          key;
+
+        DISALLOW_COPY_AND_ASSIGN(EpochManager);
+    };
+
+    /**
+     * Holds an epoch open for the duration of a scope.
+     */
+    class EpochGuard {
+    public:
+        EpochGuard(EpochManager *m) {
+            mgr = m;
+            mgr->enter();
+        }
+
+        ~EpochGuard() {
+            mgr->exit();
+        }
+
+    private:
+        EpochManager *mgr;
+
+        DISALLOW_COPY_AND_ASSIGN(EpochGuard);
+    };
+
+    /**
+     * Objects retired by a writer, waiting for readers to move on.
+     *
+     * A Limbo is not itself threadsafe; each one is guarded by
+     * whatever lock its writers already hold.
+     */
+    class Limbo {
+    public:
+
+        /**
+         * How to free a retired object (given the retire argument).
+         */
+        typedef void (*deleter_t)(void *p, void *arg);
+
+        Limbo(EpochManager *m) {
+            mgr = m;
+            limit = LIMBO_RECLAIM_THRESHOLD;
+            byteLimit = LIMBO_RECLAIM_BYTES;
+            count = bytes = 0;
+        }
+
+        /**
+         * Free everything (there must be no readers left).
+         */
+        ~Limbo() {
+            reclaim(~0UL);
+        }
+
+        /**
+         * Free the given object once no reader can be looking at it.
+         *
+         * @param size bytes it holds (counted towards reclaiming)
+         */
+        void retire(void *p, deleter_t fn, void *arg = NULL,
+                    size_t size = 0) {
+            Retired r;
+            r.p = p;
+            r.fn = fn;
+            r.arg = arg;
+            r.size = size;
+            r.epoch = mgr->current();
+            retired.push_back(r);
+            count = retired.size();
+            bytes += size;
+            if (retired.size() >= limit || bytes >= byteLimit) {
+                reclaim(mgr->tryAdvance() - 1);
+                // Don't rescan a long backlog on every retirement.
+                limit = std::max((size_t)LIMBO_RECLAIM_THRESHOLD,
+                                 retired.size() * 2);
+                byteLimit = std::max((size_t)LIMBO_RECLAIM_BYTES,
+                                     bytes * 2);
+            }
+        }
+
+        /**
+         * Free whatever no reader can be looking at any more (for a
+         * Limbo nothing's been retired to lately).
+         */
+        void reclaim() {
+            // Twice, so what was retired in the current epoch can go
+            // too if no reader is in the way.
+            mgr->tryAdvance();
+            reclaim(mgr->tryAdvance() - 1);
+            limit = std::max((size_t)LIMBO_RECLAIM_THRESHOLD,
+                             retired.size() * 2);
+            byteLimit = std::max((size_t)LIMBO_RECLAIM_BYTES, bytes * 2);
+        }
+
+        /**
+         * Objects waiting to be freed (may be read without the lock).
+         */
+        size_t getCount() {
+            return count;
+        }
+
+        /**
+         * Bytes they hold (may be read without the lock).
+         */
+        size_t getBytes() {
+            return bytes;
+        }
+
+    private:
+
+        struct Retired {
+            void          *p;
+            deleter_t      fn;
+            void          *arg;
+            size_t         size;
+            unsigned long  epoch;
+        };
+
+        // Free everything retired before the given epoch.
+        void reclaim(unsigned long before) {
+            size_t kept = 0;
+            for (size_t i = 0; i < retired.size(); i++) {
+                if (retired[i].epoch < before) {
+                    bytes -= retired[i].size;
+                    retired[i].fn(retired[i].p, retired[i].arg);
+                } else {
+                    retired[kept++] = retired[i];
+                }
+            }
+            retired.resize(kept);
+            count = kept;
+        }
+
+        EpochManager         *mgr;
+        std::vector<Retired>  retired;
+        size_t                limit;
+        size_t                byteLimit;
+        volatile size_t       count;
+        volatile size_t       bytes;
+
+        DISALLOW_COPY_AND_ASSIGN(Limbo);
+    };
+
+}
+
+#endif /* EPOCH_HH */
@@ -0,0 +1,53 @@
+#ifndef FUTEX_HH
+#define FUTEX_HH 1
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+namespace kvtest {
+
+    /**
+     * Sleep as long as *addr holds val, until woken by futex_wake (or
+     * for at most usec microseconds, if that's not zero).
+     *
+     * May return early for no reason, so callers check their
+     * condition again.  Without futexes this just naps briefly.
+     */
+    inline void futex_wait(volatile int *addr, int val, uint64_t usec = 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(usec / 1000000);
+        ts.tv_nsec = (long)(usec % 1000000) * 1000;
+#ifdef __linux__
+        syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val,
+                usec > 0 ? &ts : NULL, NULL, 0);
+#else
+        if (*addr == val) {
+            if (usec == 0 || usec > 100) {
+                ts.tv_sec = 0;
+                ts.tv_nsec = 100000;
+            }
+            nanosleep(&ts, NULL);
+        }
+#endif
+    }
+
+    /**
+     * Wake up to n threads sleeping in futex_wait on addr.
+     */
+    inline void futex_wake(volatile int *addr, int n) {
+#ifdef __linux__
+        syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+        (void)addr;
+        (void)n;
+#endif
+    }
+
+}
+
+#endif /* FUTEX_HH */
@@ -0,0 +1,232 @@
+#ifndef FUTURE_HH
+#define FUTURE_HH 1
+
+#include <assert.h>
+#include <limits.h>
+#include <vector>
+
+#include "base-test.hh"
+#include "atomic.hh"
+#include "futex.hh"
+
+namespace kvtest {
+
+    /**
+     * Counts completions of a set of futures, so a thread can sleep
+     * until any (or enough) of them are done.
+     *
+     * The count and a flag saying somebody is asleep share one word,
+     * so completing touches nothing after the swap that counts it.
+     * Wait for the group to count every completion (e.g. with
+     * waitFor()) before destroying it.
+     */
+    class FutureGroup {
+    public:
+
+        FutureGroup() : word(0) {}
+
+        /**
+         * How many of the group's futures have completed so far
+         * (modulo 2^31).
+         */
+        int getCompleted() const {
+            memory_barrier();
+            return count(word);
+        }
+
+        /**
+         * Wait until at least n of the group's futures have
+         * completed (counting from the group's creation).
+         *
+         * The count wraps around, so this only works while fewer
+         * than 2^30 completions are outstanding; n may wrap too.
+         */
+        void waitFor(unsigned int n) {
+            int c;
+            while (behind(c = getCompleted(), n)) {
+                waitPast(c);
+            }
+        }
+
+        /**
+         * Wait until the completion count is no longer seen.
+         *
+         * May return early for no reason.
+         */
+        void waitPast(int seen) {
+            int w = word;
+            if (count(w) != seen) {
+                return;
+            }
+            if ((w & SLEEPING) == 0
+                && !__sync_bool_compare_and_swap(&word, w, w | SLEEPING)) {
+                return;
+            }
+            futex_wait(&word, w | SLEEPING);
+        }
+
+        /**
+         * Count a completion, waking anybody waiting on the group.
+         */
+        void complete() {
+            int w;
+            do {
+                w = word;
+            } while (!__sync_bool_compare_and_swap(&word, w, next(w)));
+            // The group may be gone now; a stale wake is harmless.
+            if (w & SLEEPING) {
+                futex_wake(&word, INT_MAX);
+            }
+        }
+
+    private:
+
+        enum {
+            SLEEPING = 1
+        };
+
+        static int count(int w) {
+            return (int)((unsigned int)w >> 1);
+        }
+
+        // Whether count c is short of n (both modulo 2^31).
+        static bool behind(int c, unsigned int n) {
+            return (((unsigned int)c - n) & 0x40000000) != 0;
+        }
+
+        // One more completion, and nobody asleep.
+        static int next(int w) {
+            return (int)(((unsigned int)w + 2) & ~(unsigned int)SLEEPING);
+        }
+
+        volatile int word;
+
+        DISALLOW_COPY_AND_ASSIGN(FutureGroup);
+    };
+
+    /**
+     * A callback that captures a value and lets a thread wait for it.
+     *
+     * This does the job of a RememberingCallback without a mutex or
+     * condition variable: completion is a swap of one state word, and
+     * only a waiter that actually has to sleep costs a system call.
+     * Pass one wherever a Callback is wanted.  A future fires once;
+     * reset() it to use it for another operation.
+     *
+     * A future made in a FutureGroup also counts towards the group,
+     * so many in-flight operations can be waited on at once (see
+     * waitAny()).
+     */
+    template <typename T>
+    class Future : public Callback<T> {
+    public:
+
+        Future(FutureGroup *g = NULL) : state(PENDING), group(g) {}
+
+        /**
+         * Capture the value and wake the waiter (the promise side).
+         */
+        void callback(T &value) {
+            val = value;
+            FutureGroup *g = group;
+            // Publish the value before the state.
+            memory_barrier();
+            int was = __sync_lock_test_and_set(&state, READY);
+            // The waiter may already have seen READY and destroyed
+            // this future; a wake at a stale address is harmless.
+            if (was == WAITING) {
+                futex_wake(&state, INT_MAX);
+            }
+            if (g) {
+                g->complete();
+            }
+        }
+
+        /**
+         * True if the value has arrived.
+         */
+        bool ready() const {
+            memory_barrier();
+            return state == READY;
+        }
+
+        /**
+         * Wait for the value to arrive.
+         */
+        void wait() {
+            while (!ready()) {
+                // Say we're sleeping, unless it's just been set.
+                if (__sync_val_compare_and_swap(&state, PENDING, WAITING)
+                    != READY) {
+                    futex_wait(&state, WAITING);
+                }
+            }
+        }
+
+        /**
+         * Wait for the value and return it.
+         */
+        T &get() {
+            wait();
+            return val;
+        }
+
+        /**
+         * Make a fired future ready to take another value.
+         */
+        void reset() {
+            assert(ready());
+            state = PENDING;
+            memory_barrier();
+        }
+
+        /**
+         * The value, once ready.
+         */
+        T val;
+
+    private:
+
+        enum {
+            PENDING,
+            WAITING,
+            READY
+        };
+
+        volatile int  state;
+        FutureGroup  *group;
+
+        DISALLOW_COPY_AND_ASSIGN(Future);
+    };
+
+    /**
+     * Wait for every one of the given futures.
+     */
+    template <typename T>
+    void waitAll(std::vector<Future<T>*> &futures) {
+        for (size_t i = 0; i < futures.size(); i++) {
+            futures[i]->wait();
+        }
+    }
+
+    /**
+     * Wait for any of the given futures (all made in group g) to be
+     * ready, and return the index of one that is.
+     */
+    template <typename T>
+    size_t waitAny(FutureGroup &g, std::vector<Future<T>*> &futures) {
+        assert(!futures.empty());
+        for (;;) {
+            int seen = g.getCompleted();
+            for (size_t i = 0; i < futures.size(); i++) {
+                if (futures[i]->ready()) {
+                    return i;
+                }
+            }
+            g.waitPast(seen);
+        }
+    }
+
+}
+
+#endif /* FUTURE_HH */
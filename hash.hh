@@ -0,0 +1,83 @@
+#ifndef HASH_HH
+#define HASH_HH 1
+
+#include <stdint.h>
+#include <string.h>
+
+namespace kvtest {
+
+    /**
+     * Multiply two 64 bit words into 128 bits and fold the halves.
+     */
+    inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+        __extension__ typedef unsigned __int128 uint128;
+        uint128 r = (uint128)a * b;
+        return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+        uint64_t ha = a >> 32, la = (uint32_t)a;
+        uint64_t hb = b >> 32, lb = (uint32_t)b;
+        uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+        uint64_t t = rl + (rm0 << 32);
+        uint64_t c = t < rl;
+        uint64_t lo = t + (rm1 << 32);
+        c += lo < t;
+        uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+        return lo ^ hi;
+#endif
+    }
+
+    inline uint64_t hash_read8(const uint8_t *p) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+
+    inline uint64_t hash_read4(const uint8_t *p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+
+    /**
+     * A fast 64 bit hash of a byte string (after wyhash).
+     *
+     * Short keys take a couple of multiplies; longer ones are
+     * consumed 16 bytes at a time.  Every bit of the result is well
+     * mixed, so any of them can pick a bucket.
+     */
+    inline uint64_t hash_bytes(const char *data, size_t len) {
+        static const uint64_t p0 = 0xa0761d6478bd642fUL;
+        static const uint64_t p1 = 0xe7037ed1a0b428dbUL;
+        const uint8_t *p = reinterpret_cast<const uint8_t*>(data);
+        uint64_t seed = hash_mix(p0, p1);
+        uint64_t a, b;
+        if (len <= 16) {
+            if (len >= 4) {
+                size_t off = (len >> 3) << 2;
+                a = (hash_read4(p) << 32) | hash_read4(p + off);
+                b = (hash_read4(p + len - 4) << 32)
+                    | hash_read4(p + len - 4 - off);
+            } else if (len > 0) {
+                a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8)
+                    | p[len - 1];
+                b = 0;
+            } else {
+                a = b = 0;
+            }
+        } else {
+            size_t i = len;
+            while (i > 16) {
+                seed = hash_mix(hash_read8(p) ^ p1, hash_read8(p + 8) ^ seed);
+                p += 16;
+                i -= 16;
+            }
+            a = hash_read8(p + i - 16);
+            b = hash_read8(p + i - 8);
+        }
+        return hash_mix(p1 ^ (uint64_t)len, hash_mix(a ^ p1, b ^ seed) ^ p0);
+    }
+
+}
+
+#endif /* HASH_HH */
@@ -0,0 +1,142 @@
+#ifndef HISTOGRAM_HH
+#define HISTOGRAM_HH 1
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <iostream>
+
+// One bin for zero and one per power of two.
+#define HISTOGRAM_BINS 65
+
+namespace kvtest {
+
+    /**
+     * Microseconds since the epoch.
+     */
+    inline uint64_t now_usec() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+    }
+
+    /**
+     * A histogram with a bin per power of two.
+     *
+     * Adding a sample is a couple of increments, so it's cheap enough
+     * to record every item.  Updates take no lock: whoever records
+     * samples must serialize them, but anyone may read (and copy) a
+     * histogram meanwhile and see slightly stale counts.
+     */
+    class Histogram {
+    public:
+
+        Histogram() {
+            reset();
+        }
+
+        /**
+         * Record a sample.
+         */
+        void add(uint64_t v) {
+            ++bins[binFor(v)];
+            ++count;
+            total += v;
+            if (v > max) {
+                max = v;
+            }
+        }
+
+        /**
+         * Add in every sample of another histogram.
+         */
+        void merge(const Histogram &h) {
+            for (int i = 0; i < HISTOGRAM_BINS; i++) {
+                bins[i] += h.bins[i];
+            }
+            count += h.count;
+            total += h.total;
+            if (h.max > max) {
+                max = h.max;
+            }
+        }
+
+        void reset() {
+            for (int i = 0; i < HISTOGRAM_BINS; i++) {
+                bins[i] = 0;
+            }
+            count = total = max = 0;
+        }
+
+        uint64_t getCount() const {
+            return count;
+        }
+
+        uint64_t getMax() const {
+            return max;
+        }
+
+        uint64_t getMean() const {
+            return count > 0 ? total / count : 0;
+        }
+
+        /**
+         * Get the number of samples in a bin.
+         *
+         * Bin 0 holds zeros, and bin i > 0 holds [2^(i-1), 2^i).
+         */
+        uint64_t getBin(int i) const {
+            return bins[i];
+        }
+
+        /**
+         * An upper bound on the given percentile (0-100) of the
+         * samples: the top of the bin it falls in.
+         */
+        uint64_t percentile(double p) const {
+            uint64_t want = (uint64_t)((double)count * p / 100.0 + 0.5);
+            if (want == 0) {
+                want = 1;
+            }
+            uint64_t seen = 0;
+            for (int i = 0; i < HISTOGRAM_BINS; i++) {
+                seen += bins[i];
+                if (seen >= want) {
+                    uint64_t top = i == 0 ? 0 : (((uint64_t)1 << (i - 1)) << 1) - 1;
+                    return top < max ? top : max;
+                }
+            }
+            return max;
+        }
+
+        /**
+         * Print a one line summary (count, mean, percentiles, max)
+         * under the given name.
+         */
+        void print(std::ostream &o, const char *name) const {
+            o << name << "\t" << count << "\t" << getMean()
+              << "\t" << percentile(50) << "\t" << percentile(90)
+              << "\t" << percentile(99) << "\t" << max << std::endl;
+        }
+
+        /**
+         * Header for the lines print() writes.
+         */
+        static void printHeader(std::ostream &o) {
+            o << "# histogram\tcount\tmean\tp50\tp90\tp99\tmax" << std::endl;
+        }
+
+    private:
+
+        static int binFor(uint64_t v) {
+            return v == 0 ? 0 : 64 - __builtin_clzll(v);
+        }
+
+        volatile uint64_t bins[HISTOGRAM_BINS];
+        volatile uint64_t count;
+        volatile uint64_t total;
+        volatile uint64_t max;
+    };
+
+}
+
+#endif /* HISTOGRAM_HH */
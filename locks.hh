@@ -37,6 +37,18 @@ namespace kvtest {
             }
         }
 
+        /**
+         * Acquire the lock again after an unlock().
+         */
+        void lock() {
+            if (unlocked) {
+                if(pthread_mutex_lock(mutex) != 0) {
+                    throw std::runtime_error("Failed to acquire lock.");
+                }
+                unlocked = false;
+            }
+        }
+
     private:
         pthread_mutex_t *mutex;
         bool unlocked;
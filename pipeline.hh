@@ -0,0 +1,253 @@
+#ifndef PIPELINE_HH
+#define PIPELINE_HH 1
+
+#include <assert.h>
+#include <algorithm>
+#include <vector>
+
+#include "base-test.hh"
+#include "future.hh"
+
+namespace kvtest {
+
+    class Pipeline;
+
+    /**
+     * One in-flight pipelined operation: the callback handed to the
+     * store, holding the result until the operation's continuation is
+     * run.
+     */
+    class PipelineSlot : public Callback<bool>, public Callback<GetValue> {
+    public:
+
+        PipelineSlot(Pipeline *p)
+            : owner(p), boolThen(NULL), getThen(NULL), boolVal(false),
+              next(NULL) {}
+
+        void callback(bool &value);
+
+        void callback(GetValue &value);
+
+    private:
+        friend class Pipeline;
+
+        Pipeline            *owner;
+        Callback<bool>      *boolThen;
+        Callback<GetValue>  *getThen;
+        bool                 boolVal;
+        GetValue             getVal;
+        PipelineSlot        *next;
+
+        DISALLOW_COPY_AND_ASSIGN(PipelineSlot);
+    };
+
+    /**
+     * Lets one client thread keep many operations in flight against a
+     * store, without a thread (or a RememberingCallback) per
+     * operation.
+     *
+     * Each operation is given a continuation: a callback to run with
+     * its result, which may start further operations, so a client
+     * written as a set of small state machines (what a coroutine
+     * compiles to) reads naturally.  Up to depth operations are in
+     * flight at once; starting one more first runs continuations
+     * until there's room.
+     *
+     * Continuations normally run on the client's thread, from
+     * poll().  Given resumeOnExecutor, they run wherever the store
+     * completes the operation instead (e.g. on an AsyncExecutor's
+     * thread), which saves a hop but means they must be threadsafe
+     * and must not start operations on the pipeline.
+     *
+     * A pipeline is driven by one thread.
+     */
+    class Pipeline {
+    public:
+
+        Pipeline(KVStore *s, size_t d, bool resumeOnExecutor = false)
+            : store(s), depth(d), onExecutor(resumeOnExecutor),
+              done(NULL), freeSlots(NULL), inFlight(0), started(0) {
+            assert(depth > 0);
+        }
+
+        /**
+         * Wait for everything in flight, and clean up.
+         */
+        ~Pipeline() {
+            drain();
+            for (size_t i = 0; i < slots.size(); i++) {
+                delete slots[i];
+            }
+        }
+
+        /**
+         * Start a set, running then with whether it worked.
+         */
+        void set(std::string &key, std::string &val, Callback<bool> &then) {
+            PipelineSlot *s = acquire();
+            s->boolThen = &then;
+            store->set(key, val, static_cast<Callback<bool>&>(*s));
+        }
+
+        /**
+         * Start a get, running then with the value found.
+         */
+        void get(std::string &key, Callback<GetValue> &then) {
+            PipelineSlot *s = acquire();
+            s->getThen = &then;
+            store->get(key, static_cast<Callback<GetValue>&>(*s));
+        }
+
+        /**
+         * Start a delete, running then with whether it found the key.
+         */
+        void del(std::string &key, Callback<bool> &then) {
+            PipelineSlot *s = acquire();
+            s->boolThen = &then;
+            store->del(key, static_cast<Callback<bool>&>(*s));
+        }
+
+        /**
+         * Run the continuations of the operations that have completed
+         * (waiting for at least one, if asked to and any are in
+         * flight).
+         *
+         * @return the number of operations retired
+         */
+        size_t poll(bool wait = true) {
+            PipelineSlot *s;
+            for (;;) {
+                int seen = group.getCompleted();
+                s = __sync_lock_test_and_set(&done, NULL);
+                if (s || !wait || inFlight == 0) {
+                    break;
+                }
+                group.waitPast(seen);
+            }
+
+            // Completed last first; put them back in order.
+            PipelineSlot *ordered = NULL;
+            while (s) {
+                PipelineSlot *n = s->next;
+                s->next = ordered;
+                ordered = s;
+                s = n;
+            }
+
+            size_t n = 0;
+            while (ordered) {
+                s = ordered;
+                ordered = s->next;
+                Callback<bool> *boolThen = s->boolThen;
+                Callback<GetValue> *getThen = s->getThen;
+                bool boolVal = s->boolVal;
+                GetValue getVal;
+                if (getThen && !onExecutor) {
+                    std::swap(getVal, s->getVal);
+                }
+                release(s);
+                n++;
+                if (!onExecutor) {
+                    if (boolThen) {
+                        boolThen->callback(boolVal);
+                    } else {
+                        getThen->callback(getVal);
+                    }
+                }
+            }
+            return n;
+        }
+
+        /**
+         * Wait for every operation in flight (and whatever their
+         * continuations start) to complete.
+         */
+        void drain() {
+            while (inFlight > 0) {
+                poll(true);
+            }
+            // Let the last completions finish with the pipeline.
+            group.waitFor(started);
+        }
+
+        /**
+         * The number of operations started and not yet retired.
+         */
+        size_t getInFlight() const {
+            return inFlight;
+        }
+
+    private:
+        friend class PipelineSlot;
+
+        PipelineSlot *acquire() {
+            while (inFlight >= depth) {
+                poll(true);
+            }
+            PipelineSlot *s = freeSlots;
+            if (s) {
+                freeSlots = s->next;
+            } else {
+                s = new PipelineSlot(this);
+                slots.push_back(s);
+            }
+            s->next = NULL;
+            ++inFlight;
+            ++started;
+            return s;
+        }
+
+        void release(PipelineSlot *s) {
+            s->boolThen = NULL;
+            s->getThen = NULL;
+            s->next = freeSlots;
+            freeSlots = s;
+            --inFlight;
+        }
+
+        /**
+         * Called (on any thread) as each operation completes.
+         */
+        void completed(PipelineSlot *s) {
+            PipelineSlot *head;
+            do {
+                head = done;
+                s->next = head;
+            } while (!__sync_bool_compare_and_swap(&done, head, s));
+            group.complete();
+        }
+
+        KVStore                    *store;
+        size_t                      depth;
+        bool                        onExecutor;
+        FutureGroup                 group;
+        PipelineSlot * volatile     done;
+        PipelineSlot               *freeSlots;
+        size_t                      inFlight;
+        unsigned int                started;
+        std::vector<PipelineSlot*>  slots;
+
+        DISALLOW_COPY_AND_ASSIGN(Pipeline);
+    };
+
+    inline void PipelineSlot::callback(bool &value) {
+        if (owner->onExecutor) {
+            boolThen->callback(value);
+        } else {
+            boolVal = value;
+        }
+        owner->completed(this);
+    }
+
+    inline void PipelineSlot::callback(GetValue &value) {
+        if (owner->onExecutor) {
+            getThen->callback(value);
+        } else {
+            getVal = value;
+        }
+        owner->completed(this);
+    }
+
+}
+
+#endif /* PIPELINE_HH */
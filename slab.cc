@@ -0,0 +1,257 @@
+#include <string.h>
+#include <assert.h>
+
+#include "slab.hh"
+#include "locks.hh"
+
+namespace kvtest {
+
+    /**
+     * A free chunk.
+     */
+    struct FreeChunk {
+        FreeChunk *next;
+    };
+
+    /**
+     * The shared state of one size class.
+     */
+    struct SlabClass {
+        size_t            chunkSize;
+        // Chunks a thread's cache holds at most.
+        int               cacheMax;
+        pthread_mutex_t   mutex;
+        FreeChunk        *freelist;
+        char             *cur;
+        size_t            left;
+        std::vector<char*> pages;
+        Atomic<size_t>    inuse;
+        Atomic<size_t>    requested;
+    };
+
+    /**
+     * A thread's private stash of free chunks.
+     */
+    struct SlabCache {
+        SlabAllocator           *owner;
+        std::vector<FreeChunk*>  chunks;
+        std::vector<int>         counts;
+    };
+
+    SlabAllocator::SlabAllocator(double factor) {
+        assert(factor > 1.0);
+        size_t size = SLAB_MIN_CHUNK;
+        while (size <= SLAB_PAGE_SIZE) {
+            SlabClass *c = new SlabClass;
+            c->chunkSize = size;
+            pthread_mutex_init(&c->mutex, NULL);
+            c->freelist = NULL;
+            c->cur = NULL;
+            c->left = 0;
+            classes.push_back(c);
+
+            size_t next = (size_t)((double)size * factor);
+            // Keep chunks pointer aligned.
+            next = (next + 7) & ~(size_t)7;
+            size = next > size ? next : size + 8;
+        }
+        // The last class always fills a whole page.
+        classes.back()->chunkSize = SLAB_PAGE_SIZE;
+        for (size_t i = 0; i < classes.size(); i++) {
+            size_t n = SLAB_CACHE_BYTES / classes[i]->chunkSize;
+            n = n < 1 ? 1 : n;
+            classes[i]->cacheMax = (int)(n < SLAB_CACHE_SIZE
+                                         ? n : SLAB_CACHE_SIZE);
+        }
+
+        pthread_mutex_init(&mutex, NULL);
+        if (pthread_key_create(&key, releaseCache) != 0) {
+            throw std::runtime_error("Error creating slab cache key.");
+        }
+    }
+
+    SlabAllocator::~SlabAllocator() {
+        pthread_key_delete(key);
+        for (size_t i = 0; i < caches.size(); i++) {
+            delete caches[i];
+        }
+        for (size_t i = 0; i < classes.size(); i++) {
+            SlabClass *c = classes[i];
+            for (size_t j = 0; j < c->pages.size(); j++) {
+                free(c->pages[j]);
+            }
+            pthread_mutex_destroy(&c->mutex);
+            delete c;
+        }
+        pthread_mutex_destroy(&mutex);
+    }
+
+    int SlabAllocator::classFor(size_t n) {
+        // Binary search for the smallest class that fits.
+        int lo = 0, hi = (int)classes.size() - 1;
+        if (n > classes[hi]->chunkSize) {
+            return -1;
+        }
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (classes[mid]->chunkSize < n) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    SlabCache *SlabAllocator::cache() {
+        SlabCache *c = static_cast<SlabCache*>(pthread_getspecific(key));
+        if (!c) {
+            c = new SlabCache;
+            c->owner = this;
+            c->chunks.resize(classes.size() * SLAB_CACHE_SIZE);
+            c->counts.resize(classes.size());
+            LockHolder lh(&mutex);
+            caches.push_back(c);
+            lh.unlock();
+            pthread_setspecific(key, c);
+        }
+        return c;
+    }
+
+    void SlabAllocator::refill(SlabCache *c, int cls) {
+        SlabClass *sc = classes[cls];
+        FreeChunk **stash = &c->chunks[cls * SLAB_CACHE_SIZE];
+        int &n = c->counts[cls];
+        LockHolder lh(&sc->mutex);
+        int want = (sc->cacheMax + 1) / 2;
+        while (n < want) {
+            if (sc->freelist) {
+                stash[n++] = sc->freelist;
+                sc->freelist = sc->freelist->next;
+                continue;
+            }
+            if (sc->left < sc->chunkSize) {
+                char *page = (char*)malloc(SLAB_PAGE_SIZE);
+                if (!page) {
+                    break;
+                }
+                sc->pages.push_back(page);
+                sc->cur = page;
+                sc->left = SLAB_PAGE_SIZE;
+            }
+            stash[n++] = reinterpret_cast<FreeChunk*>(sc->cur);
+            sc->cur += sc->chunkSize;
+            sc->left -= sc->chunkSize;
+        }
+    }
+
+    void SlabAllocator::drain(SlabCache *c, int cls, int keep) {
+        SlabClass *sc = classes[cls];
+        FreeChunk **stash = &c->chunks[cls * SLAB_CACHE_SIZE];
+        int &n = c->counts[cls];
+        LockHolder lh(&sc->mutex);
+        while (n > keep) {
+            FreeChunk *f = stash[--n];
+            f->next = sc->freelist;
+            sc->freelist = f;
+        }
+    }
+
+    void *SlabAllocator::allocate(size_t n) {
+        int cls = classFor(n);
+        if (cls < 0) {
+            void *rv = malloc(n);
+            if (!rv) {
+                throw std::bad_alloc();
+            }
+            largeBytes.incr(n);
+            return rv;
+        }
+
+        SlabCache *c = cache();
+        if (c->counts[cls] == 0) {
+            refill(c, cls);
+            if (c->counts[cls] == 0) {
+                throw std::bad_alloc();
+            }
+        }
+        SlabClass *sc = classes[cls];
+        sc->inuse.incr();
+        sc->requested.incr(n);
+        return c->chunks[cls * SLAB_CACHE_SIZE + --c->counts[cls]];
+    }
+
+    void SlabAllocator::release(void *p, size_t n) {
+        if (!p) {
+            return;
+        }
+        int cls = classFor(n);
+        if (cls < 0) {
+            largeBytes.decr(n);
+            free(p);
+            return;
+        }
+
+        SlabCache *c = cache();
+        SlabClass *sc = classes[cls];
+        if (c->counts[cls] == sc->cacheMax) {
+            drain(c, cls, sc->cacheMax / 2);
+        }
+        sc->inuse.decr();
+        sc->requested.decr(n);
+        c->chunks[cls * SLAB_CACHE_SIZE + c->counts[cls]++] =
+            static_cast<FreeChunk*>(p);
+    }
+
+    void SlabAllocator::releaseCache(void *arg) {
+        SlabCache *c = static_cast<SlabCache*>(arg);
+        SlabAllocator *a = c->owner;
+        for (int i = 0; i < (int)a->classes.size(); i++) {
+            if (c->counts[i] > 0) {
+                a->drain(c, i, 0);
+            }
+        }
+        LockHolder lh(&a->mutex);
+        for (size_t i = 0; i < a->caches.size(); i++) {
+            if (a->caches[i] == c) {
+                a->caches.erase(a->caches.begin() + (long)i);
+                break;
+            }
+        }
+        lh.unlock();
+        delete c;
+    }
+
+    void SlabAllocator::getStats(std::vector<SlabClassStats> &out) {
+        out.resize(classes.size());
+        for (size_t i = 0; i < classes.size(); i++) {
+            SlabClass *sc = classes[i];
+            LockHolder lh(&sc->mutex);
+            out[i].chunkSize = sc->chunkSize;
+            out[i].pages = sc->pages.size();
+            out[i].chunksInUse = sc->inuse.get();
+            out[i].bytesRequested = sc->requested.get();
+        }
+    }
+
+    void SlabAllocator::printStats(std::ostream &o) {
+        std::vector<SlabClassStats> st;
+        getStats(st);
+        size_t used = 0, wasted = 0;
+        o << "# slab\tchunk\tpages\tchunks\tinuse\twasted" << std::endl;
+        for (size_t i = 0; i < st.size(); i++) {
+            if (st[i].pages == 0) {
+                continue;
+            }
+            o << i << "\t" << st[i].chunkSize << "\t" << st[i].pages
+              << "\t" << st[i].chunksInUse << "\t" << st[i].bytesInUse()
+              << "\t" << st[i].bytesWasted() << std::endl;
+            used += st[i].bytesInUse();
+            wasted += st[i].bytesWasted();
+        }
+        o << "# slab bytes in use: " << used
+          << ", wasted: " << wasted
+          << ", large: " << getLargeBytes() << std::endl;
+    }
+
+}
@@ -0,0 +1,120 @@
+#ifndef SLAB_HH
+#define SLAB_HH 1
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+
+#include "base-test.hh"
+#include "atomic.hh"
+
+// Bytes carved into chunks at a time.
+#define SLAB_PAGE_SIZE (1024 * 1024)
+// Smallest chunk handed out.
+#define SLAB_MIN_CHUNK 32
+// Most chunks of each class a thread keeps to itself.
+#define SLAB_CACHE_SIZE 32
+// Most bytes of each class a thread keeps to itself (though always
+// at least one chunk).
+#define SLAB_CACHE_BYTES (256 * 1024)
+
+namespace kvtest {
+
+    /**
+     * Memory statistics for one size class.
+     */
+    struct SlabClassStats {
+        /** Size of every chunk in this class. */
+        size_t chunkSize;
+        /** Number of pages carved up for this class. */
+        size_t pages;
+        /** Number of chunks handed out and not yet released. */
+        size_t chunksInUse;
+        /** Bytes actually asked for by the chunks in use. */
+        size_t bytesRequested;
+
+        /** Bytes of chunks in use. */
+        size_t bytesInUse() const {
+            return chunksInUse * chunkSize;
+        }
+
+        /** Bytes lost to rounding requests up to the chunk size. */
+        size_t bytesWasted() const {
+            return bytesInUse() - bytesRequested;
+        }
+    };
+
+    struct SlabClass;
+    struct SlabCache;
+
+    /**
+     * A size class slab allocator.
+     *
+     * Requests are rounded up to one of a series of chunk sizes
+     * (each factor times bigger than the last), and each size is
+     * carved out of its own pages.  Memory is never handed back to
+     * the system, but freed chunks are reused by later requests of
+     * similar size, so a long running workload doesn't fragment the
+     * heap.  Requests bigger than a page go straight to malloc.
+     *
+     * Each thread keeps a few free chunks of every class to itself
+     * (up to SLAB_CACHE_BYTES' worth) so most allocations take no
+     * lock.  Releases must say how big
+     * the original request was.
+     */
+    class SlabAllocator {
+    public:
+
+        SlabAllocator(double factor = 1.25);
+
+        ~SlabAllocator();
+
+        /**
+         * Allocate at least n bytes.
+         */
+        void *allocate(size_t n);
+
+        /**
+         * Release memory from allocate(n).
+         */
+        void release(void *p, size_t n);
+
+        /**
+         * Get statistics for each size class.
+         */
+        void getStats(std::vector<SlabClassStats> &out);
+
+        /**
+         * Bytes currently allocated beyond the largest class.
+         */
+        size_t getLargeBytes() {
+            return largeBytes.get();
+        }
+
+        /**
+         * Write the memory statistics as a table.
+         */
+        void printStats(std::ostream &o);
+
+    private:
+
+        int classFor(size_t n);
+        SlabCache *cache();
+        void refill(SlabCache *c, int cls);
+        void drain(SlabCache *c, int cls, int keep);
+
+        static void releaseCache(void *arg);
+
+        std::vector<SlabClass*>  classes;
+        std::vector<SlabCache*>  caches;
+        pthread_mutex_t          mutex;
+        pthread_key_t            key;
+        Atomic<size_t>           largeBytes;
+
+        DISALLOW_COPY_AND_ASSIGN(SlabAllocator);
+    };
+
+}
+
+#endif /* SLAB_HH */
@@ -1,4 +1,10 @@
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <vector>
 
 #include "sqlite-base.hh"
 
@@ -58,37 +64,73 @@ namespace kvtest {
         return rv;
     }
 
+    void PreparedStatement::bind64(int pos, sqlite3_int64 v) {
+        sqlite3_bind_int64(st, pos, v);
+    }
+
+    void PreparedStatement::bindNull(int pos) {
+        sqlite3_bind_null(st, pos);
+    }
+
     const char *PreparedStatement::column(int x) {
         return (char*)sqlite3_column_text(st, x);
     }
 
+    sqlite3_int64 PreparedStatement::column64(int x) {
+        return sqlite3_column_int64(st, x);
+    }
+
     void PreparedStatement::reset() {
         if(sqlite3_reset(st) != SQLITE_OK) {
             throw std::runtime_error("Error resetting statement.");
         }
     }
 
-    BaseSqlite3::BaseSqlite3(const char *fn) {
+    BaseSqlite3::BaseSqlite3(const char *fn, bool defer_sync) {
         filename = fn;
         db = NULL;
+        deferSync = defer_sync;
+        walFd = -1;
+        walLive = false;
+        if(pthread_mutex_init(&syncMutex, NULL) != 0) {
+            throw std::runtime_error("Failed to initialize mutex.");
+        }
         open();
     }
 
     BaseSqlite3::~BaseSqlite3() {
         close();
+        pthread_mutex_destroy(&syncMutex);
+    }
+
+    sqlite3 *BaseSqlite3::openConnection() {
+        sqlite3 *rv = NULL;
+        if(sqlite3_open(filename, &rv) !=  SQLITE_OK) {
+            sqlite3_close(rv);
+            throw std::runtime_error("Error initializing sqlite3");
+        }
+
+        if(sqlite3_extended_result_codes(rv, 1) != SQLITE_OK) {
+            sqlite3_close(rv);
+            throw std::runtime_error("Error enabling extended RCs");
+        }
+
+        // Other connections (e.g. scans) may briefly hold locks.
+        sqlite3_busy_timeout(rv, BUSY_TIMEOUT);
+        return rv;
     }
 
     void BaseSqlite3::open() {
         if(!db) {
-            if(sqlite3_open(filename, &db) !=  SQLITE_OK) {
-                throw std::runtime_error("Error initializing sqlite3");
-            }
-
-            if(sqlite3_extended_result_codes(db, 1) != SQLITE_OK) {
-                throw std::runtime_error("Error enabling extended RCs");
-            }
+            db = openConnection();
 
             intransaction = false;
+            if (deferSync) {
+                execute("pragma journal_mode=wal");
+                execute("pragma synchronous=normal");
+                LockHolder lh(&syncMutex);
+                walLive = true;
+            }
             initTables();
             initStatements();
         }
@@ -98,6 +140,15 @@ namespace kvtest {
         if(db) {
             intransaction = false;
             destroyStatements();
+            if (deferSync) {
+                // Closing removes the log, so let go of it first.
+                LockHolder lh(&syncMutex);
+                walLive = false;
+                if (walFd >= 0) {
+                    ::close(walFd);
+                    walFd = -1;
+                }
+            }
             sqlite3_close(db);
             db = NULL;
         }
@@ -135,6 +186,37 @@ namespace kvtest {
         }
     }
 
+    void BaseSqlite3::sync() {
+        if (!deferSync) {
+            return;
+        }
+        LockHolder lh(&syncMutex);
+        if (walFd < 0 && walLive) {
+            // There's no log until something's been written.
+            std::string wal(filename);
+            wal += "-wal";
+            walFd = ::open(wal.c_str(), O_RDONLY);
+        }
+        if (walFd >= 0 && fsync(walFd) != 0) {
+            throw std::runtime_error("Error syncing write-ahead log.");
+        }
+    }
+
+    static int db_status(sqlite3 *db, int op) {
+        int cur = 0, hi = 0;
+        if (sqlite3_db_status(db, op, &cur, &hi, 0) != SQLITE_OK) {
+            return 0;
+        }
+        return cur;
+    }
+
+    void BaseSqlite3::printStats(std::ostream &o) {
+        o << "# pages written: " << db_status(db, SQLITE_DBSTATUS_CACHE_WRITE)
+          << ", page cache hits: " << db_status(db, SQLITE_DBSTATUS_CACHE_HIT)
+          << ", misses: " << db_status(db, SQLITE_DBSTATUS_CACHE_MISS)
+          << std::endl;
+    }
+
     void BaseSqlite3::execute(const char *query) {
         PreparedStatement st(db, query);
         st.execute();
@@ -143,18 +225,64 @@ namespace kvtest {
 
     // Sqlite3 naive class.
 
+    /**
+     * SQL function kv_mutate(value, op, arg, n): the value after
+     * Mutation(op, arg, n), or NULL if it doesn't apply.
+     */
+    static void sqlite_mutate(sqlite3_context *ctx, int argc,
+                              sqlite3_value **argv) {
+        const char *old = (const char*)sqlite3_value_text(argv[0]);
+        if (!old) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        size_t len = (size_t)sqlite3_value_bytes(argv[0]);
+        const char *arg = (const char*)sqlite3_value_text(argv[2]);
+        kvtest::Mutation m((kvtest::mutation_op_t)sqlite3_value_int(argv[1]),
+                           arg ? arg : "",
+                           (uint64_t)sqlite3_value_int64(argv[3]));
+        std::string out;
+        uint64_t number;
+        if (m.apply(old, len, out, number) != kvtest::MUTATION_DONE) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        sqlite3_result_text(ctx, out.data(), (int)out.length(),
+                            SQLITE_TRANSIENT);
+    }
+
 
     void Sqlite3::initStatements() {
         ins_stmt = new PreparedStatement(db, "insert into kv(k,v) values(?, ?)");
         sel_stmt = new PreparedStatement(db, "select v from kv where k = ?");
         del_stmt = new PreparedStatement(db, "delete from kv where k = ?");
+
+        std::string q("select k, v from kv where k in (?");
+        for (int i = 1; i < MULTI_GET_BATCH; i++) {
+            q += ", ?";
+        }
+        q += ")";
+        mget_stmt = new PreparedStatement(db, q.c_str());
+
+        if (sqlite3_create_function(db, "kv_mutate", 4,
+                                    SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                    sqlite_mutate, NULL, NULL) != SQLITE_OK) {
+            throw std::runtime_error(sqlite3_errmsg(db));
+        }
+        mut_stmt = new PreparedStatement(db,
+                                         "update kv set v = kv_mutate(v, ?1, ?2, ?3)"
+                                         " where k = ?4"
+                                         " and kv_mutate(v, ?1, ?2, ?3) is not null"
+                                         " returning v");
     }
 
     void Sqlite3::destroyStatements() {
         delete ins_stmt;
         delete sel_stmt;
         delete del_stmt;
-        ins_stmt = sel_stmt = del_stmt = NULL;
+        delete mget_stmt;
+        delete mut_stmt;
+        ins_stmt = sel_stmt = del_stmt = mget_stmt = mut_stmt = NULL;
     }
 
     void Sqlite3::initTables() {
@@ -172,6 +300,11 @@ namespace kvtest {
                     "  insert into history (op,key,value)"
                     "         values ('s', new.k, new.v);"
                     " end");
+            execute("create trigger if not exists on_audit_update"
+                    " before update on kv for each row begin"
+                    "  insert into history (op,key,value)"
+                    "         values ('s', new.k, new.v);"
+                    " end");
             execute("create trigger if not exists on_audit_delete"
                     " before delete on kv for each row begin"
                     "  insert into history (op,key)"
@@ -184,6 +317,7 @@ namespace kvtest {
         execute("drop table if exists kv");
         execute("drop table if exists history");
         execute("drop trigger if exists on_audit_insert");
+        execute("drop trigger if exists on_audit_update");
         execute("drop trigger if exists on_audit_delete");
     }
 
@@ -223,4 +357,183 @@ namespace kvtest {
         del_stmt->reset();
     }
 
+    void Sqlite3::mutate(std::string &key, kvtest::Mutation &m,
+                         kvtest::Callback<kvtest::MutationResult> &cb) {
+        kvtest::MutationResult rv;
+        mut_stmt->bind64(1, (sqlite3_int64)m.op);
+        mut_stmt->bind(2, m.value.c_str());
+        mut_stmt->bind64(3, (sqlite3_int64)m.n);
+        mut_stmt->bind(4, key.c_str());
+        if (mut_stmt->fetch()) {
+            const char *v = mut_stmt->column(0);
+            rv.status = kvtest::MUTATION_DONE;
+            rv.cas = kvtest::value_cas(v, strlen(v));
+            if (m.op == kvtest::MUTATE_INCR || m.op == kvtest::MUTATE_DECR) {
+                rv.number = strtoul(v, NULL, 10);
+            }
+        }
+        mut_stmt->reset();
+
+        if (rv.status != kvtest::MUTATION_DONE) {
+            // Nothing changed: find out why.
+            sel_stmt->bind(1, key.c_str());
+            if (sel_stmt->fetch()) {
+                const char *v = sel_stmt->column(0);
+                std::string out;
+                rv.status = m.apply(v, strlen(v), out, rv.number);
+                rv.number = 0;
+                if (rv.status == kvtest::MUTATION_DONE) {
+                    rv.status = kvtest::MUTATION_FAILED;
+                }
+            }
+            sel_stmt->reset();
+        }
+        cb.callback(rv);
+    }
+
+    void Sqlite3::setMulti(std::vector<kvtest::KeyValue> &items,
+                           kvtest::Callback<std::vector<bool> > &cb) {
+        std::vector<bool> rv(items.size());
+        bool own = !inTransaction();
+        if (own) {
+            begin();
+        }
+        try {
+            for (size_t i = 0; i < items.size(); i++) {
+                ins_stmt->bind(1, items[i].key.c_str());
+                ins_stmt->bind(2, items[i].value.c_str());
+                rv[i] = ins_stmt->execute() == 1;
+                ins_stmt->reset();
+            }
+        } catch(...) {
+            if (own) {
+                rollback();
+            }
+            throw;
+        }
+        if (own) {
+            commit();
+        }
+        cb.callback(rv);
+    }
+
+    void Sqlite3::getMulti(std::vector<std::string> &keys,
+                           kvtest::Callback<std::vector<kvtest::GetValue> > &cb) {
+        std::vector<kvtest::GetValue> rv(keys.size(),
+                                         kvtest::GetValue(":(", false));
+        std::map<std::string, std::string> found;
+        for (size_t start = 0; start < keys.size(); start += MULTI_GET_BATCH) {
+            size_t n = std::min((size_t)MULTI_GET_BATCH, keys.size() - start);
+            if (n == 1) {
+                // A lone key doesn't need the wide query.
+                sel_stmt->bind(1, keys[start].c_str());
+                if (sel_stmt->fetch()) {
+                    rv[start].value = sel_stmt->column(0);
+                    rv[start].success = true;
+                }
+                sel_stmt->reset();
+                continue;
+            }
+            // Unused slots match nothing.
+            for (size_t i = 0; i < MULTI_GET_BATCH; i++) {
+                if (i < n) {
+                    mget_stmt->bind((int)i + 1, keys[start + i].c_str());
+                } else {
+                    mget_stmt->bindNull((int)i + 1);
+                }
+            }
+            while (mget_stmt->fetch()) {
+                found[mget_stmt->column(0)] = mget_stmt->column(1);
+            }
+            mget_stmt->reset();
+            for (size_t i = start; i < start + n; i++) {
+                std::map<std::string, std::string>::iterator it;
+                it = found.find(keys[i]);
+                if (it != found.end()) {
+                    rv[i].value = it->second;
+                    rv[i].success = true;
+                }
+            }
+            found.clear();
+        }
+        cb.callback(rv);
+    }
+
+    void Sqlite3::delMulti(std::vector<std::string> &keys,
+                           kvtest::Callback<std::vector<bool> > &cb) {
+        std::vector<bool> rv(keys.size());
+        bool own = !inTransaction();
+        if (own) {
+            begin();
+        }
+        try {
+            for (size_t i = 0; i < keys.size(); i++) {
+                del_stmt->bind(1, keys[i].c_str());
+                rv[i] = del_stmt->execute() == 1;
+                del_stmt->reset();
+            }
+        } catch(...) {
+            if (own) {
+                rollback();
+            }
+            throw;
+        }
+        if (own) {
+            commit();
+        }
+        cb.callback(rv);
+    }
+
+    void Sqlite3::dump(kvtest::Callback<kvtest::KeyValue> &cb,
+                       size_t slice, size_t nslices) {
+        assert(slice < nslices);
+        sqlite3 *sdb = openConnection();
+        try {
+            // Slices are contiguous rowid ranges.
+            sqlite3_int64 lo = 0, hi = -1;
+            {
+                PreparedStatement range(sdb, "select min(rowid), max(rowid)"
+                                        " from kv");
+                if (range.fetch() && range.column(0)) {
+                    lo = range.column64(0);
+                    hi = range.column64(1);
+                }
+            }
+            sqlite3_int64 span = hi - lo + 1;
+            sqlite3_int64 from = lo + span * (sqlite3_int64)slice
+                / (sqlite3_int64)nslices;
+            sqlite3_int64 to = lo + span * (sqlite3_int64)(slice + 1)
+                / (sqlite3_int64)nslices;
+
+            PreparedStatement st(sdb, "select rowid, k, v from kv"
+                                 " where rowid >= ? and rowid < ?"
+                                 " order by rowid limit ?");
+            std::vector<kvtest::KeyValue> batch;
+            while (from < to) {
+                st.bind64(1, from);
+                st.bind64(2, to);
+                st.bind64(3, SCAN_BATCH_SIZE);
+                // Copy the batch out so the read lock is only held
+                // while reading it.
+                while (st.fetch()) {
+                    from = st.column64(0) + 1;
+                    batch.push_back(kvtest::KeyValue(st.column(1),
+                                                     st.column(2)));
+                }
+                st.reset();
+                if (batch.empty()) {
+                    break;
+                }
+                for (size_t i = 0; i < batch.size(); i++) {
+                    cb.callback(batch[i]);
+                }
+                batch.clear();
+            }
+        } catch(...) {
+            sqlite3_close(sdb);
+            throw;
+        }
+        sqlite3_close(sdb);
+    }
+
 }
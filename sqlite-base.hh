@@ -1,11 +1,21 @@
 #ifndef SQLITE_BASE_H
 #define SQLITE_BASE_H 1
 
+#include <pthread.h>
 #include <sqlite3.h>
 
 #include "base-test.hh"
 #include "suite.hh"
 
+// Most slices a Sqlite3 store may be scanned in at once.
+#define MAX_SCAN_SLICES 64
+// Rows read at a time by a scan.
+#define SCAN_BATCH_SIZE 1000
+// How long a connection waits for a lock before giving up (ms).
+#define BUSY_TIMEOUT 10000
+// Keys looked up per query by a batch get.
+#define MULTI_GET_BATCH 64
+
 namespace kvtest {
 
     /**
@@ -35,6 +45,21 @@ namespace kvtest {
          */
         void bind(int pos, const char *s);
 
+        /**
+         * Bind an integer parameter to a binding in this statement.
+         *
+         * @param pos the binding position (starting at 1)
+         * @param v the value to bind
+         */
+        void bind64(int pos, sqlite3_int64 v);
+
+        /**
+         * Bind NULL to a binding in this statement.
+         *
+         * @param pos the binding position (starting at 1)
+         */
+        void bindNull(int pos);
+
         /**
          * Execute a prepared statement that does not return results.
          *
@@ -67,6 +92,14 @@ namespace kvtest {
          */
         const char *column(int x);
 
+        /**
+         * Get the integer value at a given column in the current row.
+         *
+         * @param x the column number (starting at 0)
+         * @return the value
+         */
+        sqlite3_int64 column64(int x);
+
     private:
         sqlite3      *db;
         sqlite3_stmt *st;
@@ -80,8 +113,11 @@ namespace kvtest {
 
         /**
          * Construct an instance of sqlite with the given database name.
+         *
+         * With deferSync, commits go to a write-ahead log without
+         * waiting for the disk, and only sync() makes them durable.
          */
-        BaseSqlite3(const char *fn);
+        BaseSqlite3(const char *fn, bool deferSync=false);
 
         /**
          * Cleanup.
@@ -108,8 +144,27 @@ namespace kvtest {
          */
         void rollback();
 
+        /**
+         * Wait for the write-ahead log to reach the disk (when
+         * deferring syncs).
+         */
+        void sync();
+
+        /**
+         * Pages written to (and read from) the database file since it
+         * was opened.
+         */
+        void printStats(std::ostream &o);
+
     protected:
 
+        /**
+         * True between begin() and commit() or rollback().
+         */
+        bool inTransaction() {
+            return intransaction;
+        }
+
         /**
          * Shortcut to execute a simple query.
          *
@@ -117,6 +172,14 @@ namespace kvtest {
          */
         void execute(const char *query);
 
+        /**
+         * Open another connection to the same database (e.g. for a
+         * scan running in its own thread).
+         *
+         * Close it with sqlite3_close.
+         */
+        sqlite3 *openConnection();
+
         /**
          * After setting up the DB, this is called to initialize our
          * prepared statements.
@@ -150,6 +213,13 @@ namespace kvtest {
         const char *filename;
         bool intransaction;
 
+        // Deferring syncs, the log file to sync (opened on first
+        // sync), and whether the connection that writes it is open.
+        bool            deferSync;
+        int             walFd;
+        bool            walLive;
+        pthread_mutex_t syncMutex;
+
         void open();
         void close();
     };
@@ -157,9 +227,18 @@ namespace kvtest {
     class Sqlite3 : public BaseSqlite3 {
     public:
 
-        Sqlite3(const char *path, bool is_auditable=false) : BaseSqlite3(path) {
-            ins_stmt = sel_stmt = del_stmt = NULL;
+        Sqlite3(const char *path, bool is_auditable=false,
+                bool defer_sync=false) : BaseSqlite3(path, defer_sync) {
+            ins_stmt = sel_stmt = del_stmt = mget_stmt = mut_stmt = NULL;
             auditable = is_auditable;
+            // The base constructor can't reach our overrides.
+            initTables();
+            initStatements();
+        }
+
+        ~Sqlite3() {
+            // Nor can the base destructor.
+            destroyStatements();
         }
 
         /**
@@ -182,6 +261,49 @@ namespace kvtest {
          */
         void del(std::string &key, Callback<bool> &cb);
 
+        /**
+         * Overrides mutate() to change the value with a single
+         * update statement.
+         *
+         * CAS values are hashes of the values (see value_cas).
+         */
+        void mutate(std::string &key, Mutation &m,
+                    Callback<MutationResult> &cb);
+
+        /**
+         * Overrides setMulti() to write the batch in one transaction
+         * (unless already in one).
+         */
+        void setMulti(std::vector<KeyValue> &items,
+                      Callback<std::vector<bool> > &cb);
+
+        /**
+         * Overrides getMulti() to look up MULTI_GET_BATCH keys per
+         * query.
+         */
+        void getMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<GetValue> > &cb);
+
+        /**
+         * Overrides delMulti() to delete the batch in one transaction
+         * (unless already in one).
+         */
+        void delMulti(std::vector<std::string> &keys,
+                      Callback<std::vector<bool> > &cb);
+
+        /**
+         * Overrides dump().
+         *
+         * Each scan reads through its own connection, a batch of rows
+         * at a time, so it doesn't keep writers out for long.
+         */
+        void dump(Callback<KeyValue> &cb, size_t slice = 0,
+                  size_t nslices = 1);
+
+        size_t getMaxScanSlices() {
+            return MAX_SCAN_SLICES;
+        }
+
     protected:
 
         void initStatements();
@@ -197,6 +319,8 @@ namespace kvtest {
         PreparedStatement *ins_stmt;
         PreparedStatement *sel_stmt;
         PreparedStatement *del_stmt;
+        PreparedStatement *mget_stmt;
+        PreparedStatement *mut_stmt;
     };
 
 }
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 #include "base-test.hh"
 #include "suite.hh"
@@ -13,12 +15,57 @@
 
 using namespace kvtest;
 
+static size_t env_size(const char *name, size_t def) {
+    const char *v = getenv(name);
+    return v ? (size_t)atol(v) : def;
+}
+
 int main(int argc, char **args) {
     const char *env_path = getenv("SQLITE_TEST_DB");
-    Sqlite3 sq(env_path ? env_path : "/tmp/test.db",
-               getenv("KVSTORE_AUDITABLE"));
-    QueuedKVStore thing(&sq);
+    std::string path(env_path ? env_path : "/tmp/test.db");
+    bool auditable = getenv("KVSTORE_AUDITABLE") != NULL;
+    // Commit to a write-ahead log, syncing it separately.
+    bool deferSync = getenv("SQLITE_DEFER_SYNC") != NULL;
+
+    // With ASYNC_SHARDS, keys are spread over that many executors,
+    // each with its own database file.  (The stores hold on to the
+    // file names.)
+    size_t nshards = env_size("ASYNC_SHARDS", 1);
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    std::vector<std::string> paths(nshards);
+    std::vector<KVStore*> stores;
+    if (nshards == 1) {
+        stores.push_back(new Sqlite3(path.c_str(), auditable, deferSync));
+    } else {
+        for (size_t i = 0; i < nshards; i++) {
+            std::stringstream ss;
+            ss << path << "." << i;
+            paths[i] = ss.str();
+            stores.push_back(new Sqlite3(paths[i].c_str(), auditable,
+                                         deferSync));
+        }
+    }
+
+    AsyncBatchPolicy policy;
+    policy.maxItems = env_size("ASYNC_MAX_BATCH_ITEMS", policy.maxItems);
+    policy.maxBytes = env_size("ASYNC_MAX_BATCH_BYTES", policy.maxBytes);
+    policy.minItems = env_size("ASYNC_MIN_BATCH", policy.minItems);
+    policy.maxLingerUsec = env_size("ASYNC_MAX_LINGER_USEC",
+                                    (size_t)policy.maxLingerUsec);
+    policy.targetCommitUsec = env_size("ASYNC_TARGET_COMMIT_USEC",
+                                       (size_t)policy.targetCommitUsec);
+    policy.pipelineCommits = getenv("ASYNC_PIPELINE_COMMITS") != NULL;
+
+    QueuedKVStore *thing = new QueuedKVStore(stores, policy);
+
+    TestSuite suite(thing);
+    bool rv = suite.run();
 
-    TestSuite suite(&thing);
-    return suite.run() ? 0 : 1;
+    delete thing;
+    for (size_t i = 0; i < stores.size(); i++) {
+        delete stores[i];
+    }
+    return rv ? 0 : 1;
 }
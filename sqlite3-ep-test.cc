@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 #include "base-test.hh"
 #include "suite.hh"
@@ -13,12 +15,125 @@
 
 using namespace kvtest;
 
+static size_t env_size(const char *name, size_t def) {
+    const char *v = getenv(name);
+    return v ? (size_t)atol(v) : def;
+}
+
+/**
+ * Collect everything a store dumps.
+ */
+class CollectingCallback : public Callback<KeyValue> {
+public:
+    void callback(KeyValue &kv) {
+        items.push_back(kv);
+    }
+
+    std::vector<KeyValue> items;
+};
+
+/**
+ * Check that every item the stores held before warmup can be read back
+ * with its value (the suite resets the store before its first test, so
+ * this is the only look at what warmup loaded).
+ */
+static bool check_warmup(EventuallyPersistentStore *thing,
+                         std::vector<KeyValue> &items) {
+    thing->waitForWarmup();
+    size_t bad = 0;
+    for (size_t i = 0; i < items.size(); i++) {
+        RememberingCallback<GetValue> cb;
+        thing->get(items[i].key, cb);
+        cb.waitForValue();
+        if (!cb.val.success || cb.val.value != items[i].value) {
+            if (bad++ == 0) {
+                std::cerr << "Warmup lost " << items[i].key << std::endl;
+            }
+        }
+    }
+    std::cout << "Warmup\t" << (items.size() - bad) << "/" << items.size()
+              << " items\t" << (bad == 0 ? "PASS" : "FAIL") << std::endl;
+    return bad == 0;
+}
+
 int main(int argc, char **args) {
     const char *env_path = getenv("SQLITE_TEST_DB");
-    Sqlite3 sq(env_path ? env_path : "/tmp/test.db",
-               getenv("KVSTORE_AUDITABLE"));
-    EventuallyPersistentStore thing(&sq);
+    std::string path(env_path ? env_path : "/tmp/test.db");
+    bool auditable = getenv("KVSTORE_AUDITABLE") != NULL;
+    const char *layout_env = getenv("EP_HASH_LAYOUT");
+    hash_layout_t layout = layout_env && strcmp(layout_env, "open") == 0
+        ? OPEN_LAYOUT : CHAINED_LAYOUT;
+    size_t nflushers = env_size("EP_FLUSHERS", 1);
+    if (nflushers < 1) {
+        nflushers = 1;
+    }
+
+    FlushPolicy policy;
+    policy.minItems = env_size("EP_MIN_BATCH", policy.minItems);
+    policy.maxLingerMs = env_size("EP_MAX_LINGER_MS", policy.maxLingerMs);
+    policy.maxItems = env_size("EP_MAX_BATCH_ITEMS", policy.maxItems);
+    policy.maxBytes = env_size("EP_MAX_BATCH_BYTES", policy.maxBytes);
+    policy.sortKeys = getenv("EP_SORTED_FLUSH") != NULL;
+
+    // With EP_SHARD_STORES, each flusher gets its own database file.
+    // (The stores hold on to the file names.)
+    std::vector<std::string> paths(nflushers);
+    std::vector<KVStore*> stores;
+    if (getenv("EP_SHARD_STORES")) {
+        for (size_t i = 0; i < nflushers; i++) {
+            std::stringstream ss;
+            ss << path << "." << i;
+            paths[i] = ss.str();
+            stores.push_back(new Sqlite3(paths[i].c_str(), auditable));
+        }
+    } else {
+        stores.push_back(new Sqlite3(path.c_str(), auditable));
+    }
+
+    // Note what warmup should find before anything else uses the stores.
+    size_t warmers = env_size("EP_WARMUP", 0);
+    CollectingCallback before;
+    if (warmers > 0) {
+        for (size_t i = 0; i < stores.size(); i++) {
+            stores[i]->dump(before);
+        }
+    }
+
+    EventuallyPersistentStore *thing = stores.size() > 1
+        ? new EventuallyPersistentStore(stores, 32768, layout, policy)
+        : new EventuallyPersistentStore(stores[0], 32768, layout, nflushers,
+                                        policy);
+
+    thing->setMemoryQuota(env_size("EP_MEM_QUOTA", 0));
+    thing->setExpiryPagerInterval((uint32_t)env_size("EP_EXPIRY_PAGER_SECS",
+                                                     EXPIRY_PAGER_INTERVAL));
+
+    // Throttle sets once too much is waiting to be flushed (failing
+    // them instead of waiting with EP_THROTTLE_REJECT).
+    ThrottlePolicy throttle;
+    throttle.highItems = env_size("EP_THROTTLE_ITEMS", 0);
+    throttle.lowItems = env_size("EP_THROTTLE_LOW_ITEMS", 0);
+    throttle.highBytes = env_size("EP_THROTTLE_BYTES", 0);
+    throttle.lowBytes = env_size("EP_THROTTLE_LOW_BYTES", 0);
+    throttle.maxDelayMs = env_size("EP_THROTTLE_DELAY_MS", 0);
+    throttle.reject = getenv("EP_THROTTLE_REJECT") != NULL;
+    thing->setThrottle(throttle);
+
+    // Load whatever a previous run left behind (in the background
+    // with EP_WARMUP_ASYNC).
+    bool rv = true;
+    if (warmers > 0) {
+        thing->warmup(warmers, getenv("EP_WARMUP_ASYNC") == NULL);
+        rv = check_warmup(thing, before.items);
+        thing->printStats(std::cout);
+    }
+
+    TestSuite suite(thing);
+    rv = suite.run() && rv;
 
-    TestSuite suite(&thing);
-    return suite.run() ? 0 : 1;
+    delete thing;
+    for (size_t i = 0; i < stores.size(); i++) {
+        delete stores[i];
+    }
+    return rv ? 0 : 1;
 }
@@ -30,11 +30,29 @@ void TestSuite::initTests() {
     const char *req = getenv("KVTEST_SUITE");
     if (req == NULL || (strcmp(req, "full") == 0)) {
         addTest(new TestTest());
+        addTest(new FutureTest());
+        addTest(new OrderTest());
+        addTest(new MutationTest());
         addTest(new WriteTest());
     } else if (strcmp(req, "test") == 0) {
         addTest(new TestTest());
+        addTest(new FutureTest());
+        addTest(new OrderTest());
+        addTest(new MutationTest());
     } else if (strcmp(req, "endurance") == 0) {
         addTest(new EnduranceTest());
+    } else if (strcmp(req, "read") == 0) {
+        addTest(new ReadScalingTest());
+    } else if (strcmp(req, "queue") == 0) {
+        addTest(new QueueScalingTest());
+    } else if (strcmp(req, "batch") == 0) {
+        addTest(new BatchTest());
+    } else if (strcmp(req, "expiry") == 0) {
+        addTest(new ExpiryTest());
+    } else if (strcmp(req, "flush") == 0) {
+        addTest(new FlushTest());
+    } else if (strcmp(req, "pipeline") == 0) {
+        addTest(new PipelineTest());
     }
 }
 
@@ -49,6 +67,7 @@ bool TestSuite::run() {
             tut->reset();
             t->run(tut);
             std::cout << "PASS" << std::endl;
+            tut->printStats(std::cout);
             success = true;
         } catch(AssertionError &e) {
             std::cout << "FAIL: " << e.what() << std::endl;
@@ -1,13 +1,19 @@
 #include <stdio.h>
 #include <signal.h>
+#include <sched.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "base-test.hh"
 #include "tests.hh"
 #include "keys.hh"
 #include "values.hh"
+#include "histogram.hh"
+#include "future.hh"
+#include "pipeline.hh"
 
 using namespace kvtest;
 using namespace std;
@@ -73,6 +79,223 @@ bool TestTest::run(KVStore *tut) {
     return true;
 }
 
+bool FutureTest::run(KVStore *tut) {
+    const size_t n = 100;
+    vector<string> keys;
+    for (size_t i = 0; i < n; i++) {
+        stringstream ss;
+        ss << "future key " << i;
+        keys.push_back(ss.str());
+    }
+
+    // Start every set, then wait for them all.
+    FutureGroup setGroup;
+    vector<Future<bool>*> sets;
+    for (size_t i = 0; i < n; i++) {
+        sets.push_back(new Future<bool>(&setGroup));
+        tut->set(keys[i], keys[i], *sets[i]);
+    }
+    waitAll(sets);
+    setGroup.waitFor((int)n);
+    assertEquals((int)n, setGroup.getCompleted());
+    for (size_t i = 0; i < n; i++) {
+        assertTrue(sets[i]->val, "Failed to set value.");
+        delete sets[i];
+    }
+
+    // Start every get, then take them as they come in.
+    FutureGroup getGroup;
+    vector<Future<GetValue>*> gets;
+    vector<size_t> which;
+    for (size_t i = 0; i < n; i++) {
+        gets.push_back(new Future<GetValue>(&getGroup));
+        which.push_back(i);
+        tut->get(keys[i], *gets[i]);
+    }
+    while (!gets.empty()) {
+        size_t i = waitAny(getGroup, gets);
+        assertTrue(gets[i]->val.success, "Expected success getting value.");
+        assertEquals(gets[i]->val.value, keys[which[i]]);
+        delete gets[i];
+        gets[i] = gets.back();
+        gets.pop_back();
+        which[i] = which.back();
+        which.pop_back();
+    }
+    getGroup.waitFor((int)n);
+
+    // One future, reused for each delete.
+    Future<bool> delCb;
+    for (size_t i = 0; i < n; i++) {
+        tut->del(keys[i], delCb);
+        assertTrue(delCb.get(), "Failed to delete value.");
+        delCb.reset();
+    }
+
+    Future<vector<GetValue> > multiCb;
+    tut->getMulti(keys, multiCb);
+    vector<GetValue> &got = multiCb.get();
+    assertEquals((int)n, (int)got.size());
+    for (size_t i = 0; i < n; i++) {
+        assertFalse(got[i].success, "Expected failure getting deleted value.");
+    }
+
+    return true;
+}
+
+bool OrderTest::run(KVStore *tut) {
+    string a("order a"), b("order b");
+    string v1("one"), v2("two"), v3("three");
+
+    // Everything's started before anything's waited for, so a
+    // queueing store may well take it all as one batch.
+    Future<bool> set1, set2, set3, setB, del1, del2, setB2;
+    Future<GetValue> get1, get2, getB, getB2;
+    tut->set(b, v1, setB);
+    tut->set(a, v1, set1);
+    tut->set(a, v2, set2);
+    tut->get(a, get1);
+    tut->set(a, v3, set3);
+    tut->del(a, del1);
+    tut->get(b, getB);
+    tut->del(a, del2);
+    tut->get(a, get2);
+    tut->set(b, v2, setB2);
+    Future<bool> done;
+    tut->noop(done);
+    tut->get(b, getB2);
+
+    done.wait();
+    assertTrue(setB.ready() && set1.ready() && del2.ready(),
+               "Expected everything before a noop to be done.");
+    assertTrue(set1.get() && set2.get() && set3.get(), "Failed to set a.");
+    assertTrue(setB.get() && setB2.get(), "Failed to set b.");
+    assertTrue(get1.get().success, "Expected success getting a.");
+    assertEquals(v2, get1.get().value);
+    assertTrue(del1.get(), "Failed to delete a.");
+    assertFalse(del2.get(), "Doubly deleted a.");
+    assertFalse(get2.get().success, "Expected failure getting deleted a.");
+    assertTrue(getB.get().success, "Expected success getting b.");
+    assertEquals(v1, getB.get().value);
+    assertTrue(getB2.get().success, "Expected success getting b again.");
+    assertEquals(v2, getB2.get().value);
+
+    return true;
+}
+
+/**
+ * Run a mutation and wait for the outcome.
+ */
+static MutationResult run_mutation(KVStore *tut, std::string &key,
+                                   Mutation m) {
+    RememberingCallback<MutationResult> cb;
+    tut->mutate(key, m, cb);
+    cb.waitForValue();
+    return cb.val;
+}
+
+/**
+ * Counts successful mutations (threadsafe).
+ */
+class MutationCounter : public kvtest::Callback<MutationResult> {
+public:
+    MutationCounter() : done(0) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ~MutationCounter() {
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void callback(MutationResult &r) {
+        LockHolder lh(&mutex);
+        if (r.success()) {
+            done++;
+        }
+    }
+
+    int num_done() {
+        LockHolder lh(&mutex);
+        return done;
+    }
+
+private:
+    int             done;
+    pthread_mutex_t mutex;
+};
+
+bool MutationTest::run(KVStore *tut) {
+    string counter("counter");
+    string missing("no such key");
+    string text("text");
+
+    RememberingCallback<bool> setCb;
+    string ten("10");
+    tut->set(counter, ten, setCb);
+    setCb.waitForValue();
+
+    MutationResult r = run_mutation(tut, counter,
+                                    Mutation(MUTATE_INCR, "", 5));
+    assertTrue(r.success(), "Failed to increment.");
+    assertEquals(15, (int)r.number);
+    r = run_mutation(tut, counter, Mutation(MUTATE_DECR, "", 20));
+    assertTrue(r.success(), "Failed to decrement.");
+    assertEquals(0, (int)r.number);
+    r = run_mutation(tut, missing, Mutation(MUTATE_INCR, "", 1));
+    assertEquals(MUTATION_NOT_FOUND, r.status);
+
+    // Many increments in flight at once must all land.
+    const int n = 1000;
+    MutationCounter mc;
+    for (int i = 0; i < n; i++) {
+        tut->incr(counter, 1, mc);
+    }
+    RememberingCallback<bool> noopCb;
+    tut->noop(noopCb);
+    noopCb.waitForValue();
+    RememberingCallback<GetValue> getCb;
+    tut->get(counter, getCb);
+    getCb.waitForValue();
+    assertEquals(n, mc.num_done());
+    assertEquals(getCb.val.value, "1000");
+
+    RememberingCallback<bool> setCb2;
+    string b("b");
+    tut->set(text, b, setCb2);
+    setCb2.waitForValue();
+    r = run_mutation(tut, text, Mutation(MUTATE_INCR, "", 1));
+    assertEquals(MUTATION_NOT_NUMBER, r.status);
+    r = run_mutation(tut, text, Mutation(MUTATE_APPEND, "c", 0));
+    assertTrue(r.success(), "Failed to append.");
+    r = run_mutation(tut, text, Mutation(MUTATE_PREPEND, "a", 0));
+    assertTrue(r.success(), "Failed to prepend.");
+    r = run_mutation(tut, missing, Mutation(MUTATE_APPEND, "c", 0));
+    assertEquals(MUTATION_NOT_FOUND, r.status);
+
+    RememberingCallback<GetValue> getsCb;
+    tut->gets(text, getsCb);
+    getsCb.waitForValue();
+    assertTrue(getsCb.val.success, "Expected success getting value.");
+    assertEquals(getsCb.val.value, "abc");
+    assertTrue(getsCb.val.cas != 0, "Expected a CAS value.");
+
+    uint64_t cas = getsCb.val.cas;
+    r = run_mutation(tut, text, Mutation(MUTATE_CAS, "x", cas));
+    assertTrue(r.success(), "Failed to swap.");
+    assertTrue(r.cas != cas, "Expected a new CAS value.");
+    r = run_mutation(tut, text, Mutation(MUTATE_CAS, "y", cas));
+    assertEquals(MUTATION_EXISTS, r.status);
+    r = run_mutation(tut, missing, Mutation(MUTATE_CAS, "y", cas));
+    assertEquals(MUTATION_NOT_FOUND, r.status);
+
+    RememberingCallback<GetValue> getCb2;
+    tut->get(text, getCb2);
+    getCb2.waitForValue();
+    assertEquals(getCb2.val.value, "x");
+
+    return true;
+}
+
 /**
  * Callback that simply counts the number of times it was called
  * (threadsafe).
@@ -80,7 +303,7 @@ bool TestTest::run(KVStore *tut) {
 class CountingCallback : public kvtest::Callback<bool> {
 public:
     CountingCallback() {
-        x = 0;
+        x = failed = 0;
         if(pthread_mutex_init(&mutex, NULL) != 0) {
             throw std::runtime_error("Failed to create mutex.");
         }
@@ -91,11 +314,15 @@ public:
     }
 
     /**
-     * Increment the callback counter.
+     * Increment the callback counter (and the failure counter if the
+     * operation failed).
      */
     void callback(bool &val) {
         LockHolder lh(&mutex);
         x++;
+        if (!val) {
+            failed++;
+        }
     }
 
     /**
@@ -108,11 +335,74 @@ public:
         return x;
     }
 
+    /**
+     * Get the number of callbacks reporting a failure.
+     *
+     * @return the number of times callback() was given false.
+     */
+    int num_failed() {
+        LockHolder lh(&mutex);
+        return failed;
+    }
+
 private:
     int             x;
+    int             failed;
     pthread_mutex_t mutex;
 };
 
+bool ExpiryTest::run(KVStore *tut) {
+    const int n = 100;
+    const uint32_t ttl = 1;
+    std::vector<std::string> expiring, kept;
+    CountingCallback cb;
+
+    for (int i = 0; i < n; i++) {
+        std::stringstream eStream, kStream;
+        eStream << "expiringKey" << i;
+        kStream << "keptKey" << i;
+        expiring.push_back(eStream.str());
+        kept.push_back(kStream.str());
+        std::string value("testValue");
+        tut->setWithTTL(expiring.back(), value, ttl, cb);
+        // Setting again without a TTL makes it last.
+        if (i % 2 == 0) {
+            tut->setWithTTL(kept.back(), value, ttl, cb);
+        }
+        tut->set(kept.back(), value, cb);
+    }
+    RememberingCallback<bool> cbLoaded;
+    tut->noop(cbLoaded);
+    cbLoaded.waitForValue();
+    assertEquals(0, cb.num_failed());
+
+    RememberingCallback<std::vector<GetValue> > before;
+    tut->getMulti(expiring, before);
+    before.waitForValue();
+    for (int i = 0; i < n; i++) {
+        assertTrue(before.val[i].success, "Expired too soon.");
+    }
+
+    sleep(ttl + 2);
+
+    RememberingCallback<std::vector<GetValue> > after;
+    tut->getMulti(expiring, after);
+    after.waitForValue();
+    RememberingCallback<std::vector<GetValue> > still;
+    tut->getMulti(kept, still);
+    still.waitForValue();
+    for (int i = 0; i < n; i++) {
+        assertFalse(after.val[i].success, "Expected the item to expire.");
+        assertTrue(still.val[i].success, "Expected the item to be kept.");
+    }
+
+    RememberingCallback<bool> delCb;
+    tut->del(expiring[0], delCb);
+    delCb.waitForValue();
+    assertFalse(delCb.val, "Deleted an expired item.");
+    return true;
+}
+
 bool WriteTest::run(KVStore *tut) {
     int i = 0;
     setup_alarm(5);
@@ -159,7 +449,7 @@ bool EnduranceTest::run(KVStore *tut) {
     setup_alarm(alarm_freq);
 
     std::cout << "# start time:  " << start << std::endl;
-    std::cout << "# cmds\tbacklog\ttime\tabstime\trate" << std::endl;
+    std::cout << "# cmds\tbacklog\tfailed\ttime\tabstime\trate" << std::endl;
 
     for(i = 0 ; ; i++) {
         std::string key(k.nextKey());
@@ -172,6 +462,7 @@ bool EnduranceTest::run(KVStore *tut) {
             long new_calls = i - prev_calls;
             step = now;
             std::cout << i << "\t" << (i - cb.num_calls() + 1)
+                      << "\t" << cb.num_failed()
                       << "\t" << delta << "\t" << now << "\t"
                       << ((double)new_calls / (double)delta) << std::endl
                       << std::flush;
@@ -195,3 +486,449 @@ bool EnduranceTest::run(KVStore *tut) {
               << std::endl;
     return true;
 }
+
+/**
+ * State shared by the reader threads of a ReadScalingTest.
+ */
+struct ReaderState {
+    KVStore                  *tut;
+    std::vector<std::string> *keys;
+    volatile bool            *stop;
+    int                       offset;
+    long                      ops;
+    long                      misses;
+};
+
+static void *run_reader(void *arg) {
+    ReaderState *rs = static_cast<ReaderState*>(arg);
+    size_t n = rs->keys->size();
+    size_t i = (size_t)rs->offset;
+    while (!*rs->stop) {
+        RememberingCallback<GetValue> cb;
+        rs->tut->get((*rs->keys)[i % n], cb);
+        cb.waitForValue();
+        if (!cb.val.success) {
+            rs->misses++;
+        }
+        rs->ops++;
+        i += 7;
+    }
+    return NULL;
+}
+
+bool ReadScalingTest::run(KVStore *tut) {
+    const int duration = 3;
+    const int max_threads = 8;
+    Keys k(30000);
+    std::vector<std::string> keys;
+    CountingCallback cb;
+
+    for (size_t i = 0; i < k.length(); i++) {
+        std::string key(k.nextKey());
+        std::string value("testValue" + key);
+        tut->set(key, value, cb);
+        keys.push_back(key);
+    }
+    RememberingCallback<bool> cbLoaded;
+    tut->noop(cbLoaded);
+    cbLoaded.waitForValue();
+    assertEquals((int)keys.size(), cb.num_calls());
+
+    std::cout << std::endl << "# threads\tops/s\tops/s/thread" << std::endl;
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        volatile bool stop = false;
+        std::vector<pthread_t> threads(nthreads);
+        std::vector<ReaderState> states(nthreads);
+
+        for (int i = 0; i < nthreads; i++) {
+            ReaderState &rs = states[i];
+            rs.tut = tut;
+            rs.keys = &keys;
+            rs.stop = &stop;
+            rs.offset = i * 1009;
+            rs.ops = rs.misses = 0;
+            if (pthread_create(&threads[i], NULL, run_reader, &rs) != 0) {
+                throw std::runtime_error("Error starting reader thread.");
+            }
+        }
+        sleep(duration);
+        stop = true;
+
+        long ops = 0, misses = 0;
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            ops += states[i].ops;
+            misses += states[i].misses;
+        }
+        assertEquals(0, (int)misses);
+
+        std::cout << nthreads << "\t" << (ops / duration)
+                  << "\t" << (ops / duration / nthreads) << std::endl;
+    }
+    return true;
+}
+
+/**
+ * State of one client thread of a QueueScalingTest.
+ */
+struct ProducerState {
+    KVStore          *tut;
+    volatile bool    *stop;
+    CountingCallback *cb;
+    long              ops;
+};
+
+static void *run_producer(void *arg) {
+    ProducerState *ps = static_cast<ProducerState*>(arg);
+    // Don't let the queue grow without bound.
+    const long window = 10000;
+    while (!*ps->stop) {
+        if (ps->ops - ps->cb->num_calls() >= window) {
+            sched_yield();
+            continue;
+        }
+        ps->tut->noop(*ps->cb);
+        ps->ops++;
+    }
+    RememberingCallback<bool> cbLast;
+    ps->tut->noop(cbLast);
+    cbLast.waitForValue();
+    return NULL;
+}
+
+bool QueueScalingTest::run(KVStore *tut) {
+    const int duration = 2;
+    const int max_threads = 8;
+
+    std::cout << std::endl << "# threads\tops/s\tops/s/thread" << std::endl;
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        volatile bool stop = false;
+        std::vector<pthread_t> threads(nthreads);
+        std::vector<ProducerState> states(nthreads);
+        std::vector<CountingCallback*> cbs;
+
+        for (int i = 0; i < nthreads; i++) {
+            ProducerState &ps = states[i];
+            ps.tut = tut;
+            ps.stop = &stop;
+            ps.cb = new CountingCallback();
+            ps.ops = 0;
+            cbs.push_back(ps.cb);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            if (pthread_create(&threads[i], NULL, run_producer,
+                               &states[i]) != 0) {
+                throw std::runtime_error("Error starting producer thread.");
+            }
+        }
+        sleep(duration);
+        stop = true;
+
+        long ops = 0, done = 0;
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            ops += states[i].ops;
+            done += cbs[i]->num_calls();
+            delete cbs[i];
+        }
+        assertEquals((int)ops, (int)done);
+
+        std::cout << nthreads << "\t" << (ops / duration)
+                  << "\t" << (ops / duration / nthreads) << std::endl;
+    }
+    return true;
+}
+
+/**
+ * Batch test's rate of single sets (batch == 0), or of sets of the
+ * given batch size, over the given keys.
+ */
+static double batch_set_rate(KVStore *tut, std::vector<KeyValue> &items,
+                             size_t batch, uint64_t usecs) {
+    uint64_t start = now_usec(), end = start + usecs, now;
+    size_t i = 0;
+    long ops = 0;
+    std::vector<KeyValue> b;
+    do {
+        if (batch == 0) {
+            RememberingCallback<bool> cb;
+            KeyValue &kv = items[i++ % items.size()];
+            tut->set(kv.key, kv.value, cb);
+            cb.waitForValue();
+            ops++;
+        } else {
+            b.clear();
+            for (size_t j = 0; j < batch; j++) {
+                b.push_back(items[i++ % items.size()]);
+            }
+            RememberingCallback<std::vector<bool> > cb;
+            tut->setMulti(b, cb);
+            cb.waitForValue();
+            ops += (long)batch;
+        }
+    } while ((now = now_usec()) < end);
+    return (double)ops * 1000000.0 / (double)(now - start);
+}
+
+/**
+ * As batch_set_rate(), for gets.
+ */
+static double batch_get_rate(KVStore *tut, std::vector<std::string> &keys,
+                             size_t batch, uint64_t usecs) {
+    uint64_t start = now_usec(), end = start + usecs, now;
+    size_t i = 0;
+    long ops = 0;
+    std::vector<std::string> b;
+    do {
+        if (batch == 0) {
+            RememberingCallback<GetValue> cb;
+            tut->get(keys[i++ % keys.size()], cb);
+            cb.waitForValue();
+            ops++;
+        } else {
+            b.clear();
+            for (size_t j = 0; j < batch; j++) {
+                b.push_back(keys[i++ % keys.size()]);
+            }
+            RememberingCallback<std::vector<GetValue> > cb;
+            tut->getMulti(b, cb);
+            cb.waitForValue();
+            ops += (long)batch;
+        }
+    } while ((now = now_usec()) < end);
+    return (double)ops * 1000000.0 / (double)(now - start);
+}
+
+bool BatchTest::run(KVStore *tut) {
+    const uint64_t usecs = 1000000;
+    const size_t nkeys = 10000;
+    const size_t sizes[] = { 1, 10, 100, 1000 };
+    std::vector<KeyValue> items;
+    std::vector<std::string> keys;
+
+    for (size_t i = 0; i < nkeys; i++) {
+        std::stringstream kStream;
+        std::stringstream vStream;
+        kStream << "batchKey" << i;
+        vStream << "batchValue" << i;
+        items.push_back(KeyValue(kStream.str(), vStream.str()));
+        keys.push_back(kStream.str());
+    }
+
+    double setBase = batch_set_rate(tut, items, 0, usecs);
+    double getBase = batch_get_rate(tut, keys, 0, usecs);
+
+    std::cout << std::endl << "# batch\tset ops/s\tspeedup"
+              << "\tget ops/s\tspeedup" << std::endl;
+    std::cout << "single\t" << (long)setBase << "\t1\t"
+              << (long)getBase << "\t1" << std::endl;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        double setRate = batch_set_rate(tut, items, sizes[s], usecs);
+        double getRate = batch_get_rate(tut, keys, sizes[s], usecs);
+        std::cout << sizes[s] << "\t" << (long)setRate
+                  << "\t" << (setRate / setBase)
+                  << "\t" << (long)getRate
+                  << "\t" << (getRate / getBase) << std::endl;
+    }
+
+    // Every key has been written by now: check what comes back.
+    RememberingCallback<std::vector<bool> > setCb;
+    tut->setMulti(items, setCb);
+    setCb.waitForValue();
+    assertEquals((int)nkeys, (int)setCb.val.size());
+    for (size_t i = 0; i < nkeys; i++) {
+        assertTrue(setCb.val[i], "Failed to set value in batch.");
+    }
+
+    RememberingCallback<std::vector<GetValue> > getCb;
+    tut->getMulti(keys, getCb);
+    getCb.waitForValue();
+    assertEquals((int)nkeys, (int)getCb.val.size());
+    for (size_t i = 0; i < nkeys; i++) {
+        assertTrue(getCb.val[i].success, "Expected success getting value.");
+        assertEquals(getCb.val[i].value, items[i].value);
+    }
+
+    RememberingCallback<std::vector<bool> > delCb;
+    tut->delMulti(keys, delCb);
+    delCb.waitForValue();
+    for (size_t i = 0; i < nkeys; i++) {
+        assertTrue(delCb.val[i], "Failed to delete value in batch.");
+    }
+
+    RememberingCallback<std::vector<GetValue> > getCb2;
+    tut->getMulti(keys, getCb2);
+    getCb2.waitForValue();
+    for (size_t i = 0; i < nkeys; i++) {
+        assertFalse(getCb2.val[i].success, "Expected failure after delete.");
+    }
+    return true;
+}
+
+bool FlushTest::run(KVStore *tut) {
+    const size_t nkeys = 100000;
+    const size_t nchecked = 100;
+    Keys keys(nkeys);
+    std::string value(100, 'v');
+    CountingCallback cb;
+
+    uint64_t start = now_usec();
+    tut->begin();
+    for (size_t i = 0; i < nkeys; i++) {
+        std::string key(keys.nextKey());
+        tut->set(key, value, cb);
+    }
+    RememberingCallback<bool> cbLast;
+    tut->noop(cbLast);
+    cbLast.waitForValue();
+    tut->commit();
+    uint64_t usecs = now_usec() - start;
+
+    assertEquals((int)nkeys, cb.num_calls());
+    for (size_t i = 0; i < nchecked; i++) {
+        std::string key(keys.nextKey());
+        RememberingCallback<GetValue> getCb;
+        tut->get(key, getCb);
+        getCb.waitForValue();
+        assertTrue(getCb.val.success, "Expected success getting value.");
+        assertEquals(value, getCb.val.value);
+    }
+
+    std::cout << std::endl << "# flush\titems\tusec\titems/s" << std::endl
+              << "random\t" << nkeys << "\t" << usecs << "\t"
+              << (long)((double)nkeys * 1000000.0 / (double)(usecs ? usecs : 1))
+              << std::endl;
+    return true;
+}
+
+/**
+ * A pipeline test client: sets its key, reads it back once that's
+ * done (checking the value), and goes round again until stopped.
+ * Each step is a continuation, so any number of these can be in
+ * flight on one thread.
+ */
+class RoundTripClient {
+public:
+    RoundTripClient(Pipeline &p, std::string k, std::string &v, bool &s)
+        : ops(0), failures(0), pipeline(p), key(k), value(v), stop(s) {
+        setDone.owner = this;
+        gotValue.owner = this;
+    }
+
+    void start() {
+        pipeline.set(key, value, setDone);
+    }
+
+    long ops;
+    int  failures;
+
+private:
+
+    class SetDone : public Callback<bool> {
+    public:
+        void callback(bool &ok) {
+            owner->afterSet(ok);
+        }
+        RoundTripClient *owner;
+    };
+
+    class GotValue : public Callback<GetValue> {
+    public:
+        void callback(GetValue &v) {
+            owner->afterGet(v);
+        }
+        RoundTripClient *owner;
+    };
+
+    void afterSet(bool ok) {
+        ops++;
+        if (!ok) {
+            failures++;
+        }
+        pipeline.get(key, gotValue);
+    }
+
+    void afterGet(GetValue &v) {
+        ops++;
+        if (!v.success || v.value != value) {
+            failures++;
+        }
+        if (!stop) {
+            start();
+        }
+    }
+
+    Pipeline    &pipeline;
+    std::string  key;
+    std::string &value;
+    bool        &stop;
+    SetDone      setDone;
+    GotValue     gotValue;
+};
+
+bool PipelineTest::run(KVStore *tut) {
+    const uint64_t usecs = 1000000;
+    const size_t max_depth = 4096;
+    std::string value("pipelined value");
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < max_depth; i++) {
+        std::stringstream ss;
+        ss << "pipeline key " << i;
+        keys.push_back(ss.str());
+    }
+
+    std::cout << std::endl << "# depth\tround trip ops/s\tsets/s"
+              << std::endl;
+    for (size_t depth = 1; depth <= max_depth; depth *= 4) {
+        // Clients chaining set, get, set..., resumed on this thread.
+        long ops = 0;
+        int failures = 0;
+        uint64_t start = now_usec(), end = start + usecs, elapsed;
+        {
+            Pipeline p(tut, depth);
+            bool stop = false;
+            std::vector<RoundTripClient*> clients;
+            for (size_t i = 0; i < depth; i++) {
+                clients.push_back(new RoundTripClient(p, keys[i], value, stop));
+                clients[i]->start();
+            }
+            while (now_usec() < end) {
+                p.poll(true);
+            }
+            stop = true;
+            p.drain();
+            elapsed = now_usec() - start;
+            for (size_t i = 0; i < depth; i++) {
+                ops += clients[i]->ops;
+                failures += clients[i]->failures;
+                delete clients[i];
+            }
+        }
+        assertEquals(0, failures);
+        double roundTrips = (double)ops * 1000000.0 / (double)elapsed;
+
+        // Plain sets, resumed wherever they complete.
+        CountingCallback cb;
+        long sets = 0;
+        start = now_usec();
+        end = start + usecs;
+        {
+            Pipeline p(tut, depth, true);
+            do {
+                for (int i = 0; i < 256; i++, sets++) {
+                    p.set(keys[(size_t)sets % depth], value, cb);
+                }
+            } while (now_usec() < end);
+            p.drain();
+            elapsed = now_usec() - start;
+        }
+        assertEquals((int)sets, cb.num_calls());
+        assertEquals(0, cb.num_failed());
+
+        std::cout << depth << "\t" << (long)roundTrips << "\t"
+                  << (long)((double)sets * 1000000.0 / (double)elapsed)
+                  << std::endl;
+    }
+    return true;
+}
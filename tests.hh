@@ -44,6 +44,50 @@ public:
     std::string name() { return "test test"; }
 };
 
+/**
+ * Drives many operations at once through futures, waiting on all of
+ * them or on whichever completes first.
+ */
+class FutureTest : public kvtest::Test {
+public:
+    virtual ~FutureTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "future test"; }
+};
+
+/**
+ * Starts a run of dependent operations on a couple of keys without
+ * waiting in between, and checks each saw the ones before it.
+ */
+class OrderTest : public kvtest::Test {
+public:
+    virtual ~OrderTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "order test"; }
+};
+
+/**
+ * Checks incr/decr, append/prepend and CAS.
+ */
+class MutationTest : public kvtest::Test {
+public:
+    virtual ~MutationTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "mutation test"; }
+};
+
+/**
+ * Checks items set with a TTL go away (and nothing else does).
+ *
+ * Only meaningful for stores that expire items.
+ */
+class ExpiryTest : public kvtest::Test {
+public:
+    virtual ~ExpiryTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "expiry test"; }
+};
+
 /**
  * A test of write efficiency.
  */
@@ -64,4 +108,68 @@ public:
     std::string name() { return "endurance test"; }
 };
 
+/**
+ * Read throughput as the number of reader threads grows.
+ *
+ * The store must be safe to call from several threads at once.
+ */
+class ReadScalingTest : public kvtest::Test {
+public:
+    virtual ~ReadScalingTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "read scaling test"; }
+};
+
+/**
+ * Throughput of noops as the number of client threads grows.
+ *
+ * A noop does nothing in the store, so for an async store this is
+ * the cost of getting operations through its queue.  The store must
+ * be safe to call from several threads at once.
+ */
+class QueueScalingTest : public kvtest::Test {
+public:
+    virtual ~QueueScalingTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "queue scaling test"; }
+};
+
+/**
+ * Throughput of batch sets and gets at several batch sizes, against
+ * single operations.
+ */
+class BatchTest : public kvtest::Test {
+public:
+    virtual ~BatchTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "batch test"; }
+};
+
+/**
+ * Throughput of writing out a lot of keys in random order.
+ *
+ * Committing at the end waits for a write-back store to persist
+ * them, so comparing its stats across flush policies shows what the
+ * write order costs the underlying store.
+ */
+class FlushTest : public kvtest::Test {
+public:
+    virtual ~FlushTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "flush test"; }
+};
+
+/**
+ * Throughput of one thread keeping operations in flight through a
+ * pipeline, at several depths: clients chaining a set and a get
+ * (resumed on the test's thread), and plain sets (resumed on
+ * whichever thread completes them).
+ */
+class PipelineTest : public kvtest::Test {
+public:
+    virtual ~PipelineTest() {}
+    bool run(kvtest::KVStore *tut);
+    std::string name() { return "pipeline test"; }
+};
+
 #endif /* TESTS_H */
@@ -27,10 +27,15 @@ void TokyoStore::reset() {
 
 void TokyoStore::set(std::string &key, std::string &val,
                    Callback<bool> &cb) {
+  set(key, val.c_str(), cb);
+}
+
+void TokyoStore::set(std::string &key, const char *val,
+                   Callback<bool> &cb) {
   bool rv = true;
   //int ecode;
 
-  if (!tchdbput2(hdb, key.c_str(), val.c_str())) {
+  if (!tchdbput2(hdb, key.c_str(), val)) {
     /*
       ecode = tchdbecode(hdb);
       char errmsg[ERRSTR_SIZE];
@@ -70,7 +75,7 @@ void TokyoStore::get(std::string &key, Callback<GetValue> &cb) {
 
 void TokyoStore::del(std::string &key, Callback<bool> &cb) {
   bool rv = true;
-  if (!tchdbout(hdb, key.c_str(), key.length()))
+  if (!tchdbout(hdb, key.c_str(), (int)key.length()))
   {
     rv = false;
   }
@@ -78,6 +83,63 @@ void TokyoStore::del(std::string &key, Callback<bool> &cb) {
   cb.callback(rv);
 }
 
+void TokyoStore::setMulti(std::vector<KeyValue> &items,
+                          Callback<std::vector<bool> > &cb) {
+  std::vector<bool> rv(items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    rv[i] = tchdbput2(hdb, items[i].key.c_str(), items[i].value.c_str());
+  }
+  if (autocommit) {
+      tchdbsync(hdb);
+  }
+  cb.callback(rv);
+}
+
+void TokyoStore::getMulti(std::vector<std::string> &keys,
+                          Callback<std::vector<GetValue> > &cb) {
+  std::vector<GetValue> rv(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    char *value = tchdbget2(hdb, keys[i].c_str());
+    if (value) {
+      rv[i].value.assign(value);
+      rv[i].success = true;
+      free(value);
+    } else {
+      rv[i].value = ":(";
+      rv[i].success = false;
+    }
+  }
+  cb.callback(rv);
+}
+
+void TokyoStore::delMulti(std::vector<std::string> &keys,
+                          Callback<std::vector<bool> > &cb) {
+  std::vector<bool> rv(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    rv[i] = tchdbout(hdb, keys[i].c_str(), (int)keys[i].length());
+  }
+  cb.callback(rv);
+}
+
+void TokyoStore::dump(Callback<KeyValue> &cb, size_t slice, size_t nslices) {
+  if (!tchdbiterinit(hdb)) {
+    throw std::runtime_error("Error starting iteration.");
+  }
+
+  char *key;
+  for (size_t i = 0; (key = tchdbiternext2(hdb)) != NULL; i++) {
+    if (i % nslices == slice) {
+      char *value = tchdbget2(hdb, key);
+      if (value) {
+        kvtest::KeyValue kv(key, value);
+        cb.callback(kv);
+        free(value);
+      }
+    }
+    free(key);
+  }
+}
+
 void TokyoStore::open() {
     int ecode;
     int flags = HDBOWRITER | HDBOCREAT | HDBOTSYNC;